@@ -0,0 +1,212 @@
+#!/bin/bash
+#========================================================
+# End to end comparison on the bundled example VCF. Every
+# case runs vikNGS in two ways that must write the same
+# p-values and filtered variants:
+#   the same seed twice, also with one more VCF header line;
+#   1 and 4 threads, also for expected genotypes of a
+#   case-control phenotype;
+#   bootstrap batches of 1, 7 and of the default size;
+#   3 shards merged and the whole VCF;
+#   the exports of 3 shards and of the whole VCF recomputed;
+#   a run killed after its first checkpoint and resumed,
+#   and a run that was not interrupted.
+# The common test of called genotypes, at the default
+# filters, must also write the p-values of the baseline.
+# Asymptotic CAST, SKAT and C-alpha of single variants must
+# give p-values in [0, 1] that agree with each other.
+# A traced run must also hold EM and CQF spans, and a run
+# with perf counters, hardware or software, must count EM
+# and CQF and write the same p-values.
+#
+# Usage, from bin after make: ./compare.sh [vikNGS binary]
+# Exits with 1 if any case differs.
+#========================================================
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+VIKNGS=${1:-$BIN/vikNGS}
+VCF=$BIN/../example/example.vcf
+INFO=$BIN/../example/example_info.txt
+FILTERS="-m 0.5 -x 0.5"
+REFERENCE=$BIN/../example/example_call_pvalues.txt
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+#run <output dir> <options>: runs vikNGS on the example into a new directory of WORK
+run(){
+    local dir=$WORK/$1
+    shift
+    mkdir -p "$dir"
+    "$VIKNGS" "$VCF" "$INFO" $FILTERS "$@" -o "$dir" > "$dir.log" 2>&1
+}
+
+#defaults <output dir> <options>: same as run, at the default filters
+defaults(){
+    local FILTERS=""
+    run "$@"
+}
+
+#same <case> <dir> <dir>: both runs wrote p-values, and the same ones
+same(){
+    local a=$WORK/$2 b=$WORK/$3
+    if [ -s "$(echo $a/pvalues*)" ] && cmp -s $a/pvalues* $b/pvalues* && cmp -s $a/filtered* $b/filtered*; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1"
+        FAILED=1
+    fi
+}
+
+#windows of 3500 bp every 4000 bp over the example, so sets along the BED file are tested too
+BED=$WORK/windows.bed
+grep -v "^#" "$VCF" | awk -F'\t' 'NR == 1 || $2 < lo { lo = $2 } $2 > hi { hi = $2; chr = $1 }
+    END { n = 0; for(s = lo - lo % 4000; s <= hi; s += 4000) print chr "\t" s "\t" s + 3500 "\tW" n++ }' > "$BED"
+
+echo "Comparing outputs of $VIKNGS"
+
+# -------------------------------------
+run seed1 -r cast -k 3 -n 200 --seed 7 -t 4
+run seed2 -r cast -k 3 -n 200 --seed 7 -t 4
+same "same seed" seed1 seed2
+
+#the draws of a set are keyed by its variants, not by where it starts in the file
+awk 'NR == 2 { print "##source=compare.sh" } { print }' "$VCF" > "$WORK/header.vcf"
+VCF=$WORK/header.vcf run seed3 -r cast -k 3 -n 200 --seed 7 -t 4
+same "same seed, VCF with one more header line" seed1 seed3
+
+# -------------------------------------
+run threads1 -r skat -k 4 -n 100 --seed 7 -a 20 -t 1
+run threads4 -r skat -k 4 -n 100 --seed 7 -a 20 -t 4
+same "1 vs 4 threads" threads1 threads4
+
+# -------------------------------------
+#at the default filters samples with a missing call are left out of the common test of a variant,
+#and the p-values of the 1 and 4 thread runs must be those of the baseline
+defaults call1 -g call -t 1
+defaults call4 -g call -t 4
+same "called genotypes, default filters, 1 vs 4 threads" call1 call4
+if [ -s "$(echo $WORK/call1/pvalues*)" ] && cmp -s "$REFERENCE" $WORK/call1/pvalues*; then
+    echo "PASS called genotypes, default filters, vs baseline p-values"
+else
+    echo "FAIL called genotypes, default filters, vs baseline p-values"
+    FAILED=1
+fi
+
+# -------------------------------------
+#rare tests without bootstrap and without collapsing: every set is one variant, where CAST, SKAT
+#and C-alpha reduce to the same 1 df score test
+for rare in cast skat calpha; do
+    run single_$rare -g call -r $rare
+done
+if [ -s "$(echo $WORK/single_cast/pvalues*)" ] &&
+   paste $WORK/single_cast/pvalues* $WORK/single_skat/pvalues* $WORK/single_calpha/pvalues* | awk -F'\t' '
+    function off(a, b) { return (a > b ? a - b : b - a) > 1e-3 * (a > b ? a : b) + 1e-5 }
+    $1 != $7 || $2 != $8 || $1 != $13 || $2 != $14 || !($5 >= 0 && $5 <= 1) || off($5, $11) || off($5, $17) { bad = 1 }
+    END { exit bad }'; then
+    echo "PASS asymptotic rare tests of single variants"
+else
+    echo "FAIL asymptotic rare tests of single variants"
+    FAILED=1
+fi
+
+# -------------------------------------
+#genotype calls take the batched bootstrap, see bootstrapChunk
+for rare in cast skat calpha; do
+    run serial_$rare -g call -r $rare -k 4 -n 300 --seed 7 -t 2 --boot-batch 1
+    run batched_$rare -g call -r $rare -k 4 -n 300 --seed 7 -t 2
+    run odd_$rare -g call -r $rare -k 4 -n 300 --seed 7 -t 2 --boot-batch 7
+    same "serial vs batched bootstrap ($rare)" serial_$rare batched_$rare
+    same "batches of 7 vs default ($rare)" odd_$rare batched_$rare
+done
+
+# -------------------------------------
+#expected genotypes of a case-control phenotype are bootstrapped one iteration at a time,
+#see TestObject::canBootstrapBatch
+for rare in cast skat; do
+    run exp1_$rare -g exp -r $rare -k 4 -n 200 --seed 7 -t 1 --boot-batch 1
+    run exp4_$rare -g exp -r $rare -k 4 -n 200 --seed 7 -t 4
+    same "expected genotypes, case-control, 1 vs 4 threads ($rare)" exp1_$rare exp4_$rare
+done
+
+# -------------------------------------
+shards(){
+    local name=$1
+    shift
+    run whole_$name "$@"
+    for i in 1 2 3; do
+        run shard${i}_$name "$@" --shard $i/3
+    done
+    mkdir -p "$WORK/merged_$name"
+    "$VIKNGS" merge $WORK/shard1_$name/shard_*.txt $WORK/shard2_$name/shard_*.txt $WORK/shard3_$name/shard_*.txt \
+        -o "$WORK/merged_$name" > "$WORK/merged_$name.log" 2>&1
+    same "3 shards merged vs whole VCF ($name)" whole_$name merged_$name
+}
+
+shards single -r cast -n 100 --seed 7 -t 2
+shards collapse -r skat -k 4 -n 50 --seed 7 -a 37 -t 2
+shards bed -b "$BED" --gene 1 -k 5 -r cast -n 50 --seed 7 -a 7 -t 2
+
+# -------------------------------------
+#summary statistics of the shards recomputed together, shards 2 and 3 skip the lines before them
+run export_whole -r cast -n 1 --seed 7 -t 2 --export "$WORK/export_whole.bin"
+for i in 1 2 3; do
+    run export_shard$i -r cast -n 1 --seed 7 -t 2 --export "$WORK/export_shard$i.bin" --shard $i/3
+done
+mkdir -p "$WORK/recompute_whole" "$WORK/recompute_shards"
+"$VIKNGS" recompute "$WORK/export_whole.bin" -r cast -o "$WORK/recompute_whole" > "$WORK/recompute_whole.log" 2>&1
+"$VIKNGS" recompute "$WORK/export_shard3.bin" "$WORK/export_shard1.bin" "$WORK/export_shard2.bin" -r cast \
+    -o "$WORK/recompute_shards" > "$WORK/recompute_shards.log" 2>&1
+if [ -s "$(echo $WORK/recompute_whole/pvalues*)" ] && cmp -s $WORK/recompute_whole/pvalues* $WORK/recompute_shards/pvalues*; then
+    echo "PASS 3 shards exported and recomputed vs whole VCF"
+else
+    echo "FAIL 3 shards exported and recomputed vs whole VCF"
+    FAILED=1
+fi
+
+# -------------------------------------
+#per variant and per set spans are sampled, not left out
+run trace -r skat -k 4 -n 100 --seed 7 -t 2 --trace "$WORK/trace.json"
+if grep -q '"name":"EM"' "$WORK/trace.json" && grep -q '"name":"CQF"' "$WORK/trace.json"; then
+    echo "PASS trace has EM and CQF spans"
+else
+    echo "FAIL trace has EM and CQF spans"
+    FAILED=1
+fi
+
+# -------------------------------------
+#hosts without a PMU count the software events, so this runs in CI too
+run perf -r skat -k 4 -n 100 --seed 7 -a 20 -t 4 --perf-counters
+if grep -q "counters of the kernels" "$WORK/perf.log" && grep -qE "EM: .* over [1-9]" "$WORK/perf.log" &&
+   grep -qE "CQF: .* over [1-9]" "$WORK/perf.log"; then
+    same "perf counters vs none" threads4 perf
+else
+    echo "FAIL perf counters count EM and CQF"
+    FAILED=1
+fi
+
+# -------------------------------------
+#enough bootstrap iterations that the run is still going when its first checkpoint is written
+RESUME="-r cast -k 3 -n 20000 --seed 7 -a 20 -t 2"
+run uninterrupted $RESUME
+
+mkdir -p "$WORK/resumed"
+"$VIKNGS" "$VCF" "$INFO" $FILTERS $RESUME --checkpoint 1 -o "$WORK/resumed" > "$WORK/resumed.log" 2>&1 &
+PID=$!
+while kill -0 $PID 2> /dev/null && [ ! -f "$WORK/resumed/checkpoint.txt" ]; do
+    sleep 0.1
+done
+kill -9 $PID 2> /dev/null
+wait $PID 2> /dev/null
+
+if [ -f "$WORK/resumed/checkpoint.txt" ]; then
+    #the seed comes from the checkpoint
+    "$VIKNGS" "$VCF" "$INFO" $FILTERS -r cast -k 3 -n 20000 -a 20 -t 2 --resume \
+        -o "$WORK/resumed" >> "$WORK/resumed.log" 2>&1
+    same "resumed vs uninterrupted" uninterrupted resumed
+else
+    echo "SKIP resumed vs uninterrupted (the run ended before its first checkpoint)"
+fi
+
+exit $FAILED
@@ -0,0 +1,123 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//========================================================
+// Bounded queue connecting two pipeline stages. push blocks
+// while the queue is full and pop while it is empty, so a
+// stage sleeps instead of polling when it has nothing to do.
+//========================================================
+
+template <typename T>
+class BlockingQueue {
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+    std::mutex lock;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+
+public:
+
+    BlockingQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) { }
+
+    /*
+    Adds an item, waiting for space if the queue is full.
+
+    @param item Item to add.
+    @return false if the queue was closed, in which case the item is dropped.
+    */
+    inline bool push(T item){
+        std::unique_lock<std::mutex> guard(lock);
+        notFull.wait(guard, [this]{ return closed || items.size() < capacity; });
+        if(closed)
+            return false;
+
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /*
+    Removes the oldest item, waiting for one if the queue is empty.
+
+    @param item Receives the item.
+    @return false once the queue is closed and every item has been taken.
+    */
+    inline bool pop(T& item){
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait(guard, [this]{ return !items.empty() || closed; });
+        if(items.empty())
+            return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    inline size_t size(){
+        std::lock_guard<std::mutex> guard(lock);
+        return items.size();
+    }
+
+    //no more items will be pushed, items already queued can still be taken
+    inline void close(){
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    //closes the queue and drops its items
+    inline void abort(){
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        items.clear();
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+//========================================================
+// Limits the number of batches a stage has in flight. The
+// stage takes a slot before submitting work and the next
+// stage gives it back once it has taken the result.
+//========================================================
+
+class StageSlots {
+private:
+    size_t available;
+    bool aborted;
+    std::mutex lock;
+    std::condition_variable released;
+
+public:
+
+    StageSlots(size_t slots) : available(slots > 0 ? slots : 1), aborted(false) { }
+
+    //waits for a free slot, false once aborted
+    inline bool acquire(){
+        std::unique_lock<std::mutex> guard(lock);
+        released.wait(guard, [this]{ return aborted || available > 0; });
+        if(aborted)
+            return false;
+
+        available--;
+        return true;
+    }
+
+    inline void release(){
+        std::lock_guard<std::mutex> guard(lock);
+        available++;
+        released.notify_one();
+    }
+
+    inline void abort(){
+        std::lock_guard<std::mutex> guard(lock);
+        aborted = true;
+        released.notify_all();
+    }
+};
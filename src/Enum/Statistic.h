@@ -1,8 +1,9 @@
 #pragma once
 
-enum class Statistic { NONE, COMMON, CAST, SKAT, CALPHA };
+enum class Statistic { NONE, COMMON, CAST, SKAT, CALPHA, SKATO };
 
 inline bool isRare(Statistic s) {
     return s == Statistic::CAST      ||
             s == Statistic::SKAT     ||
-            s == Statistic::CALPHA;}
+            s == Statistic::CALPHA   ||
+            s == Statistic::SKATO;}
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <cstdint>
 #include "Statistic.h"
 #include "GenotypeSource.h"
 #include "Variance.h"
@@ -11,7 +12,16 @@ private:
     Variance variance;
     int nboot = -1;
     int nsamples = -1;
+    int bootBatch = 64;
+    int stopHits = 10;
+    double daviesThreshold = 0.05;
+    double daviesAccuracy = 1e-4;
+    int daviesLimit = 10000;
+    uint64_t seed = 0;
+    int index = 0;
+    int phenotype = 0;
     bool earlyStopping = false;
+    bool saddlepoint = false;
 
 public:
     TestSettings(GenotypeSource g, Statistic s, Variance v, int nbootstrap=-1, int nsamples=-1) : genotype(g), statistic(s), variance(v){
@@ -28,6 +38,15 @@ public:
     inline void setRegularVariance(){ variance = Variance::REGULAR; }
     inline void setGenotype(GenotypeSource gt){ genotype=gt; }
     inline void setEarlyStopping(bool value) { earlyStopping = value; }
+    inline void setSaddlepoint(bool value) { saddlepoint = value; }
+    inline void setBootstrapBatchSize(int size) { bootBatch = size; }
+    inline void setStopHits(int hits) { stopHits = hits; }
+    inline void setDaviesThreshold(double threshold) { daviesThreshold = threshold; }
+    inline void setDaviesAccuracy(double accuracy) { daviesAccuracy = accuracy; }
+    inline void setDaviesLimit(int limit) { daviesLimit = limit; }
+    inline void setSeed(uint64_t value) { seed = value; }
+    inline void setIndex(int i) { index = i; }
+    inline void setPhenotype(int i) { phenotype = i; }
 
     inline bool needVCFCalls(){ return genotype == GenotypeSource::VCF_CALL; }
     inline bool needGenotypeCalls(){ return genotype == GenotypeSource::CALL; }
@@ -35,13 +54,28 @@ public:
     inline bool isExpectedGenotypes(){ return genotype == GenotypeSource::EXPECTED; }
     inline bool isBootstrap(){ return nboot>1; }
 
+    //tests on the same genotypes, variance and samples can be evaluated on one test object
+    inline bool sharesTestObject(TestSettings& other){
+        return genotype == other.genotype && variance == other.variance && isRareTest() == other.isRareTest() &&
+                nsamples == other.nsamples && phenotype == other.phenotype;
+    }
+
     inline GenotypeSource getGenotype(){ return genotype; }
     inline Statistic getStatistic(){ return statistic; }
     inline Variance getVariance(){ return variance; }
 
     inline int getSampleSize(){ return nsamples; }
     inline int getBootstrapSize(){ return nboot; }
+    inline int getBootstrapBatchSize(){ return bootBatch; }
+    inline int getStopHits(){ return stopHits; }
+    inline double getDaviesThreshold(){ return daviesThreshold; }
+    inline double getDaviesAccuracy(){ return daviesAccuracy; }
+    inline int getDaviesLimit(){ return daviesLimit; }
+    inline uint64_t getSeed(){ return seed; }
+    inline int getIndex(){ return index; }
+    inline int getPhenotype(){ return phenotype; }
     inline bool useEarlyStopping(){ return earlyStopping; }
+    inline bool useSaddlepoint(){ return saddlepoint; }
 
     inline std::string toString(){
         std::string part1, part2;
@@ -62,6 +96,7 @@ public:
             case Statistic::CAST : part2 = "CAST"; break;
             case Statistic::SKAT : part2 = "SKAT"; break;
             case Statistic::CALPHA : part2 = "Calpha"; break;
+            case Statistic::SKATO : part2 = "SKAT-O"; break;
             default: part2 = "???"; break;
         }
 
@@ -86,6 +121,7 @@ public:
             case Statistic::CAST : part2 = "CAST"; break;
             case Statistic::SKAT : part2 = "SKAT"; break;
             case Statistic::CALPHA : part2 = "Calpha"; break;
+            case Statistic::SKATO : part2 = "SKAT-O"; break;
 
             default: return "???";
         }
@@ -1,3 +1,7 @@
 #include "vikNGS.h"
 
 bool STOP_RUNNING_THREAD = false;
+ThreadPool* THREAD_POOL = nullptr;
+SummaryWriter* SUMMARY_WRITER = nullptr;
+Tracer* TRACER = nullptr;
+PerfCounters* PERF_COUNTERS = nullptr;
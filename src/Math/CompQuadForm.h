@@ -12,8 +12,7 @@
 
 #include "Math.h"
 
-#include <setjmp.h>
-#include <iostream>
+#include <vector>
 #define UseDouble 0             /* all floating point double */
 
 #define TRUE_  1
@@ -23,13 +22,14 @@ typedef int BOOL;
 #define pi 3.14159265358979
 #define log28 0.0866  /*  log(2.0) / 8.0  */
 
+//The workspace is reused between calls, so a single CQF should be kept per thread
+//rather than constructed for every p-value.
 struct CQF {
 private:
     double sigsq, lmax, lmin, mean, c;
     double intl, ersm;
-    int count, r, lim;  BOOL ndtsrt, fail;
-    int *th; double *lb, *nc;
-    jmp_buf env;
+    int count, r, lim;  BOOL ndtsrt, fail, exceeded;
+    std::vector<int> th; const double *lb;
 
     inline double exp1(double x)               /* to avoid underflows  */
     {
@@ -37,10 +37,11 @@ private:
     }
 
     inline void counter(void)
-        /*  count number of calls to errbd, truncation, cfe */
+        /*  count number of calls to errbd, truncation, cfe,
+        once over the limit every caller unwinds and qfc gives up */
     {
         count = count + 1;
-        if (count > lim) longjmp(env, 1);
+        if (count > lim) exceeded = TRUE_;
     }
 
     inline double square(double x) { return x * x; }
@@ -94,6 +95,7 @@ private:
     {
         double sum1, lj, x, y, xconst; int j;
         counter();
+        if (exceeded) { *cx = mean; return 0.0; }
         xconst = u * sigsq;  sum1 = u * xconst;  u = 2.0 * u;
         for (j = r - 1; j >= 0; j--)
         {
@@ -112,12 +114,12 @@ private:
         double u1, u2, u, rb, xconst, c1, c2;
         u2 = *upn;   u1 = 0.0;  c1 = mean;
         rb = 2.0 * ((u2 > 0.0) ? lmax : lmin);
-        for (u = u2 / (1.0 + u2 * rb); errbd(u, &c2) > accx;
+        for (u = u2 / (1.0 + u2 * rb); errbd(u, &c2) > accx && !exceeded;
             u = u2 / (1.0 + u2 * rb))
         {
             u1 = u2;  c1 = c2;  u2 = 2.0 * u2;
         }
-        for (u = (c1 - mean) / (c2 - mean); u < 0.9;
+        for (u = (c1 - mean) / (c2 - mean); u < 0.9 && !exceeded;
             u = (c1 - mean) / (c2 - mean))
         {
             u = (u1 + u2) / 2.0;
@@ -141,6 +143,7 @@ private:
         int j, s;
 
         counter();
+        if (exceeded) return 0.0;
         sum1 = 0.0; prod2 = 0.0;  prod3 = 0.0;  s = 0;
         sum2 = (sigsq + tausq) * square(u); prod1 = 2.0 * sum2;
         u = 2.0 * u;
@@ -176,12 +179,12 @@ private:
         ut = *utx; u = ut / 4.0;
         if (truncation(u, 0.0) > accx)
         {
-            for (u = ut; truncation(u, 0.0) > accx; u = ut) ut = ut * 4.0;
+            for (u = ut; truncation(u, 0.0) > accx && !exceeded; u = ut) ut = ut * 4.0;
         }
         else
         {
             ut = u;
-            for (u = u / 4.0; truncation(u, 0.0) <= accx; u = u / 4.0)
+            for (u = u / 4.0; truncation(u, 0.0) <= accx && !exceeded; u = u / 4.0)
                 ut = u;
         }
         for (i = 0; i < 4; i++)
@@ -226,6 +229,7 @@ private:
     {
         double axl, axl1, axl2, sxl, sum1, lj; int j, k, t;
         counter();
+        if (exceeded) { fail = TRUE_; return 1.0; }
         if (ndtsrt) order();
         axl = fabs(x);  sxl = (x > 0.0) ? 1.0 : -1.0;  sum1 = 0.0;
         for (j = r - 1; j >= 0; j--)
@@ -256,6 +260,47 @@ private:
 
 
 public:
+    CQF() : count(0), r(0), lim(0), ndtsrt(TRUE_), fail(FALSE_), exceeded(FALSE_), lb(nullptr) { }
+
+    /*
+    Approximates P[Q > q] by matching the first four cumulants of Q to a (non-central)
+    chi-squared distribution (Liu, Tang & Zhang 2009). Much cheaper than qfc but less
+    accurate in the far tail.
+
+    @param lambda Coefficients of the chi-squared variables, all non-negative.
+    @param evalpoint point at which df is to be evaluated.
+    @return P[Q > q], NAN if the coefficients are not all non-negative.
+    */
+    double liu(const std::vector<double>& lambda, double evalpoint) {
+        double c1 = 0, c2 = 0, c3 = 0, c4 = 0;
+        for (double lj : lambda)
+        {
+            if (lj < 0) return NAN;
+            c1 += lj; c2 += square(lj); c3 += cube(lj); c4 += square(square(lj));
+        }
+        if (c3 <= 0) return NAN;
+
+        double s1 = c3 / std::pow(c2, 1.5);
+        double s2 = c4 / square(c2);
+
+        double a, delta, l;
+        if (square(s1) > s2)
+        {
+            a = 1 / (s1 - std::sqrt(square(s1) - s2));
+            delta = s1 * cube(a) - square(a);
+            l = square(a) - 2 * delta;
+        }
+        else
+        {
+            a = 1 / s1; delta = 0; l = 1 / square(s1);
+        }
+
+        double tstar = (evalpoint - c1) / std::sqrt(2 * c2);
+        double x = tstar * std::sqrt(2.0) * a + l + delta;
+
+        return chiSquareUpperTail(x, l, delta);
+    }
+
     /*
     Computes P[Q > q] where Q = sum lambda_j X_j where X_j are independent random variables
     having a non-central chi^2 distribution with 1 degree of freedom and non-centrality
@@ -263,23 +308,24 @@ public:
 
     @param coef A vector with coefficients of j-th chi-squared variable.
     @param evalpoint point at which df is to be evaluated.
-    @return P[Q > q].
+    @param acc Maximum error of the result.
+    @param limit Maximum number of calls to the error bounds, see failed().
+    @return P[Q > q], NAN if the limit was reached.
     */
-    double qfc(std::vector<double> lambda, double evalpoint, int ncoef) {
-        double acc = 1e-04;
-
+    double qfc(const std::vector<double>& lambda, double evalpoint, int ncoef, double acc = 1e-04, int limit = 10000) {
         int j, nt, ntm; double almx, xlim, xnt, xntm;
         double utx, tausq, sd, intv, intv1, x, up, un, d1, d2, lj;
 
         double qfval = -1.0;
 
-        r = ncoef; lim = 10000; c = evalpoint;
-        lb = &lambda[0];
+        r = ncoef; lim = limit; c = evalpoint;
+        lb = lambda.data();
         count = 0;
         intl = 0.0; ersm = 0.0;
-        qfval = -1.0; ndtsrt = TRUE_;  fail = FALSE_;
+        qfval = -1.0; ndtsrt = TRUE_;  fail = FALSE_;  exceeded = FALSE_;
         xlim =  static_cast<double>(lim);
-        th =  static_cast<int *>(malloc( static_cast<size_t>(r)*(sizeof(int))));
+        //only grows, so the workspace ends up sized to the largest set seen
+        if (static_cast<int>(th.size()) < r) th.resize(static_cast<size_t>(r));
 
         /* find mean, sd, max and min of lb,
         check that parameter values are valid */
@@ -304,6 +350,7 @@ public:
         utx = 16.0 / sd;  up = 4.5 / sd;  un = -up;
         /* truncation point with no convergence factor */
         findu(&utx, .5 * acc);
+        if (exceeded) goto endofproc;
         /* does convergence factor help */
         if (c != 0.0 && (almx > 0.07 * sd))
         {
@@ -314,14 +361,17 @@ public:
                 sigsq = sigsq + tausq;
                 findu(&utx, .25 * acc);
             }
+            if (exceeded) goto endofproc;
         }
         acc *= 0.5;
 
         /* find RANGE of distribution, quit if outside this */
     l1:
         d1 = ctff(acc, &up) - c;
+        if (exceeded) goto endofproc;
         if (d1 < 0.0) { qfval = 1.0; goto endofproc; }
         d2 = c - ctff(acc, &un);
+        if (exceeded) goto endofproc;
         if (d2 < 0.0) { qfval = 0.0; goto endofproc; }
         /* find integration interval */
         intv = 2.0 * pi / ((d1 > d2) ? d1 : d2);
@@ -336,6 +386,7 @@ public:
             if (x <= fabs(c)) goto l2;
             /* calculate convergence factor */
             tausq = .33 * acc / (1.1 * (cfe(c - x) + cfe(c + x)));
+            if (exceeded) goto endofproc;
             if (fail) goto l2;
             acc *= .67;
             /* auxillary integration */
@@ -343,6 +394,7 @@ public:
             xlim = xlim - xntm;  sigsq = sigsq + tausq;
             /* find truncation point with new convergence factor */
             findu(&utx, .25 * acc);  acc *= 0.75;
+            if (exceeded) goto endofproc;
             goto l1;
         }
 
@@ -357,9 +409,12 @@ public:
         up = ersm; x = up + acc / 10.0;
 
     endofproc:
-        free((char*)th);
+        if (exceeded) return NAN;
         return std::abs(1 - qfval);
     }
+
+    //true if the last call to qfc needed more than limit terms and returned NAN
+    inline bool failed() { return exceeded == TRUE_; }
 };
 
 
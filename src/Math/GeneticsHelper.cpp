@@ -1,6 +1,8 @@
 #include "Math.h"
 #include <iostream>
 #include "../Test/Group.h"
+#include "../Trace.h"
+#include "../PerfCounters.h"
 
 /**
 Calculates the robust variance of E(G | D). var(x) = E(x^2) - E(x)^2
@@ -88,6 +90,8 @@ Uses EM algorithm to estimate the genotype frequencies in the sample
 @return A vector with probability of 0, 1 or 2 minor alleles.
 */
 Vector3d calculateGenotypeFrequencies(std::vector<Vector3d>& likelihood) {
+    TraceDetail span("EM");
+    PerfScope counters(PerfStage::EM, 1, PERF_EM_SAMPLE);
     double p = 0.15;
     double q = 0.15;
     double qn = 1;
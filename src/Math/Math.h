@@ -5,20 +5,24 @@
 #include <vector>
 #include <map>
 #include <random>
+#include <cstdint>
 
 
 class Group;
+class RandomStream;
 
 //RandomHelper.cpp
+void seedRandom(uint64_t seed);
+uint64_t randomSeed();
 int randomInt(int from, int to);
 double randomDouble(double from, double to);
 double randomNormal(double mean, double sd);
 int randomBinomial(int trials, double success);
-MatrixXd groupwiseShuffleWithReplacement(MatrixXd& M, VectorXi& G, std::map<int, std::vector<int>>& group);
-VectorXd groupwiseShuffleWithReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group);
-VectorXd groupwiseShuffleWithoutReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group);
-MatrixXd shuffleColumnwiseWithoutReplacement(MatrixXd &M);
-VectorXd shuffleWithoutReplacement(VectorXd& V);
+MatrixXd groupwiseShuffleWithReplacement(MatrixXd& M, VectorXi& G, std::map<int, std::vector<int>>& group, RandomStream& rng);
+VectorXd groupwiseShuffleWithReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group, RandomStream& rng);
+VectorXd groupwiseShuffleWithoutReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group, RandomStream& rng);
+MatrixXd shuffleColumnwiseWithoutReplacement(MatrixXd &M, RandomStream& rng);
+VectorXd shuffleWithoutReplacement(VectorXd& V, RandomStream& rng);
 
 //VectorHelper.cpp
 bool hasVariance(VectorXd &v);
@@ -51,6 +55,10 @@ bool readDepthFlip(VectorXd &Y, Group& group, Family family);
 int maxValue(double zero, double one, double two);
 double pnorm(double x);
 double chiSquareOneDOF(double);
+double upperIncompleteGamma(double a, double x);
+double chiSquareUpperTail(double statistic, double df, double noncentrality = 0);
+double chiSquareUpperQuantile(double p, double df);
+double saddlepointPvalue(double score, VectorXd &g, VectorXd &mu);
 MatrixXd covariance(MatrixXd &M);
 MatrixXd correlation(MatrixXd &M);
 MatrixXd calculateHatMatrix(MatrixXd &Z);
@@ -62,7 +70,21 @@ VectorXd fitModel(VectorXd &beta, MatrixXd &Z, Family family);
 inline double sigmoid(VectorXd &x, VectorXd &beta){
     return (1.0 / (1.0 + exp(-(beta.dot(x)))));
 }
+
+//buffers reused by logisticRegression between fits of the same size
+struct IRLSWorkspace {
+    VectorXd eta;
+    VectorXd p;
+    VectorXd residual;
+    VectorXd gradient;
+    VectorXd step;
+    MatrixXd WX;
+    MatrixXd hessian;
+    Eigen::LDLT<MatrixXd> ldlt;
+};
+
 VectorXd logisticRegression(VectorXd &Y, MatrixXd &Z);
+void logisticRegression(VectorXd &Y, MatrixXd &Z, VectorXd &beta, IRLSWorkspace &ws);
 inline VectorXd CovariateNormalRegression(VectorXd &Y, MatrixXd &Z) {
     return Z.householderQr().solve(Y);
 }
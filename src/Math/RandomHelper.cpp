@@ -1,9 +1,21 @@
 #include "Math.h"
+#include "RandomStream.h"
 #include <random>
 
 static std::random_device rd;
 static thread_local std::mt19937 generate(rd());
 
+//reseeds the generator used by the helpers below on the calling thread
+void seedRandom(uint64_t seed) {
+    std::seed_seq seq{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+    generate.seed(seq);
+}
+
+//nondeterministic seed for runs where the user did not pick one
+uint64_t randomSeed() {
+    return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+
 int randomInt(int from, int to) {
     std::uniform_int_distribution<> sample(from, to);
     return sample(generate);
@@ -21,29 +33,29 @@ int randomBinomial(int trials, double success) {
     return sample(generate);
 }
 
-MatrixXd shuffleColumnwiseWithoutReplacement(MatrixXd& M){
+MatrixXd shuffleColumnwiseWithoutReplacement(MatrixXd& M, RandomStream& rng){
 
     MatrixXd shuffled(M.rows(), M.cols());
     VectorXi indices = VectorXi::LinSpaced(M.rows(), 0, M.rows());
     for(int i = 0; i < M.cols(); i++){
-        std::random_shuffle(indices.data(), indices.data() + M.rows());
+        rng.shuffle(indices.data(), M.rows());
         shuffled.col(i) = indices.asPermutation() * M.col(i);
     }
 
     return shuffled;
 }
 
-VectorXd shuffleWithoutReplacement(VectorXd& V){
+VectorXd shuffleWithoutReplacement(VectorXd& V, RandomStream& rng){
 
     VectorXd shuffled(V.rows());
     VectorXi indices = VectorXi::LinSpaced(V.rows(), 0, V.rows());
-    std::random_shuffle(indices.data(), indices.data() + V.rows());
+    rng.shuffle(indices.data(), V.rows());
     shuffled = indices.asPermutation() * V;
 
     return shuffled;
 }
 
-MatrixXd groupwiseShuffleWithReplacement(MatrixXd& M, VectorXi& G, std::map<int, std::vector<int>>& group){
+MatrixXd groupwiseShuffleWithReplacement(MatrixXd& M, VectorXi& G, std::map<int, std::vector<int>>& group, RandomStream& rng){
 
     MatrixXd shuffled(M.rows(), M.cols());
     int g, rand;
@@ -51,7 +63,7 @@ MatrixXd groupwiseShuffleWithReplacement(MatrixXd& M, VectorXi& G, std::map<int,
     for(int i = 0; i < M.rows(); i++){
 
         g = G[i];
-        rand = randomInt(0, group[g].size() - 1);
+        rand = rng.uniformInt(0, group[g].size() - 1);
         rand = group[g][static_cast<size_t>(rand)];
 
         shuffled.row(i) = M.row(rand);
@@ -60,14 +72,14 @@ MatrixXd groupwiseShuffleWithReplacement(MatrixXd& M, VectorXi& G, std::map<int,
     return shuffled;
 }
 
-VectorXd groupwiseShuffleWithReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group){
+VectorXd groupwiseShuffleWithReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group, RandomStream& rng){
 
     VectorXd shuffled(V.rows());
     int g, n, rand;
 
     for(int j = 0; j < V.rows(); j++){
         g = G[j]; n = static_cast<int>(group[g].size());
-        rand = randomInt(0, n - 1);
+        rand = rng.uniformInt(0, n - 1);
         rand = group[g][static_cast<size_t>(rand)];
 
         shuffled(j) = V[rand];
@@ -76,13 +88,13 @@ VectorXd groupwiseShuffleWithReplacement(VectorXd& V, VectorXi& G, std::map<int,
     return shuffled;
 }
 
-VectorXd groupwiseShuffleWithoutReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group){
+VectorXd groupwiseShuffleWithoutReplacement(VectorXd& V, VectorXi& G, std::map<int, std::vector<int>>& group, RandomStream& rng){
 
     std::map<int, std::vector<int>> groupShuffle;
 
     for (std::pair<int, std::vector<int>> e : group){
         std::vector<int> v = e.second;
-        std::random_shuffle(v.begin(), v.end());
+        rng.shuffle(v.data(), static_cast<int>(v.size()));
         groupShuffle[e.first] = v;
     }
 
@@ -98,6 +110,3 @@ VectorXd groupwiseShuffleWithoutReplacement(VectorXd& V, VectorXi& G, std::map<i
 
     return shuffled;
 }
-
-
-
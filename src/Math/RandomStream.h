@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+
+//========================================================
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011).
+// A stream is fully determined by its key and iteration, so the
+// numbers drawn for an iteration do not depend on which thread
+// runs it or on how iterations are grouped into batches.
+//========================================================
+
+//identifies the random numbers of one test on one variant set, sets
+//from a VCF are keyed by their variants (see VariantSet::getRandomKey)
+struct RandomKey {
+    uint64_t seed;
+    uint64_t set;
+    uint32_t test;
+};
+
+class RandomStream {
+private:
+    uint32_t key[2];
+    uint32_t counter[4];
+    uint32_t block[4];
+    int used;
+
+    inline void nextBlock(){
+        philox(counter, key, block);
+        used = 0;
+        counter[0]++;
+    }
+
+public:
+
+    RandomStream(RandomKey k, uint32_t iteration) {
+        key[0] = static_cast<uint32_t>(k.seed);
+        key[1] = static_cast<uint32_t>(k.seed >> 32);
+        //the first word counts blocks drawn within the stream
+        counter[0] = 0;
+        counter[1] = iteration;
+        //distinct for sets below 2^48 and tests below 2^16
+        counter[2] = static_cast<uint32_t>(k.set);
+        counter[3] = k.test ^ (static_cast<uint32_t>(k.set >> 32) << 16);
+        used = 4;
+    }
+
+    //one block of Philox4x32-10, out = philox(counter, key)
+    static inline void philox(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]){
+        uint32_t k0 = key[0], k1 = key[1];
+        uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+
+        for(int round = 0; round < 10; round++){
+            uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * c0;
+            uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * c2;
+
+            c0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+            c2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+            c1 = static_cast<uint32_t>(p1);
+            c3 = static_cast<uint32_t>(p0);
+
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+
+        out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+
+    inline uint32_t next(){
+        if(used == 4)
+            nextBlock();
+        return block[used++];
+    }
+
+    //uniform on [0, 1) with 53 random bits
+    inline double uniform(){
+        uint64_t a = next() >> 5;
+        uint64_t b = next() >> 6;
+        return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+    }
+
+    //uniform on [from, to] without modulo bias (Lemire 2019)
+    inline int uniformInt(int from, int to){
+        uint32_t range = static_cast<uint32_t>(to - from) + 1;
+        uint64_t m = static_cast<uint64_t>(next()) * range;
+        uint32_t low = static_cast<uint32_t>(m);
+
+        if(low < range){
+            uint32_t threshold = (0u - range) % range;
+            while(low < threshold){
+                m = static_cast<uint64_t>(next()) * range;
+                low = static_cast<uint32_t>(m);
+            }
+        }
+
+        return from + static_cast<int>(m >> 32);
+    }
+
+    //Fisher-Yates shuffle
+    template <typename T>
+    inline void shuffle(T* first, int n){
+        for(int i = n - 1; i > 0; i--){
+            int j = uniformInt(0, i);
+            T tmp = first[i]; first[i] = first[j]; first[j] = tmp;
+        }
+    }
+};
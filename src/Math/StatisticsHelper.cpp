@@ -91,6 +91,206 @@ double chiSquareOneDOF(double statistic) {
     return std::max(1 - p, minVal);
 }
 
+/*
+Regularized upper incomplete gamma function Q(a, x), using the series expansion below
+a + 1 and Lentz's continued fraction above it.
+
+@param a Shape.
+@param x Point at which Q is evaluated.
+@return Q(a, x).
+*/
+double upperIncompleteGamma(double a, double x) {
+    if(x <= 0)
+        return 1;
+
+    double logPrefix = a * std::log(x) - x - std::lgamma(a);
+
+    if(x < a + 1){
+        double term = 1 / a;
+        double sum = term;
+        for(int n = 1; n < 1000; n++){
+            term *= x / (a + n);
+            sum += term;
+            if(std::fabs(term) < std::fabs(sum) * 1e-15)
+                break;
+        }
+        return std::max(1 - sum * std::exp(logPrefix), 0.0);
+    }
+
+    double tiny = 1e-300;
+    double b = x + 1 - a;
+    double c = 1 / tiny;
+    double d = 1 / b;
+    double h = d;
+    for(int n = 1; n < 1000; n++){
+        double an = -n * (n - a);
+        b += 2;
+        d = an * d + b;
+        if(std::fabs(d) < tiny) d = tiny;
+        c = b + an / c;
+        if(std::fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        double delta = d * c;
+        h *= delta;
+        if(std::fabs(delta - 1) < 1e-15)
+            break;
+    }
+    return std::exp(logPrefix) * h;
+}
+
+/*
+Upper tail of the (non-central) chi-squared distribution. The non-central case is a
+Poisson mixture of central tails, summed outwards from the largest weight.
+
+@param statistic Point at which the tail is evaluated.
+@param df Degrees of freedom, need not be an integer.
+@param noncentrality Non-centrality parameter.
+@return P[X > statistic].
+*/
+double chiSquareUpperTail(double statistic, double df, double noncentrality) {
+    if(noncentrality <= 0)
+        return upperIncompleteGamma(df / 2, statistic / 2);
+
+    double lambda = noncentrality / 2;
+    int mode = static_cast<int>(std::floor(lambda));
+    double logModeWeight = -lambda + mode * std::log(lambda) - std::lgamma(mode + 1.0);
+
+    double p = 0;
+    double weight = std::exp(logModeWeight);
+    for(int j = mode; j < mode + 10000 && weight > 1e-17; j++){
+        p += weight * upperIncompleteGamma(df / 2 + j, statistic / 2);
+        weight *= lambda / (j + 1);
+    }
+
+    weight = std::exp(logModeWeight);
+    for(int j = mode; j > 0 && weight > 1e-17; j--){
+        weight *= j / lambda;
+        p += weight * upperIncompleteGamma(df / 2 + j - 1, statistic / 2);
+    }
+
+    return std::min(p, 1.0);
+}
+
+/*
+Inverse of the upper tail of the central chi-squared distribution, found by bisection.
+
+@param p Upper tail probability.
+@param df Degrees of freedom, need not be an integer.
+@return x such that P[X > x] = p.
+*/
+double chiSquareUpperQuantile(double p, double df) {
+    if(p >= 1)
+        return 0;
+
+    double lower = 0;
+    double upper = std::max(df, 1.0);
+    while(chiSquareUpperTail(upper, df) > p && upper < 1e6)
+        upper *= 2;
+
+    for(int i = 0; i < 200 && upper - lower > 1e-12 * upper; i++){
+        double mid = (lower + upper) / 2;
+        if(chiSquareUpperTail(mid, df) > p)
+            lower = mid;
+        else
+            upper = mid;
+    }
+    return (lower + upper) / 2;
+}
+
+/*
+Cumulant generating function of S = sum g_i (y_i - mu_i) with independent y_i ~ Bernoulli(mu_i),
+and its first two derivatives at t.
+*/
+static void binomialCGF(double t, VectorXd &g, VectorXd &mu, double &K, double &K1, double &K2) {
+    K = 0; K1 = 0; K2 = 0;
+    for(int i = 0; i < g.rows(); i++){
+        if(mu[i] <= 0 || mu[i] >= 1)
+            continue;
+
+        //a = t g + logit(mu), written with softplus and sigmoid to avoid overflow
+        double a = t * g[i] + std::log(mu[i] / (1 - mu[i]));
+        double softplus = (a > 0) ? a + std::log1p(std::exp(-a)) : std::log1p(std::exp(a));
+        double p = (a > 0) ? 1 / (1 + std::exp(-a)) : std::exp(a) / (1 + std::exp(a));
+
+        K += std::log1p(-mu[i]) + softplus - t * g[i] * mu[i];
+        K1 += g[i] * (p - mu[i]);
+        K2 += g[i] * g[i] * p * (1 - p);
+    }
+}
+
+/*
+Lugannani-Rice tail probability of S beyond q, P[S > q] for q > 0 and P[S < q] for q < 0.
+*/
+static double saddlepointTail(double q, VectorXd &g, VectorXd &mu) {
+    double K, K1, K2;
+
+    //K' is increasing, bracket the root then use safeguarded Newton steps
+    double lower = 0, upper = 0, step = (q > 0) ? 1 : -1;
+    bool bracketed = false;
+    for(int i = 0; i < 100 && !bracketed; i++){
+        binomialCGF(step, g, mu, K, K1, K2);
+        bracketed = (q > 0 && K1 >= q) || (q < 0 && K1 <= q);
+        if(!bracketed)
+            step *= 2;
+    }
+    //q is at or beyond the most extreme score possible
+    if(!bracketed)
+        return 0;
+    if(q > 0) upper = step; else lower = step;
+
+    double zeta = 0;
+    for(int i = 0; i < 100; i++){
+        binomialCGF(zeta, g, mu, K, K1, K2);
+        if(K1 < q) lower = zeta; else upper = zeta;
+
+        double next = zeta - (K1 - q) / K2;
+        if(!(next > lower && next < upper))
+            next = (lower + upper) / 2;
+        if(std::fabs(next - zeta) < 1e-10 * (1 + std::fabs(zeta))){
+            zeta = next;
+            break;
+        }
+        zeta = next;
+    }
+    binomialCGF(zeta, g, mu, K, K1, K2);
+
+    double w = ((zeta > 0) ? 1 : -1) * std::sqrt(std::max(2 * (zeta * q - K), 0.0));
+    double v = zeta * std::sqrt(K2);
+    if(w == 0 || v / w <= 0)
+        return pnorm(-std::fabs(q) / std::sqrt(K2));
+
+    double z = w + std::log(v / w) / w;
+    return (q > 0) ? pnorm(-z) : pnorm(z);
+}
+
+/*
+Two-sided p-value of the score S = sum g_i (y_i - mu_i) under a binomial null using the saddlepoint
+approximation (Dey et al. 2017). Close to the mean the normal approximation is used, in the tails
+the saddlepoint keeps the p-value calibrated when cases and controls are unbalanced.
+
+@param score Observed score.
+@param g Covariate adjusted genotype (or burden) of every sample.
+@param mu Fitted probabilities of the null model.
+@return p-value.
+*/
+double saddlepointPvalue(double score, VectorXd &g, VectorXd &mu) {
+    double K, K1, variance;
+    binomialCGF(0, g, mu, K, K1, variance);
+
+    if(variance <= 0)
+        return NAN;
+
+    double q = std::fabs(score);
+    if(q < 2 * std::sqrt(variance))
+        return chiSquareOneDOF(score * score / variance);
+
+    //floored like chiSquareOneDOF, a tail beyond the most extreme score possible is 0
+    double minVal = 1e-14;
+
+    double p = saddlepointTail(q, g, mu) + saddlepointTail(-q, g, mu);
+    return std::min(std::max(p, minVal), 1.0);
+}
+
 //same as doing pairwise.complete.obs in R
 MatrixXd covariance(MatrixXd &M) {
     MatrixXd centered = M.rowwise() - M.colwise().mean();
@@ -154,22 +354,26 @@ VectorXd fitModel(VectorXd &beta, MatrixXd &Z, Family family) {
 }
 
 VectorXd logisticRegression(VectorXd &Y, MatrixXd &X) {
-
     VectorXd beta = VectorXd::Constant(X.cols(), 0);
-    VectorXd lastBeta = VectorXd::Constant(X.cols(), 0);
-
-    int nobs = X.rows();
-
-    std::vector<VectorXd> x;
-    std::vector<MatrixXd> xxT;
+    IRLSWorkspace ws;
+    logisticRegression(Y, X, beta, ws);
+    return beta;
+}
 
-    for(int i = 0; i< nobs; i++){
-        x.push_back(X.row(i));
-        xxT.push_back(X.row(i)*X.row(i).transpose());
-    }
+/*
+Fits a logistic regression with iteratively reweighted least squares. The Newton step
+is solved with an LDLT decomposition of X'WX and all intermediate results live in the
+workspace, so repeated fits of the same size do not allocate.
+
+@param Y Binary response.
+@param X Design matrix.
+@param beta Starting values, replaced by the fitted coefficients.
+@param ws Workspace reused between calls.
+*/
+void logisticRegression(VectorXd &Y, MatrixXd &X, VectorXd &beta, IRLSWorkspace &ws) {
 
-    VectorXd first;
-    MatrixXd hess;
+    if(beta.rows() != X.cols())
+        beta = VectorXd::Constant(X.cols(), 0);
 
     int iteration = 0;
 
@@ -177,36 +381,23 @@ VectorXd logisticRegression(VectorXd &Y, MatrixXd &X) {
 
         iteration++;
 
-        VectorXd p(nobs);
-        VectorXd W(nobs);
-
-        for(int i =0; i < nobs; i++){
-            double s = sigmoid(x.at(static_cast<size_t>(i)), beta);
-            p[i] = s;
-            W[i] = s * (1-s);
-        }
+        ws.eta.noalias() = X * beta;
+        ws.p = 1 / (1 + (-ws.eta.array()).exp());
 
-        //calculate 1st derivative vector of likelihood function
-        first = X.transpose()*(Y - p);
+        //1st derivative of the log likelihood and the (negated) Hessian X'WX
+        ws.residual = Y - ws.p;
+        ws.gradient.noalias() = X.transpose() * ws.residual;
+        ws.WX = (ws.p.array() * (1 - ws.p.array())).matrix().asDiagonal() * X;
+        ws.hessian.noalias() = X.transpose() * ws.WX;
 
-        //calculate Hessian matrix of likelihood function
-        hess = -X.transpose()*W.asDiagonal()*X;
-
-        lastBeta = beta;
-        try{
-        beta = lastBeta - hess.inverse()*first;
-        }catch(...){
+        ws.ldlt.compute(ws.hessian);
+        if(ws.ldlt.info() != Eigen::Success)
             throwError(ERROR_SOURCE, "Error while trying to invert matrix in logistic regression");
-        }
 
-        bool stop = true;
-        VectorXd grad = (beta - lastBeta).array().abs();
-        for(int i = 0; i< grad.rows(); i++){
-            if(grad[i] > 1e-7){
-                stop = false;
-                break;
-            }
-        }
+        ws.step = ws.ldlt.solve(ws.gradient);
+        beta += ws.step;
+
+        bool stop = ws.step.cwiseAbs().maxCoeff() <= 1e-7;
 
         if(iteration > 50 || stop)
             break;
@@ -215,8 +406,5 @@ VectorXd logisticRegression(VectorXd &Y, MatrixXd &X) {
     if(iteration > 50){
         throwError(ERROR_SOURCE, "Logistic regression failed to converge after 50 iterations.");
     }
-
-    return beta;
 }
 
-
@@ -0,0 +1,98 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+
+//========================================================
+// Bytes held by the batches in each stage of the VCF
+// pipeline. The reader waits for room before reading the
+// next batch, so the stages never hold much more than the
+// budget however large the VCF is.
+//========================================================
+
+enum class PipelineStage { READ, PARSE, COLLAPSE, TEST };
+static const int PIPELINE_STAGES = 4;
+
+class MemoryBudget {
+private:
+    size_t limit;
+    size_t held[PIPELINE_STAGES];
+    size_t peak[PIPELINE_STAGES];
+    size_t peakTotal;
+    bool aborted;
+
+    std::mutex lock;
+    std::condition_variable released;
+
+    inline size_t total(){
+        size_t sum = 0;
+        for(int s = 0; s < PIPELINE_STAGES; s++)
+            sum += held[s];
+        return sum;
+    }
+
+    //collapsing only lets go of its variants once the next batch arrives, so waiting on them
+    //could stall the reader forever. They are bounded by about one batch anyway.
+    inline size_t gated(){
+        return total() - held[static_cast<int>(PipelineStage::COLLAPSE)];
+    }
+
+    inline void update(PipelineStage stage, size_t bytes){
+        int s = static_cast<int>(stage);
+        held[s] = bytes;
+        peak[s] = std::max(peak[s], bytes);
+        peakTotal = std::max(peakTotal, total());
+    }
+
+public:
+
+    //limit of 0 means no budget, bytes are still counted
+    MemoryBudget(size_t bytes) : limit(bytes), peakTotal(0), aborted(false) {
+        for(int s = 0; s < PIPELINE_STAGES; s++){
+            held[s] = 0;
+            peak[s] = 0;
+        }
+    }
+
+    /*
+    Waits until the stages hold less than the budget. Always returns right away when they
+    hold nothing, so a single batch larger than the budget still goes through.
+
+    @return false once aborted.
+    */
+    inline bool waitForRoom(){
+        std::unique_lock<std::mutex> guard(lock);
+        released.wait(guard, [this]{ return aborted || limit == 0 || gated() < limit; });
+        return !aborted;
+    }
+
+    inline void add(PipelineStage stage, size_t bytes){
+        std::lock_guard<std::mutex> guard(lock);
+        update(stage, held[static_cast<int>(stage)] + bytes);
+    }
+
+    inline void remove(PipelineStage stage, size_t bytes){
+        std::lock_guard<std::mutex> guard(lock);
+        size_t current = held[static_cast<int>(stage)];
+        update(stage, (bytes < current) ? current - bytes : 0);
+        released.notify_all();
+    }
+
+    inline void set(PipelineStage stage, size_t bytes){
+        std::lock_guard<std::mutex> guard(lock);
+        update(stage, bytes);
+        released.notify_all();
+    }
+
+    inline void abort(){
+        std::lock_guard<std::mutex> guard(lock);
+        aborted = true;
+        released.notify_all();
+    }
+
+    inline size_t getLimit(){ return limit; }
+    inline size_t getPeak(){ std::lock_guard<std::mutex> guard(lock); return peakTotal; }
+    inline size_t getPeak(PipelineStage stage){
+        std::lock_guard<std::mutex> guard(lock);
+        return peak[static_cast<int>(stage)];
+    }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../Log.h"
+
+//========================================================
+// Last consistent point of a run over a VCF. Every set up
+// to sequence - 1 has its p-values in the output files, so
+// a resumed run truncates the files to the recorded sizes
+// and reads the VCF again from offset. The set after the
+// last written one always starts a new set there, so no
+// collapse state has to be saved. Filtered variants are
+// written ahead of the tests and are tracked on their own.
+// The seed and the analysis settings are saved too: a
+// resumed run draws the same bootstrap samples and refuses
+// to go on with other tests.
+//
+// Text file "checkpoint.txt" in the output directory, one
+// "key value" pair per line.
+//========================================================
+
+static const std::string CHECKPOINT_HEADER = "vikNGS checkpoint 2";
+
+struct Checkpoint {
+    std::string name;
+    std::string vcf;
+    uint64_t seed = 0;
+    //see Request::describeAnalysis
+    std::string analysis;
+    //next byte and variant line to read
+    uint64_t offset = 0;
+    uint64_t lines = 0;
+    //first set not written, counted from the first set the run read (see VariantSet::getKey)
+    int sequence = 0;
+    //filtered variants before filteredEnd take filteredBytes of the filtered file
+    uint64_t filteredEnd = 0;
+    uint64_t filteredBytes = 0;
+    //size of the p-value file and of the part file of every other phenotype
+    std::vector<uint64_t> pvalueBytes;
+};
+
+inline std::string checkpointFile(std::string outputDir){
+    return outputDir + "/checkpoint.txt";
+}
+
+/*
+Renames temp over path. POSIX replaces path in one step, so path is never missing. Where
+rename does not overwrite (Windows), path is removed first and only then missing for a moment.
+
+@return false if temp could not be renamed.
+*/
+inline bool replaceFile(std::string temp, std::string path){
+    if(std::rename(temp.c_str(), path.c_str()) == 0)
+        return true;
+    std::remove(path.c_str());
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+/*
+Writes the checkpoint next to the old one and renames it over it, so an interrupted write
+leaves the previous checkpoint.
+*/
+inline void saveCheckpoint(Checkpoint& c, std::string path){
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios_base::trunc);
+    if(!out.is_open())
+        throwError("CHECKPOINT", "Could not open file for writing checkpoint.", temp);
+
+    out << CHECKPOINT_HEADER << '\n';
+    out << "name " << c.name << '\n';
+    out << "vcf " << c.vcf << '\n';
+    out << "seed " << c.seed << '\n';
+    out << "analysis " << c.analysis << '\n';
+    out << "offset " << c.offset << '\n';
+    out << "lines " << c.lines << '\n';
+    out << "sequence " << c.sequence << '\n';
+    out << "filteredEnd " << c.filteredEnd << '\n';
+    out << "filteredBytes " << c.filteredBytes << '\n';
+    out << "pvalueBytes";
+    for(uint64_t bytes : c.pvalueBytes)
+        out << ' ' << bytes;
+    out << '\n';
+    out.close();
+
+    if(!replaceFile(temp, path))
+        throwError("CHECKPOINT", "Could not replace checkpoint file.", path);
+}
+
+inline Checkpoint loadCheckpoint(std::string path){
+    std::ifstream in(path);
+    if(!in.is_open())
+        throwError("CHECKPOINT", "No checkpoint to resume from, runs only write checkpoints with --checkpoint.", path);
+
+    std::string line;
+    if(!std::getline(in, line) || line != CHECKPOINT_HEADER)
+        throwError("CHECKPOINT", "Not a vikNGS checkpoint file.", path);
+
+    Checkpoint c;
+    while(std::getline(in, line)){
+        size_t space = line.find(' ');
+        std::string key = line.substr(0, space);
+        std::string value = (space == std::string::npos) ? "" : line.substr(space + 1);
+        std::istringstream values(value);
+
+        if(key == "name") c.name = value;
+        else if(key == "vcf") c.vcf = value;
+        else if(key == "seed") values >> c.seed;
+        else if(key == "analysis") c.analysis = value;
+        else if(key == "offset") values >> c.offset;
+        else if(key == "lines") values >> c.lines;
+        else if(key == "sequence") values >> c.sequence;
+        else if(key == "filteredEnd") values >> c.filteredEnd;
+        else if(key == "filteredBytes") values >> c.filteredBytes;
+        else if(key == "pvalueBytes"){
+            uint64_t bytes;
+            while(values >> bytes)
+                c.pvalueBytes.push_back(bytes);
+        }
+    }
+
+    if(c.pvalueBytes.size() < 1 || c.analysis.size() < 1)
+        throwError("CHECKPOINT", "Checkpoint file is incomplete.", path);
+
+    return c;
+}
+
+inline uint64_t fileSize(std::string path){
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    return file.is_open() ? static_cast<uint64_t>(file.tellg()) : 0;
+}
+
+/*
+Cuts a file back to its first bytes, dropping whatever was written after the checkpoint.
+
+@param path File to cut.
+@param bytes Size recorded by the checkpoint.
+*/
+inline void truncateFile(std::string path, uint64_t bytes){
+    uint64_t size = fileSize(path);
+    if(size == bytes)
+        return;
+    if(size < bytes)
+        throwError("CHECKPOINT", "Output file is shorter than at the checkpoint.", path);
+
+    std::string temp = path + ".tmp";
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        std::vector<char> buffer(1 << 20);
+        uint64_t left = bytes;
+        while(left > 0 && in){
+            std::streamsize n = static_cast<std::streamsize>(std::min<uint64_t>(left, buffer.size()));
+            in.read(buffer.data(), n);
+            out.write(buffer.data(), in.gcount());
+            left -= static_cast<uint64_t>(in.gcount());
+        }
+    }
+
+    if(!replaceFile(temp, path))
+        throwError("CHECKPOINT", "Could not replace output file.", path);
+}
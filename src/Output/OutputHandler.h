@@ -3,6 +3,7 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include "../Variant.h"
 #include "../Enum/TestSettings.h"
@@ -30,19 +31,35 @@ inline void initializeOutputFiles (std::string outputDir, std::string name = "")
     filtered.close();
 }
 
-inline void outputPvals(std::vector<VariantSet>& variants, std::string outputDir, std::vector<TestSettings>& test, std::string name="") {
-
-    std::ofstream pvals(fileName(outputDir, pfile, name), std::ios_base::app);
-
-    if (pvals.is_open())
-    {
-        for (size_t i = 0; i < variants.size(); i++)
-            pvals << variants[i].toString(test[0].toShortString(), 0, i) << '\n';
-
-        pvals.close();
-    }
+//test name written after every p-value, with several phenotypes the phenotype number follows it
+inline std::string pvalueLabel(TestSettings& test, int phenotype, int nphenotypes){
+    std::string label = test.toShortString();
+    if(nphenotypes > 1)
+        label += "\tY" + std::to_string(phenotype + 1);
+    return label;
 }
 
+/*
+Rule that picked the method of every p-value when they come from two methods, for the log.
+Asymptotic SKAT, C-alpha and SKAT-O p-values are approximated with Liu's method and only
+recalculated with Davies' method when that approximation is below the Davies threshold.
+
+@param test Test of the p-values.
+@param bootstrap The p-values are bootstrapped.
+@param daviesThreshold See Request::getDaviesThreshold.
+
+@return Empty when every p-value comes from Davies' method or the test does not use it.
+*/
+inline std::string pvalueMethod(TestSettings& test, bool bootstrap, double daviesThreshold){
+    Statistic s = test.getStatistic();
+    if(bootstrap || daviesThreshold >= 1 || (s != Statistic::SKAT && s != Statistic::CALPHA && s != Statistic::SKATO))
+        return "";
+
+    std::ostringstream method;
+    method << "SKAT/C-alpha p-values are from Liu's approximation when it is at least " << daviesThreshold
+           << ", otherwise from Davies' method, or Liu's approximation where it did not converge";
+    return method.str();
+}
 
 inline void outputFiltered(std::vector<Variant> variants, std::string outputDir, std::string name = "") {
 
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <vector>
+#include "OutputHandler.h"
+#include "Checkpoint.h"
+#include "../Log.h"
+
+//========================================================
+// Writes p-values while the VCF is still being tested.
+// Sets arrive in the order they finish and wait in a
+// reorder buffer keyed by their sequence number until every
+// earlier set has been written, so the file keeps VCF order.
+// Lines of the first phenotype go straight to the p-value
+// file, the others to one part file per phenotype that is
+// appended at the end, so the lines of every phenotype come
+// after those of the one before. The writer also knows the
+// last consistent point for a checkpoint: the sets written
+// so far and where the VCF can be read again without
+// touching them.
+//========================================================
+
+class ResultWriter {
+private:
+    std::string path;
+    std::vector<std::string> labels;
+    std::vector<std::string> partPaths;
+    std::vector<std::unique_ptr<std::ofstream>> out;
+    std::vector<uint64_t> bytes;
+
+    std::map<int, VariantSet> waiting;
+    int next;
+    bool keep;
+    std::vector<VariantSet> kept;
+    bool finished;
+
+    //VCF position after the last written set
+    uint64_t vcfEnd;
+    uint64_t vcfLine;
+    //part files are needed to resume once a checkpoint refers to them
+    bool keepParts;
+
+    inline void writeSet(VariantSet& set){
+        for(size_t p = 0; p < out.size(); p++){
+            std::string line = set.toString(labels[p], static_cast<int>(p), set.getSequence()) + '\n';
+            *out[p] << line;
+            bytes[p] += line.size();
+        }
+
+        if(set.size() > 0){
+            vcfEnd = set.getVCFEnd();
+            vcfLine = set.getVCFLine();
+        }
+    }
+
+public:
+
+    /*
+    @param outputDir Directory of the p-value file.
+    @param name Request name used in the file name.
+    @param test Test whose name labels every line.
+    @param nphenotypes Number of phenotypes tested.
+    @param keepSets Keep the written sets for plotting.
+    @param start Checkpoint to continue from, or the start of the VCF.
+    @param resumed Cut the files back to their size at start and append to them.
+    */
+    ResultWriter(std::string outputDir, std::string name, TestSettings& test, int nphenotypes, bool keepSets,
+                 Checkpoint& start, bool resumed) :
+        path(fileName(outputDir, pfile, name)), next(start.sequence), keep(keepSets), finished(false),
+        vcfEnd(start.offset), vcfLine(start.lines), keepParts(resumed) {
+
+        if(resumed && start.pvalueBytes.size() != static_cast<size_t>(nphenotypes))
+            throwError("RESULT_WRITER", "Checkpoint was written for a different number of phenotypes.",
+                       std::to_string(start.pvalueBytes.size()));
+
+        for(int p = 0; p < nphenotypes; p++){
+            labels.push_back(pvalueLabel(test, p, nphenotypes));
+
+            std::string file = path;
+            if(p > 0){
+                file = path + ".Y" + std::to_string(p + 1) + ".part";
+                partPaths.push_back(file);
+            }
+
+            if(resumed)
+                truncateFile(file, start.pvalueBytes[p]);
+            bytes.push_back(resumed ? start.pvalueBytes[p] : 0);
+
+            out.emplace_back(new std::ofstream(file, (p > 0 && !resumed) ? std::ios_base::trunc : std::ios_base::app));
+            if(!out.back()->is_open())
+                throwError("RESULT_WRITER", "Could not open file for writing p-values.", file);
+        }
+    }
+
+    ~ResultWriter(){
+        if(finished || keepParts)
+            return;
+
+        //a failed run keeps what the p-value file already has
+        out.clear();
+        for(std::string& part : partPaths)
+            std::remove(part.c_str());
+    }
+
+    /*
+    Adds a tested set and writes every set that is now in order.
+
+    @param set Tested set, moved into the buffer.
+    */
+    inline void add(VariantSet&& set){
+        int sequence = set.getSequence();
+        waiting.emplace(sequence, std::move(set));
+
+        bool wrote = false;
+        std::map<int, VariantSet>::iterator it;
+        while((it = waiting.find(next)) != waiting.end()){
+            writeSet(it->second);
+            wrote = true;
+
+            if(keep)
+                kept.push_back(std::move(it->second));
+
+            waiting.erase(it);
+            next++;
+        }
+
+        if(wrote)
+            for(size_t p = 0; p < out.size(); p++)
+                out[p]->flush();
+    }
+
+    inline size_t setsWritten() { return static_cast<size_t>(next); }
+    //sets waiting for an earlier set
+    inline size_t pending() { return waiting.size(); }
+    inline std::vector<uint64_t> getBytes() { return bytes; }
+
+    //first set to write, when the sets before it are not tested here
+    inline void startAt(int sequence){
+        if(waiting.size() < 1 && sequence > next)
+            next = sequence;
+    }
+
+    //records the sets written so far, which have all been flushed
+    inline void fillCheckpoint(Checkpoint& c){
+        c.sequence = next;
+        c.offset = vcfEnd;
+        c.lines = vcfLine;
+        c.pvalueBytes = bytes;
+        keepParts = true;
+    }
+
+    /*
+    Appends the part files of the other phenotypes to the p-value file.
+
+    @return Sets kept for plotting, in VCF order.
+    */
+    inline std::vector<VariantSet> finish(){
+        if(waiting.size() > 0)
+            printWarning(std::to_string(waiting.size()) + " tested variant sets were never written, an earlier set is missing.");
+
+        for(size_t p = 1; p < out.size(); p++){
+            out[p]->close();
+            std::ifstream part(partPaths[p - 1]);
+            if(part.peek() != std::ifstream::traits_type::eof())
+                *out[0] << part.rdbuf();
+            part.close();
+            std::remove(partPaths[p - 1].c_str());
+        }
+        out[0]->close();
+        finished = true;
+
+        return std::move(kept);
+    }
+};
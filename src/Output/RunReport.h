@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "../vikNGS.h"
+#include "../PipelineStats.h"
+#include "../PerfCounters.h"
+#include "../Test/Test.h"
+#include "../Log.h"
+
+//========================================================
+// Machine readable summary of a run, written as JSON next
+// to the p-value file: the settings that shape the pipeline,
+// the times and counts of the run and the counters of every
+// pipeline stage and queue.
+//========================================================
+
+inline std::string reportFile(std::string outputDir, std::string name){
+    if(name.size() > 0)
+        return outputDir + "/report_" + name + ".json";
+    else
+        return outputDir + "/report.json";
+}
+
+inline std::string jsonString(std::string value){
+    std::string quoted = "\"";
+    for(char c : value){
+        if(c == '"' || c == '\\')
+            quoted += std::string("\\") + c;
+        else if(static_cast<unsigned char>(c) < 0x20){
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+            quoted += c;
+    }
+    return quoted + "\"";
+}
+
+inline std::string jsonNumber(double value){
+    std::ostringstream out;
+    out.precision(6);
+    out << value;
+    return out.str();
+}
+
+/*
+@param path File to write, see reportFile.
+@param req Request of the run.
+@param result Times and counts of the run.
+@param stats Counters of the pipeline.
+@param counters Hardware counters of the kernels, null if not counted.
+@param tiers Number of SKAT/C-alpha p-values from each method.
+@param stopped The run was stopped before the end of the VCF.
+*/
+inline void writeRunReport(std::string path, Request& req, Data& result, PipelineStats& stats, PerfCounters* counters,
+                           QuadFormCounts tiers, bool stopped){
+    std::ofstream out(path, std::ios_base::trunc);
+    if(!out.is_open()){
+        printWarning("Could not open file for writing the run report: " + path);
+        return;
+    }
+
+    out << "{\n";
+    out << "  \"name\": " << jsonString(req.getRequestName()) << ",\n";
+    out << "  \"vcf\": " << jsonString(req.getVCFDir()) << ",\n";
+    out << "  \"sampleInfo\": " << jsonString(req.getSampleDir()) << ",\n";
+    out << "  \"threads\": " << req.getNumberThreads() << ",\n";
+    out << "  \"parseThreads\": " << req.getParseThreads() << ",\n";
+    out << "  \"testBatches\": " << req.getTestBatches() << ",\n";
+    out << "  \"batchSize\": " << req.getBatchSize() << ",\n";
+    out << "  \"maxMemoryMB\": " << req.getMaxMemory() << ",\n";
+    out << "  \"shard\": " << req.getShardIndex() + 1 << ",\n";
+    out << "  \"shards\": " << req.getShardCount() << ",\n";
+    out << "  \"resumed\": " << (req.shouldResume() ? "true" : "false") << ",\n";
+    out << "  \"stopped\": " << (stopped ? "true" : "false") << ",\n";
+    out << "  \"processingSeconds\": " << jsonNumber(result.processingTime) << ",\n";
+    out << "  \"evaluationSeconds\": " << jsonNumber(result.evaluationTime) << ",\n";
+    out << "  \"variantLines\": " << result.variantsParsed << ",\n";
+    out << "  \"setsWritten\": " << stats.getStage(StatStage::WRITE).items << ",\n";
+    //Liu's approximation is kept when it is at least the threshold, 1 means Davies' method for every p-value
+    out << "  \"quadForm\": { \"liu\": " << tiers.liu << ", \"davies\": " << tiers.davies <<
+           ", \"daviesThreshold\": " << jsonNumber(req.getDaviesThreshold()) << " },\n";
+
+    double wall = stats.getWallTime();
+    out << "  \"pipeline\": {\n";
+    out << "    \"wallSeconds\": " << jsonNumber(wall) << ",\n";
+    out << "    \"busiestStage\": " << jsonString(stats.getStage(stats.getBusiestStage()).name) << ",\n";
+
+    out << "    \"batchMillisecondBuckets\": [";
+    for(int b = 0; b < STAT_BUCKETS - 1; b++)
+        out << (b > 0 ? ", " : "") << (1 << b);
+    out << "],\n";
+
+    out << "    \"stages\": [\n";
+    for(int s = 0; s < STAT_STAGES; s++){
+        StatStage stage = static_cast<StatStage>(s);
+        StageStats st = stats.getStage(stage);
+        out << "      { \"name\": " << jsonString(st.name) << ", \"unit\": " << jsonString(st.unit) <<
+               ", \"workers\": " << st.workers << ", \"batches\": " << st.batches << ", \"items\": " << st.items <<
+               ", \"itemsPerSecond\": " << jsonNumber(wall > 0 ? st.items / wall : 0) <<
+               ", \"busySeconds\": " << jsonNumber(st.busy) <<
+               ", \"inputWaitSeconds\": " << jsonNumber(st.inputWait) <<
+               ", \"outputWaitSeconds\": " << jsonNumber(st.outputWait) <<
+               ", \"utilisation\": " << jsonNumber(stats.getUtilisation(stage)) <<
+               ", \"batchMilliseconds\": [";
+        for(int b = 0; b < STAT_BUCKETS; b++)
+            out << (b > 0 ? ", " : "") << st.histogram[b];
+        out << "] }" << (s + 1 < STAT_STAGES ? "," : "") << "\n";
+    }
+    out << "    ],\n";
+
+    out << "    \"queues\": [\n";
+    for(int q = 0; q < STAT_QUEUES; q++){
+        QueueStats qs = stats.getQueue(static_cast<StatQueue>(q));
+        out << "      { \"name\": " << jsonString(qs.name) << ", \"capacity\": " << qs.capacity <<
+               ", \"samples\": " << qs.samples <<
+               ", \"meanDepth\": " << jsonNumber(qs.samples > 0 ? qs.total / qs.samples : 0) <<
+               ", \"maxDepth\": " << qs.max << " }" << (q + 1 < STAT_QUEUES ? "," : "") << "\n";
+    }
+    out << "    ],\n";
+
+    const char* memoryNames[PIPELINE_STAGES] = { "read", "parse", "collapse", "test" };
+    out << "    \"memoryPeakBytes\": {";
+    for(int s = 0; s < PIPELINE_STAGES; s++)
+        out << " " << jsonString(memoryNames[s]) << ": " << stats.getMemoryPeak(static_cast<PipelineStage>(s)) << ",";
+    out << " \"total\": " << stats.getMemoryPeak() << " }\n";
+    out << "  }" << (counters != nullptr ? "," : "") << "\n";
+
+    if(counters != nullptr){
+        out << "  \"hardwareCounters\": [\n";
+        for(int s = 0; s < PERF_STAGES; s++){
+            PerfStage stage = static_cast<PerfStage>(s);
+            out << "    { \"name\": " << jsonString(perfStageName(stage)) << ", \"unit\": " << jsonString(perfStageUnit(stage)) <<
+                   ", \"items\": " << counters->getItems(stage) <<
+                   ", \"countedItems\": " << counters->getCountedItems(stage) <<
+                   ", \"cycles\": " << jsonNumber(counters->getCount(stage, PerfEvent::CYCLES)) <<
+                   ", \"instructions\": " << jsonNumber(counters->getCount(stage, PerfEvent::INSTRUCTIONS)) <<
+                   ", \"llcMisses\": " << jsonNumber(counters->getCount(stage, PerfEvent::LLC_MISSES)) <<
+                   ", \"branchMisses\": " << jsonNumber(counters->getCount(stage, PerfEvent::BRANCH_MISSES)) <<
+                   ", \"ipc\": " << jsonNumber(counters->getIPC(stage)) <<
+                   ", \"llcMissesPerItem\": " << jsonNumber(counters->perItem(stage, PerfEvent::LLC_MISSES)) <<
+                   ", \"branchMissesPerItem\": " << jsonNumber(counters->perItem(stage, PerfEvent::BRANCH_MISSES)) <<
+                   " }" << (s + 1 < PERF_STAGES ? "," : "") << "\n";
+        }
+        out << "  ]\n";
+    }
+    out << "}\n";
+}
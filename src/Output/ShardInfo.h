@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../Log.h"
+
+//========================================================
+// Written by a run with --shard i/N next to its outputs.
+// Shard i tests the sets whose first variant ends in the
+// i-th of N equal byte ranges of the VCF, and every shard
+// numbers the sets over the whole VCF, so the shards hold
+// consecutive runs of the unsharded results. vikNGS merge
+// puts the phenotype blocks of the shards back together.
+//
+// Text file "shard_<name>.txt", one "key value" pair per
+// line. File names are relative to its directory.
+//========================================================
+
+static const std::string SHARD_HEADER = "vikNGS shard 1";
+
+struct ShardInfo {
+    int index = 0;
+    int count = 1;
+    std::string vcf;
+    uint64_t vcfSize = 0;
+    std::string pvalues;
+    std::string filtered;
+    //bytes of every phenotype block of the p-value file
+    std::vector<uint64_t> pvalueBytes;
+};
+
+inline std::string shardFile(std::string outputDir, std::string name){
+    return outputDir + "/shard_" + name + ".txt";
+}
+
+inline void saveShardInfo(ShardInfo& s, std::string path){
+    std::ofstream out(path, std::ios_base::trunc);
+    if(!out.is_open())
+        throwError("SHARD", "Could not open file for writing shard information.", path);
+
+    out << SHARD_HEADER << '\n';
+    out << "shard " << s.index << ' ' << s.count << '\n';
+    out << "vcf " << s.vcf << '\n';
+    out << "vcfSize " << s.vcfSize << '\n';
+    out << "pvalues " << s.pvalues << '\n';
+    out << "filtered " << s.filtered << '\n';
+    out << "pvalueBytes";
+    for(uint64_t bytes : s.pvalueBytes)
+        out << ' ' << bytes;
+    out << '\n';
+}
+
+inline ShardInfo loadShardInfo(std::string path){
+    std::ifstream in(path);
+    if(!in.is_open())
+        throwError("SHARD", "Could not open shard information file.", path);
+
+    std::string line;
+    if(!std::getline(in, line) || line != SHARD_HEADER)
+        throwError("SHARD", "Not a vikNGS shard information file.", path);
+
+    ShardInfo s;
+    s.count = 0;
+    while(std::getline(in, line)){
+        size_t space = line.find(' ');
+        std::string key = line.substr(0, space);
+        std::string value = (space == std::string::npos) ? "" : line.substr(space + 1);
+        std::istringstream values(value);
+
+        if(key == "shard") values >> s.index >> s.count;
+        else if(key == "vcf") s.vcf = value;
+        else if(key == "vcfSize") values >> s.vcfSize;
+        else if(key == "pvalues") s.pvalues = value;
+        else if(key == "filtered") s.filtered = value;
+        else if(key == "pvalueBytes"){
+            uint64_t bytes;
+            while(values >> bytes)
+                s.pvalueBytes.push_back(bytes);
+        }
+    }
+
+    if(s.count < 1 || s.pvalueBytes.size() < 1)
+        throwError("SHARD", "Shard information file is incomplete.", path);
+
+    return s;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "../Math/EigenStructures.h"
+#include "../Log.h"
+
+//========================================================
+// Binary store of the per set summary statistics (score
+// vector and variance matrix) that every score test is
+// derived from, so tests can be recomputed without the VCF.
+//
+// File: "VIKSS" magic and a uint32 version, followed by one
+// record per set, phenotype and genotype/variance pair.
+// Numbers are written in native byte order.
+//========================================================
+
+static const char SUMMARY_MAGIC[] = { 'V', 'I', 'K', 'S', 'S' };
+static const uint32_t SUMMARY_VERSION = 2;
+
+struct SummaryRecord {
+    //orders the sets, see VariantSet::getKey
+    uint64_t position;
+    uint32_t phenotype;
+    uint8_t genotype;
+    uint8_t varianceType;
+    //interval id, or the set sequence number without a BED file
+    std::string setID;
+    //one "chr\tpos\tref\talt" entry per tested variant
+    std::vector<std::string> variants;
+    //k x 3 genotype frequencies
+    MatrixXd P;
+    VectorXd weights;
+    VectorXd score;
+    MatrixXd variance;
+};
+
+class SummaryWriter {
+private:
+    std::ofstream out;
+    std::mutex lock;
+
+    template <typename T>
+    inline void put(T value) { out.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+    inline void putString(const std::string& s) {
+        put(static_cast<uint32_t>(s.size()));
+        out.write(s.data(), static_cast<std::streamsize>(s.size()));
+    }
+
+    inline void putDoubles(const double* values, int n) {
+        out.write(reinterpret_cast<const char*>(values), static_cast<std::streamsize>(n * sizeof(double)));
+    }
+
+public:
+    SummaryWriter(std::string path) : out(path, std::ios::binary | std::ios::trunc) {
+        if(!out.is_open())
+            throwError("SUMMARY_STATISTICS", "Could not open file for writing summary statistics.", path);
+
+        out.write(SUMMARY_MAGIC, sizeof(SUMMARY_MAGIC));
+        put(SUMMARY_VERSION);
+    }
+
+    /*
+    Appends a record, may be called from several threads.
+
+    @param r Summary statistics of one set.
+    */
+    inline void write(SummaryRecord& r) {
+        int k = static_cast<int>(r.score.rows());
+
+        //the arrays are written as they lie in memory, check their shapes before writing anything
+        if(r.P.rows() != k || r.P.cols() != 3 || r.weights.rows() != k ||
+                r.variance.rows() != k || r.variance.cols() != k || static_cast<int>(r.variants.size()) != k)
+            throwError("SUMMARY_STATISTICS", "Summary statistics of a set do not match its number of variants.", r.setID);
+
+        std::lock_guard<std::mutex> guard(lock);
+        put(r.position);
+        put(r.phenotype);
+        put(r.genotype);
+        put(r.varianceType);
+        putString(r.setID);
+        put(static_cast<uint32_t>(k));
+
+        for(int i = 0; i < k; i++)
+            putString(r.variants[i]);
+
+        MatrixXd P = r.P;
+        putDoubles(P.data(), k * 3);
+        putDoubles(r.weights.data(), k);
+        putDoubles(r.score.data(), k);
+
+        //symmetric, only the upper triangle is stored
+        for(int j = 0; j < k; j++)
+            putDoubles(r.variance.col(j).data(), j + 1);
+    }
+};
+
+class SummaryReader {
+private:
+    std::ifstream in;
+
+    template <typename T>
+    inline T get() {
+        T value;
+        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+
+    inline std::string getString() {
+        uint32_t size = get<uint32_t>();
+        std::string s(size, ' ');
+        in.read(&s[0], static_cast<std::streamsize>(size));
+        return s;
+    }
+
+    inline void getDoubles(double* values, int n) {
+        in.read(reinterpret_cast<char*>(values), static_cast<std::streamsize>(n * sizeof(double)));
+    }
+
+public:
+    SummaryReader(std::string path) : in(path, std::ios::binary) {
+        if(!in.is_open())
+            throwError("SUMMARY_STATISTICS", "Could not open summary statistics file.", path);
+
+        char magic[sizeof(SUMMARY_MAGIC)];
+        in.read(magic, sizeof(magic));
+        if(!in || !std::equal(magic, magic + sizeof(magic), SUMMARY_MAGIC))
+            throwError("SUMMARY_STATISTICS", "Not a vikNGS summary statistics file.", path);
+
+        uint32_t version = get<uint32_t>();
+        if(version != SUMMARY_VERSION)
+            throwError("SUMMARY_STATISTICS", "Unsupported summary statistics version.", std::to_string(version));
+    }
+
+    /*
+    Reads the next record.
+
+    @param r Record to fill.
+    @return false at the end of the file.
+    */
+    inline bool next(SummaryRecord& r) {
+        r.position = get<uint64_t>();
+        if(!in)
+            return false;
+
+        r.phenotype = get<uint32_t>();
+        r.genotype = get<uint8_t>();
+        r.varianceType = get<uint8_t>();
+        r.setID = getString();
+        int k = static_cast<int>(get<uint32_t>());
+
+        r.variants.resize(static_cast<size_t>(k));
+        for(int i = 0; i < k; i++)
+            r.variants[i] = getString();
+
+        r.P.resize(k, 3);
+        getDoubles(r.P.data(), k * 3);
+        r.weights.resize(k);
+        getDoubles(r.weights.data(), k);
+        r.score.resize(k);
+        getDoubles(r.score.data(), k);
+
+        r.variance.resize(k, k);
+        for(int j = 0; j < k; j++)
+            getDoubles(r.variance.col(j).data(), j + 1);
+        r.variance.triangularView<Eigen::StrictlyLower>() = r.variance.transpose();
+
+        if(!in)
+            throwError("SUMMARY_STATISTICS", "Summary statistics file ends in the middle of a record.");
+
+        return true;
+    }
+};
@@ -78,6 +78,34 @@ struct File {
         return lineNumber;
     }
 
+    inline uint64_t size() {
+        return mmap.size();
+    }
+
+    //byte offset of the next line from the start of the file
+    inline uint64_t offset() {
+        return (currentPage - pagesPerSegment) * pageSize + pos;
+    }
+
+    //moves to a byte offset given by offset()
+    inline void seek(uint64_t offset) {
+        if(offset >= mmap.size()){
+            lastSegment = true;
+            pos = segmentSize;
+            return;
+        }
+
+        uint64_t start = (offset / pageSize) * pageSize;
+        uint64_t mapSize = pagesPerSegment * pageSize;
+
+        mmap.remap(start, mapSize);
+        segmentSize = mmap.mappedSize();
+
+        lastSegment = (start + mapSize) >= mmap.size();
+        currentPage = start / pageSize + pagesPerSegment;
+        pos = offset - start;
+    }
+
     inline bool hasNext() {
         return !lastSegment || (pos < segmentSize);
     }
@@ -36,15 +36,17 @@ Filter filterByVariantInfo(Request *req, std::string &chrom, std::string &pos, s
 Filters variants read from VCF file based on genotype data. Filters each
 genotype separately, fails if a single genotype fails.
 Checks for missing data and filters data for common or rare test.
+A variant is filtered for every phenotype or for none, so all phenotypes
+test the same variants and collapse them into the same sets.
 
 @param req Request object containing filtering parameters.
 @param variant Single variant read from VCF file.
-@param Y Vector of response variable.
+@param Y Response variables, one column per phenotype.
 @param family Specifies case-control or quantatitive for missing filter.
 
 @return Filter enum based on whether or not variant passes the filters.
 */
-Filter filterByGenotypes(Request* req, Variant& variant, VectorXd& Y, Family family) {
+Filter filterByGenotypes(Request* req, Variant& variant, MatrixXd& Y, Family family) {
 
     std::vector<GenotypeSource> genotypes = variant.getAllGenotypes();
     //must pass filter for all genotype sets
@@ -54,9 +56,13 @@ Filter filterByGenotypes(Request* req, Variant& variant, VectorXd& Y, Family fam
         if(!mafTest(P, req->getMAFCutOff(), req->useCommon()))
             return Filter::MAF;
 
+        //too much missing data among the cases or controls of any phenotype
         VectorXd* X = variant.getGenotype(gt);
-        if(!missingTest(X, Y, req->getMissingThreshold(), family))
-            return Filter::MISSING_DATA;
+        for(int j = 0; j < Y.cols(); j++){
+            VectorXd y = Y.col(j);
+            if(!missingTest(X, y, req->getMissingThreshold(), family))
+                return Filter::MISSING_DATA;
+        }
 
         if(!checkVariability(X))
             return Filter::NO_VARIATION;
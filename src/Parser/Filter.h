@@ -14,7 +14,7 @@ inline bool validBase(std::string &base) {
 }
 
 Filter filterByVariantInfo(Request * req, std::string &chrom, std::string &pos, std::string &ref, std::string &alt, std::string &filter);
-Filter filterByGenotypes(Request *req, Variant &variant, VectorXd &Y, Family family);
+Filter filterByGenotypes(Request *req, Variant &variant, MatrixXd &Y, Family family);
 
 bool mafTest(Vector3d* P, double mafCutoff, bool keepCommon);
 bool checkVariability(VectorXd* X);
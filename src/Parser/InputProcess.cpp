@@ -3,15 +3,32 @@
 #include "../Test/Test.h"
 #include "File.h"
 #include "../Output/OutputHandler.h"
+#include "../Output/ResultWriter.h"
+#include "../Output/Checkpoint.h"
+#include "../Output/ShardInfo.h"
 #include "../Request.h"
 #include "../SampleInfo.h"
 #include "../vikNGS.h"
 #include "../Log.h"
 
-#include <future>
-#include <thread>
+#include "../BlockingQueue.h"
+#include "../MemoryBudget.h"
+#include "../PipelineStats.h"
+#include "../ThreadPool.h"
+#include "../Trace.h"
+#include "../PerfCounters.h"
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <queue>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 static const std::string ERROR_SOURCE = "INPUT_PARSER";
 
@@ -25,7 +42,7 @@ SampleInfo parseSampleInfo(Request & req) {
 
     validateSampleIDs(dir, IDmap);
 
-    sampleInfo.setY(parseSamplePhenotype(dir, IDmap));
+    sampleInfo.setPhenotypes(parseSamplePhenotype(dir, IDmap));
     sampleInfo.setG(parseSampleGroupID(dir, IDmap));
 
     VectorXi G = sampleInfo.getG();
@@ -38,15 +55,28 @@ SampleInfo parseSampleInfo(Request & req) {
 
     if(sampleInfo.hasCovariates())
         printInfo(std::to_string(sampleInfo.ncov()) + " covariates parsed");
+    if(sampleInfo.nphenotypes() > 1)
+        printInfo(std::to_string(sampleInfo.nphenotypes()) + " phenotypes parsed");
 
     return sampleInfo;
 }
 
-std::vector<Variant> constructVariants(Request* req, SampleInfo* sampleInfo, std::vector<std::string> &lines){
+/*
+Parses and filters a batch of VCF lines.
+
+@param lines VCF lines.
+@param ends Byte offset just past each line.
+@param firstLine Number of variant lines before the batch.
+
+@return Every variant that is not ignored, filtered ones included.
+*/
+std::vector<Variant> constructVariants(Request* req, SampleInfo* sampleInfo, std::vector<std::string> &lines,
+                                       std::vector<uint64_t> &ends, uint64_t firstLine){
 
     bool getVCFCalls = req->requireVCFCalls();
     bool calculateExpected = req->requireExpectedGenotypes();
     bool calculateCalls = req->requireGenotypeCalls();
+    MatrixXd Y = sampleInfo->getPhenotypes();
 
     std::vector<Variant> variants;
     variants.reserve(lines.size());
@@ -74,10 +104,8 @@ std::vector<Variant> constructVariants(Request* req, SampleInfo* sampleInfo, std
             std::vector<std::string> columns = splitString(lines[i], VCF_SEP);
             variant = constructVariant(columns, calculateExpected, calculateCalls, getVCFCalls);
 
-            if(variant.isValid()){
-                VectorXd Y = sampleInfo->getY();
+            if(variant.isValid())
                 filter = filterByGenotypes(req, variant, Y, sampleInfo->getFamily());
-            }
             else
                 continue;
 
@@ -87,6 +115,7 @@ std::vector<Variant> constructVariants(Request* req, SampleInfo* sampleInfo, std
             catch(...){ continue; }
 
         variant.setFilter(filter);
+        variant.setVCFLocation(ends[i], firstLine + i + 1);
         variants.push_back(variant);
     }
     variants.shrink_to_fit();
@@ -202,326 +231,864 @@ bool testBatch(Request* req, SampleInfo* sampleInfo, std::vector<VariantSet*> &v
     if(req->useBootstrap())
         nboot = req->bootstrapSize();
 
-    for(int i = 0; i < variants.size(); i++){
-        for(TestSettings t : req->getTests()){
-            if(variants[i]->validSize() > 0){
-                double pval = runTest(sampleInfo, variants[i], t, nboot, req->useStopEarly());
-                variants[i]->addPval(pval);
+    std::vector<TestSettings> tests = req->getTests();
+    int ntraits = sampleInfo->nphenotypes();
+    int nsets = static_cast<int>(variants.size());
+
+    //p-values of test j and phenotype p are stored at index j * ntraits + p
+    MatrixXd pvals = MatrixXd::Constant(nsets, static_cast<int>(tests.size()) * ntraits, NAN);
+
+    //tests that share a test object are run together, see runTests
+    std::vector<std::vector<int>> groups;
+
+    for(size_t j = 0; j < tests.size(); j++){
+        TestSettings& t = tests[j];
+        t.setBootstrapBatchSize(req->getBootstrapBatchSize());
+        t.setSeed(req->getSeed());
+        t.setStopHits(req->getStopHits());
+        t.setDaviesThreshold(req->getDaviesThreshold());
+        t.setDaviesAccuracy(req->getDaviesAccuracy());
+        t.setDaviesLimit(req->getDaviesLimit());
+        t.setSaddlepoint(req->useSaddlepoint());
+        int first = static_cast<int>(j) * ntraits;
+
+        //asymptotic common tests are evaluated for the whole batch and all phenotypes at once,
+        //which skips the per set score and variance needed for summary statistics
+        if(nboot <= 1 && t.isCommonTest() && !t.useSaddlepoint() && SUMMARY_WRITER == nullptr){
+            pvals.middleCols(first, ntraits) = runCommonTestBlock(sampleInfo, variants, t);
+            continue;
+        }
+
+        size_t g = 0;
+        while(g < groups.size() && !tests[groups[g][0]].sharesTestObject(t))
+            g++;
+        if(g == groups.size())
+            groups.push_back(std::vector<int>());
+        groups[g].push_back(static_cast<int>(j));
+    }
+
+    for(int p = 0; p < ntraits; p++){
+        for(std::vector<int>& group : groups){
+
+            std::vector<TestSettings> grouped;
+            for(int j : group){
+                TestSettings t = tests[j];
+                t.setPhenotype(p);
+                t.setIndex(j * ntraits + p);
+                grouped.push_back(t);
+            }
+
+            for(int i = 0; i < nsets; i++){
+                if(variants[i]->validSize() < 1)
+                    continue;
+
+                VectorXd result = runTests(sampleInfo, variants[i], grouped, nboot, req->useStopEarly());
+                for(size_t k = 0; k < group.size(); k++)
+                    pvals(i, group[k] * ntraits + p) = result[static_cast<int>(k)];
             }
         }
     }
 
+    for(int i = 0; i < nsets; i++)
+        if(variants[i]->validSize() > 0)
+            for(int k = 0; k < pvals.cols(); k++)
+                variants[i]->addPval(pvals(i, k));
+
     return true;
 }
 
-class ParallelProcess
-{
-private:
-    Request* req;
-    SampleInfo* sampleInfo;
-
+//========================================================
+// Staged pipeline used by processVCF:
+//   read -> parse and filter -> collapse -> test -> collect
+// Reading, collapsing and collecting each have a thread, as
+// they work in VCF order and mostly wait. Parsing and testing
+// are tasks on the shared ThreadPool, so the same workers
+// parse, test and run bootstrap chunks. Each stage has a
+// bounded number of batches in flight, so a stage sleeps
+// while it has no input or the next stage is behind. With a
+// memory budget the reader also waits while the batches of
+// the later stages hold more bytes than the budget. Batches
+// carry their position in the VCF so the ordered stages can
+// restore it, and the bytes charged to their stage. Test
+// batches are sized by the estimated cost of their sets.
+// Tested sets go to a writer thread that writes their
+// p-values in VCF order as soon as every earlier set is done
+// and from time to time saves a checkpoint to resume from.
+// A shard starts reading at the last line before its part of
+// the VCF that no set continues over, only tests its own sets
+// and stops once a set starts after its part. Every
+// stage reports its batches and waits to PipelineStats, and
+// a monitor thread prints the progress from time to time.
+//========================================================
+
+struct LineBatch {
+    size_t index;
+    size_t bytes;
+    uint64_t firstLine;
     std::vector<std::string> lines;
+    std::vector<uint64_t> ends;
+};
+
+struct VariantBatch {
+    size_t index;
+    size_t bytes;
+    uint64_t end;
     std::vector<Variant> variants;
-    std::vector<VariantSet*> pointers;
+};
 
-    VariantSet leftover;
+struct SetBatch {
+    size_t index;
+    size_t bytes;
+    std::vector<VariantSet> sets;
+};
 
-    bool collapsing;
-    bool parsing;
-    bool testing;
+static const size_t BYTES_PER_MB = 1024 * 1024;
 
-    std::future<std::vector<Variant>> futureVariants;
-    std::future<std::vector<VariantSet>> futureVariantSets;
-    std::future<bool> testingDone;
+//genes differ a lot in size, small test batches keep the workers balanced
+static const size_t GENE_TEST_BATCH = 3;
 
-public:
+/*
+Estimated work of testing a set of k valid variants on n samples: about n*k^2 for the
+variance and n*k for the score, repeated by every bootstrap iteration.
+*/
+inline double estimateTestCost(int k, int nsamples, int nboot){
+    double n = nsamples;
+    return (n * k * k + n * k) * (1 + nboot);
+}
 
-    ParallelProcess(Request *r, SampleInfo *si) : req(r), sampleInfo(si) {
-        collapsing = false;
-        parsing = false;
-        testing = false;
-    }
+//floor(size * k / count) without overflowing
+inline uint64_t shardBoundary(uint64_t size, uint64_t k, uint64_t count){
+    return size / count * k + size % count * k / count;
+}
+
+//CHROM and POS of a variant line, false if it is not one
+inline bool variantPosition(std::string& line, std::string& chrom, int& pos){
+    std::vector<std::string> columns = splitString(line, VCF_SEP, FORMAT - 1);
+    if(columns.size() < FORMAT)
+        return false;
+    try{ pos = std::stoi(columns[POS]); }
+    catch(...){ return false; }
+    chrom = columns[CHROM];
+    return true;
+}
 
-    inline bool isRunning(){ return collapsing || parsing || testing; }
-    inline bool isParsing(){ return parsing; }
-    inline bool isCollapsing(){ return collapsing; }
-    inline bool isTesting(){ return testing; }
+//no interval of a sorted VCF holds variants on both sides of the gap from a to b
+inline bool setsEndBetween(IntervalSet* is, std::string& chromA, int a, std::string& chromB, int b){
+    if(chromA != chromB)
+        return true;
+    if(a > b)
+        return false;
 
-    //---------------------------------------------------
-    void parseAndFilter(std::deque<std::string>& lns, size_t n){
-        n = (lns.size() < n) ? lns.size() : n;
-        if(n < 1) return;
-        lines.clear(); lines.reserve(n);
+    for(Interval& interval : *is->get(chromA))
+        if(interval.start <= a && interval.end >= b)
+            return false;
+    return true;
+}
+
+/*
+Offset from which a shard collapses the VCF as if it had read every line before it: the
+start of a line that no set continues over. Every line starts a set of single variants,
+and a set along a BED file cannot continue over a gap that no interval covers, so the
+lines before the shard are searched backwards for one, splitting out only CHROM and POS.
+Sets of k variants depend on every variant before them, so these shards read from the start.
+
+@param dataStart Offset of the first variant line.
+@param begin First byte of the shard, see shardBoundary.
+
+@return Offset to read from, dataStart when the lines before the shard are needed.
+*/
+uint64_t shardStartOffset(Request* req, uint64_t dataStart, uint64_t begin){
+    bool single = req->getCollapseType() == CollapseType::NONE || (req->shouldCollapseK() && req->getCollapseSize() < 2);
+    bool bed = req->shouldCollapseBed();
+    if(begin <= dataStart || (!single && !bed))
+        return dataStart;
+
+    std::ifstream in(req->getVCFDir(), std::ios::binary);
+    if(!in.is_open())
+        return dataStart;
+
+    //windows before the shard grow until they hold a line a set cannot continue over
+    for(uint64_t window = 1 << 16; ; window *= 2){
+        uint64_t lo = (begin - dataStart > window) ? begin - window : dataStart;
+        std::string bytes(static_cast<size_t>(begin - lo), '\0');
+        in.clear();
+        in.seekg(static_cast<std::streamoff>(lo));
+        in.read(&bytes[0], static_cast<std::streamsize>(bytes.size()));
+
+        //whole lines of the window, the last one holds the first byte of the shard
+        std::vector<uint64_t> starts;
+        if(lo == dataStart)
+            starts.push_back(lo);
+        for(size_t i = 0; i < bytes.size(); i++)
+            if(bytes[i] == '\n')
+                starts.push_back(lo + i + 1);
+
+        if(starts.size() < 1)
+            continue;
+        if(single)
+            return starts.back();
+
+        //lines that are not variants never reach a set and are passed over
+        std::string line, chrom, laterChrom;
+        int pos = 0, laterPos = 0;
+        uint64_t laterStart = starts.back();
+
+        in.clear();
+        in.seekg(static_cast<std::streamoff>(starts.back()));
+        std::getline(in, line);
+        bool hasLater = variantPosition(line, laterChrom, laterPos);
+
+        for(size_t j = starts.size() - 1; j > 0; j--){
+            line = bytes.substr(static_cast<size_t>(starts[j - 1] - lo), static_cast<size_t>(starts[j] - starts[j - 1] - 1));
+            if(!variantPosition(line, chrom, pos))
+                continue;
 
-        parsing = true;
+            if(hasLater && setsEndBetween(req->getIntervals(), chrom, pos, laterChrom, laterPos))
+                return laterStart;
 
-        for(size_t i = 0; i < n; i++){
-            lines.push_back(lns.front());
-            lns.pop_front();
+            laterChrom = chrom;
+            laterPos = pos;
+            laterStart = starts[j - 1];
+            hasLater = true;
         }
 
-        futureVariants = std::async(std::launch::async,
-                [this] { return constructVariants(req, sampleInfo, lines); }) ;
-    }
-    inline bool isParseDone(){
-        return parsing && futureVariants.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        if(lo == dataStart)
+            return dataStart;
     }
+}
 
-    inline std::vector<Variant> getFilterResults(){
-        parsing = false;
-        lines.clear();
-        return futureVariants.get();
+class VCFPipeline
+{
+private:
+    Request* req;
+    SampleInfo* sampleInfo;
+    ThreadPool* pool;
+    size_t batchSize;
+
+    //test batches are cut at about the cost of setsPerBatch sets of the average cost of the
+    //sets waiting to be sent
+    int nsamples;
+    int nboot;
+    size_t setsPerBatch;
+
+    //a slot is taken when a batch is submitted and given back when the next stage takes the result,
+    //so the queues never hold more batches than there are slots
+    StageSlots parseSlots;
+    StageSlots testSlots;
+    BlockingQueue<VariantBatch> parsed;
+    BlockingQueue<SetBatch> tested;
+
+    TaskGroup parseTasks;
+    TaskGroup testTasks;
+
+    MemoryBudget memory;
+
+    PipelineStats& stats;
+    //time collapse spent waiting for test slots
+    double sendWait;
+    std::atomic<size_t> reorderDepth;
+
+    std::mutex monitorLock;
+    std::condition_variable monitorSignal;
+    bool finished;
+
+    //where a resumed run starts, or the start of the VCF
+    Checkpoint start;
+    int checkpointInterval;
+    //filtered variants written so far, updated by collapse
+    std::mutex filteredLock;
+    uint64_t filteredEnd;
+    uint64_t filteredBytes;
+
+    //sets whose first variant ends in (shardBegin, shardEnd] are tested
+    uint64_t shardBegin;
+    uint64_t shardEnd;
+    std::atomic<bool> pastShard;
+    //first set sent to the test stage, the writer starts there
+    std::atomic<int> firstSequence;
+    bool owning;
+
+    std::mutex errorLock;
+    std::exception_ptr error;
+
+    //stops every stage after an exception, which is rethrown by run
+    void fail(){
+        {
+            std::lock_guard<std::mutex> guard(errorLock);
+            if(!error)
+                error = std::current_exception();
+        }
+        parseSlots.abort();
+        testSlots.abort();
+        parsed.abort();
+        tested.abort();
+        memory.abort();
     }
+
     //---------------------------------------------------
+    void parse(LineBatch& batch){
+        try{
+            TraceSpan span("parse", "lines", static_cast<long long>(batch.lines.size()));
+            StatClock::time_point begin = StatClock::now();
+            PerfScope counters(PerfStage::PARSE, 0);
+
+            VariantBatch result;
+            result.index = batch.index;
+            result.end = batch.ends.back();
+            result.variants = constructVariants(req, sampleInfo, batch.lines, batch.ends, batch.firstLine);
+            batch.lines = std::vector<std::string>();
+            counters.setItems(result.variants.size());
+
+            result.bytes = 0;
+            for(size_t i = 0; i < result.variants.size(); i++)
+                result.bytes += result.variants[i].memoryUsage();
+
+            stats.addBatch(StatStage::PARSE, result.variants.size(), secondsSince(begin));
+
+            memory.add(PipelineStage::PARSE, result.bytes);
+            memory.remove(PipelineStage::READ, batch.bytes);
+
+            StatClock::time_point blocked = StatClock::now();
+            parsed.push(std::move(result));
+            stats.addOutputWait(StatStage::PARSE, secondsSince(blocked));
+            stats.sampleQueue(StatQueue::PARSED, parsed.size());
+        }
+        catch(...){ fail(); }
+    }
 
-    void collapse(std::deque<Variant>& v, VariantSet& leftovers, size_t n){
-        n = (v.size() < n) ? v.size() : n;
-        if(n < 1) return;
-        variants.clear(); variants.reserve(n);
+    bool submitParse(LineBatch& batch){
+        StatClock::time_point blocked = StatClock::now();
+        if(!parseSlots.acquire())
+            return false;
+        stats.addOutputWait(StatStage::READ, secondsSince(blocked));
 
-        collapsing = true;
+        memory.add(PipelineStage::READ, batch.bytes);
+        std::shared_ptr<LineBatch> task = std::make_shared<LineBatch>(std::move(batch));
+        pool->submit(parseTasks, [this, task]{ parse(*task); });
+        return true;
+    }
 
-        for(size_t i = 0; i < n; i++){
-            variants.push_back(v.front());
-            v.pop_front();
+    void read(File& vcf, size_t& totalLineCount){
+        traceThreadName("reader");
+        try{
+            LineBatch batch;
+            batch.index = 0;
+            batch.bytes = 0;
+            batch.firstLine = totalLineCount;
+            bool reading = true;
+            StatClock::time_point begin = StatClock::now();
+
+            while(reading && vcf.hasNext() && !STOP_RUNNING_THREAD && !pastShard){
+                //nothing more is read while the later stages are over the budget
+                if(batch.lines.size() < 1){
+                    StatClock::time_point blocked = StatClock::now();
+                    if(!memory.waitForRoom())
+                        break;
+                    stats.addOutputWait(StatStage::READ, secondsSince(blocked));
+                    begin = StatClock::now();
+                }
+
+                batch.lines.emplace_back(vcf.nextLine());
+                batch.bytes += sizeof(std::string) + batch.lines.back().capacity();
+                batch.ends.push_back(vcf.offset());
+                totalLineCount++;
+
+                if(batch.lines.size() < batchSize)
+                    continue;
+
+                stats.addBatch(StatStage::READ, batch.lines.size(), secondsSince(begin));
+                printInfo(std::to_string(totalLineCount) + " variant lines have been parsed so far.");
+                size_t next = batch.index + 1;
+                reading = submitParse(batch);
+
+                batch = LineBatch();
+                batch.index = next;
+                batch.bytes = 0;
+                batch.firstLine = totalLineCount;
+            }
+
+            if(reading && batch.lines.size() > 0){
+                stats.addBatch(StatStage::READ, batch.lines.size(), secondsSince(begin));
+                submitParse(batch);
+            }
+
+            pool->wait(parseTasks);
+            printInfo("A total of " + std::to_string(totalLineCount) + " variants were parsed from the VCF file.");
         }
+        catch(...){ fail(); }
 
-        this->leftover = leftovers;
-        futureVariantSets = std::async(std::launch::async,
-                [this] { return collapseVariants(req, variants, leftover); }) ;
-    }
-    inline bool isCollapseDone(){
-        return collapsing && futureVariantSets.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
-    }
-    inline std::vector<VariantSet> getCollapseResults(){
-        collapsing = false;
-        variants.clear();
-        return futureVariantSets.get();
+        parsed.close();
     }
+
     //---------------------------------------------------
+    void test(SetBatch& batch){
+        try{
+            std::vector<VariantSet*> pointers;
+            for(size_t i = 0; i < batch.sets.size(); i++)
+                pointers.push_back(&batch.sets[i]);
+
+            StatClock::time_point begin = StatClock::now();
+            {
+                TraceSpan span("test batch", "sets", static_cast<long long>(batch.sets.size()));
+                testBatch(req, sampleInfo, pointers);
+            }
+            stats.addBatch(StatStage::TEST, batch.sets.size(), secondsSince(begin));
 
-    void beginAssociationTest(std::deque<VariantSet*>& vs, size_t n){
-        n = (vs.size() < n) ? vs.size() : n;
-        if(n < 1) return;
-        pointers.clear(); pointers.reserve(n);
+            StatClock::time_point blocked = StatClock::now();
+            tested.push(std::move(batch));
+            stats.addOutputWait(StatStage::TEST, secondsSince(blocked));
+            stats.sampleQueue(StatQueue::TESTED, tested.size());
+        }
+        catch(...){ fail(); }
+    }
 
-        testing = true;
+    /*
+    Sends the sets in ready to the test stage in batches that cost about as much as setsPerBatch
+    of these sets on average. The most expensive sets go first, so a large gene starts early in a
+    batch of its own while the small sets packed after it fill the gaps. Unless flush is set, the
+    last batch waits for more sets if it is not full.
+
+    @return false once the pipeline has been aborted.
+    */
+    bool sendSets(std::deque<VariantSet>& ready, size_t& nbatches, bool flush){
+        if(ready.size() < 1)
+            return true;
+
+        std::vector<double> cost(ready.size());
+        double total = 0;
+        for(size_t i = 0; i < ready.size(); i++){
+            cost[i] = estimateTestCost(ready[i].validSize(), nsamples, nboot);
+            total += cost[i];
+        }
 
-        for(size_t i = 0; i < n; i++){
-            pointers.push_back(vs.front());
-            vs.pop_front();
+        //scales with the sizes of the sets at hand, so a few large genes are not packed together
+        double batchCost = total / ready.size() * setsPerBatch;
+        if(!flush && ready.size() < setsPerBatch)
+            return true;
+
+        std::vector<size_t> order(ready.size());
+        for(size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&cost](size_t a, size_t b){ return cost[a] > cost[b]; });
+
+        std::vector<std::vector<size_t>> batches;
+        double lastCost = 0;
+        for(size_t i : order){
+            if(batches.size() < 1 || lastCost + cost[i] > batchCost || batches.back().size() >= batchSize){
+                batches.push_back(std::vector<size_t>());
+                lastCost = 0;
+            }
+            batches.back().push_back(i);
+            lastCost += cost[i];
         }
 
-        testingDone = std::async(std::launch::async,
-                [this] { return testBatch(req, sampleInfo, pointers); }) ;
-    }
-    inline bool isTestingDone(){
-        return testing && testingDone.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        size_t nsend = batches.size();
+        if(!flush && lastCost < batchCost && batches.back().size() < setsPerBatch)
+            nsend--;
+
+        for(size_t b = 0; b < nsend; b++){
+            StatClock::time_point blocked = StatClock::now();
+            if(!testSlots.acquire())
+                return false;
+            double waited = secondsSince(blocked);
+            sendWait += waited;
+            stats.addOutputWait(StatStage::COLLAPSE, waited);
+
+            std::shared_ptr<SetBatch> batch = std::make_shared<SetBatch>();
+            batch->index = nbatches++;
+            for(size_t i : batches[b])
+                batch->sets.push_back(std::move(ready[i]));
+
+            batch->bytes = 0;
+            for(size_t i = 0; i < batch->sets.size(); i++)
+                batch->bytes += batch->sets[i].memoryUsage();
+            memory.add(PipelineStage::TEST, batch->bytes);
+
+            pool->submit(testTasks, [this, batch]{ test(*batch); });
+        }
+
+        //the sets of the unsent batch stay, in VCF order
+        std::deque<VariantSet> remaining;
+        if(nsend < batches.size()){
+            std::vector<size_t> last = batches.back();
+            std::sort(last.begin(), last.end());
+            for(size_t i : last)
+                remaining.push_back(std::move(ready[i]));
+        }
+        ready.swap(remaining);
+
+        return true;
     }
 
-    inline void setDone(){
-        parsing = false;
-        collapsing = false;
-        testing = false;
-        pointers.clear();
-        lines.clear();
-        variants.clear();
-        return;
+    inline bool inShard(uint64_t vcfEnd){
+        return vcfEnd > shardBegin && vcfEnd <= shardEnd;
     }
 
-};
+    //sets outside the shard are numbered like the others but never tested
+    void queueSet(VariantSet& set, std::deque<VariantSet>& ready){
+        uint64_t first = set.getFirstVCFEnd();
+        if(first > shardEnd){
+            pastShard = true;
+            return;
+        }
+        if(!inShard(first))
+            return;
 
-std::vector<VariantSet> processVCF(Request &req, SampleInfo &sampleInfo, size_t& totalLineCount) {
-    std::vector<VariantSet> results;
+        if(!owning){
+            firstSequence = set.getSequence();
+            owning = true;
+        }
+        ready.push_back(set);
+    }
 
-    size_t nthreads = std::max(1, req.getNumberThreads());
-    std::vector<ParallelProcess> threads;
-    for(size_t i = 0; i < nthreads; i++)
-        threads.emplace_back(&req, &sampleInfo);
+    //variants held by collapse, charged again after every batch
+    size_t collapseBytes(std::deque<Variant>& pending, std::deque<VariantSet>& ready, VariantSet& leftover){
+        size_t bytes = leftover.memoryUsage();
+        for(size_t i = 0; i < pending.size(); i++)
+            bytes += pending[i].memoryUsage();
+        for(size_t i = 0; i < ready.size(); i++)
+            bytes += ready[i].memoryUsage();
+        return bytes;
+    }
 
-    std::queue<ParallelProcess*> parseOrder;
-    std::queue<ParallelProcess*> collapseOrder;
+    void collapse(){
+        traceThreadName("collapse");
+        try{
+            std::map<size_t, VariantBatch> waiting;
+            size_t next = 0;
+
+            std::deque<Variant> pending;
+            std::deque<VariantSet> ready;
+            VariantSet leftover;
+            //numbers the sets in VCF order, the writer restores it
+            int nsets = start.sequence;
+            size_t nbatches = 0;
+
+            bool done = false;
+            bool sending = true;
+            while(!done && sending){
+                VariantBatch batch;
+                StatClock::time_point blocked = StatClock::now();
+                done = !parsed.pop(batch);
+                stats.addInputWait(StatStage::COLLAPSE, secondsSince(blocked));
+
+                TraceSpan span("collapse");
+                StatClock::time_point begin = StatClock::now();
+                double waited = sendWait;
+                int first = nsets;
+                if(!done){
+                    parseSlots.release();
+                    waiting[batch.index] = std::move(batch);
+                }
 
-    File vcf;
-    vcf.open(req.getVCFDir());
+                //parse tasks finish out of order
+                while(waiting.count(next) > 0){
+                    std::vector<Variant>& v = waiting[next].variants;
+                    if(pastShard)
+                        v.clear();
+
+                    //a resumed run has already written the filtered variants up to start.filteredEnd
+                    std::vector<Variant> filtered;
+                    for(size_t i = 0; i < v.size(); i++){
+                        if(v[i].isValid())
+                            pending.push_back(v[i]);
+                        else if(req->shouldKeepFiltered() && v[i].getVCFEnd() > start.filteredEnd && inShard(v[i].getVCFEnd()))
+                            filtered.push_back(v[i]);
+                    }
+
+                    if(filtered.size() > 0){
+                        TraceSpan writing("write filtered", "variants", static_cast<long long>(filtered.size()));
+                        outputFiltered(filtered, req->getOutputDir(), req->getRequestName());
+                    }
+
+                    if(waiting[next].end > filteredEnd){
+                        std::lock_guard<std::mutex> guard(filteredLock);
+                        filteredEnd = waiting[next].end;
+                        if(filtered.size() > 0)
+                            filteredBytes = fileSize(fileName(req->getOutputDir(), ffile, req->getRequestName()));
+                    }
+
+                    memory.remove(PipelineStage::PARSE, waiting[next].bytes);
+                    waiting.erase(next++);
+                }
 
-    totalLineCount = 0;
-    size_t batchSize = static_cast<size_t>(req.getBatchSize());
+                //sets are cut from batchSize variants at a time, and from whatever remains at the end
+                while(sending && (pending.size() >= batchSize || (done && pending.size() > 0))){
+                    size_t n = std::min(batchSize, pending.size());
+                    std::vector<Variant> variants(pending.begin(), pending.begin() + n);
+                    pending.erase(pending.begin(), pending.begin() + n);
 
-    std::deque<std::string> lines;
-    std::deque<Variant> constructedVariants;
-    std::deque<VariantSet> collapsedVariants;
-    std::deque<VariantSet*> readyToRun;
+                    std::vector<VariantSet> sets = collapseVariants(req, variants, leftover);
+                    leftover = VariantSet();
 
-    VariantSet leftover;
+                    //the last set may continue in the next chunk
+                    if(sets.size() > 0){
+                        leftover = sets.back();
+                        sets.pop_back();
+                    }
 
-    //skips header
-    extractHeaderLine(vcf);
-    bool allParsingDone = false;
-    bool allCollapsingDone = false;
-    bool allTestingDone = false;
+                    for(size_t i = 0; i < sets.size(); i++){
+                        sets[i].setSequence(nsets++);
+                        queueSet(sets[i], ready);
+                    }
 
-    while (!allParsingDone || !allCollapsingDone || !allTestingDone){
-
-        if(STOP_RUNNING_THREAD)
-            break;
+                    sending = sendSets(ready, nbatches, false);
+                }
 
-        //read in line if batch not full
-        if(vcf.hasNext() && lines.size() < batchSize){
-            lines.emplace_back(vcf.nextLine());
-            totalLineCount++;
+                //everything after the first set past the shard is past it too
+                if(pastShard){
+                    pending.clear();
+                    leftover = VariantSet();
+                }
 
-            if(totalLineCount % batchSize == 0){
-                if(totalLineCount == 0)
-                    printInfo("Parsing VCF file...");
-                else
-                    printInfo(std::to_string(totalLineCount) + " variant lines have been parsed so far.");
+                memory.set(PipelineStage::COLLAPSE, collapseBytes(pending, ready, leftover));
+                stats.addBatch(StatStage::COLLAPSE, static_cast<size_t>(nsets - first), secondsSince(begin) - (sendWait - waited));
             }
-        }
 
-        //check if parse thread is done
-        if(parseOrder.size() > 0 && parseOrder.front()->isParseDone()){
-            std::vector<Variant> v = parseOrder.front()->getFilterResults();
-            parseOrder.pop();
-
-            std::vector<Variant> filtered;
-            for(size_t i = 0; i < v.size(); i++){
-                if(v[i].isValid())
-                    constructedVariants.push_back(v[i]);
-                else if(req.shouldKeepFiltered())
-                    filtered.push_back(v[i]);
+            StatClock::time_point begin = StatClock::now();
+            double waited = sendWait;
+            int first = nsets;
+
+            if(sending && leftover.size() > 0 && !STOP_RUNNING_THREAD){
+                leftover.setSequence(nsets++);
+                queueSet(leftover, ready);
             }
 
-            if(filtered.size() > 0)
-                outputFiltered(filtered, req.getOutputDir(), req.getRequestName());
+            if(sending)
+                sendSets(ready, nbatches, true);
+            memory.set(PipelineStage::COLLAPSE, 0);
+            stats.addBatch(StatStage::COLLAPSE, static_cast<size_t>(nsets - first), secondsSince(begin) - (sendWait - waited));
 
+            pool->wait(testTasks);
         }
-        if(lines.size() == 0 && parseOrder.size() == 0 && !vcf.hasNext()){
-            if(!allParsingDone)
-                printInfo("A total of " + std::to_string(totalLineCount) + " variants were parsed from the VCF file.");
-            allParsingDone = true;
-        }
+        catch(...){ fail(); }
 
-        //check if collapse thread is done
-        if(collapseOrder.size() > 0 && collapseOrder.front()->isCollapseDone()){
-            std::vector<VariantSet> v = collapseOrder.front()->getCollapseResults();
-            collapseOrder.pop();
+        tested.close();
+    }
 
-            if(v.size() > 0){
-                leftover = v.back();
-                v.pop_back();
+    //---------------------------------------------------
+    void saveProgress(ResultWriter& results){
+        TraceSpan span("checkpoint");
+        Checkpoint c = start;
+        results.fillCheckpoint(c);
+        {
+            std::lock_guard<std::mutex> guard(filteredLock);
+            c.filteredEnd = filteredEnd;
+            c.filteredBytes = filteredBytes;
+        }
+        saveCheckpoint(c, checkpointFile(req->getOutputDir()));
+    }
 
-                for(size_t i = 0; i < v.size(); i++){
-                    collapsedVariants.push_back(v[i]);
-                    readyToRun.push_back(&collapsedVariants.back());
+    void write(ResultWriter& results){
+        traceThreadName("writer");
+        try{
+            std::chrono::steady_clock::time_point lastCheckpoint = std::chrono::steady_clock::now();
+            size_t checkpointed = results.setsWritten();
+
+            SetBatch batch;
+            bool started = false;
+            StatClock::time_point blocked = StatClock::now();
+            while(tested.pop(batch)){
+                testSlots.release();
+                stats.addInputWait(StatStage::WRITE, secondsSince(blocked));
+                StatClock::time_point begin = StatClock::now();
+
+                if(!started)
+                    results.startAt(firstSequence);
+                started = true;
+
+                //the writer puts sets back in VCF order, genotypes kept for plotting leave the budget with their set
+                {
+                    TraceSpan span("write", "sets", static_cast<long long>(batch.sets.size()));
+                    for(VariantSet& set : batch.sets){
+                        if(!req->shouldRetainGenotypes())
+                            set.shrink();
+                        results.add(std::move(set));
+                    }
                 }
-            }
-       }
-
-        if(collapseOrder.size() == 0 && allParsingDone && constructedVariants.size() == 0){
-            allCollapsingDone = true;
-            if(leftover.size() > 0){
-                collapsedVariants.push_back(leftover);
-                readyToRun.push_back(&collapsedVariants.back());
-                VariantSet empty; leftover = empty;
+                memory.remove(PipelineStage::TEST, batch.bytes);
+                reorderDepth = results.pending();
+                stats.sampleQueue(StatQueue::REORDER, reorderDepth);
+
+                //sets finishing after a stop request are not complete, so no checkpoint may include them
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - lastCheckpoint;
+                if(checkpointInterval > 0 && elapsed.count() >= checkpointInterval &&
+                        results.setsWritten() > checkpointed && !STOP_RUNNING_THREAD){
+                    saveProgress(results);
+                    checkpointed = results.setsWritten();
+                    lastCheckpoint = std::chrono::steady_clock::now();
+                }
+
+                stats.addBatch(StatStage::WRITE, batch.sets.size(), secondsSince(begin));
+                blocked = StatClock::now();
             }
         }
+        catch(...){ fail(); }
+    }
 
-        //check if testing thread is done
-        bool allDone = true;
-        for(size_t m = 0; m < nthreads; m++){
-
-            if(threads[m].isTestingDone()){
-                threads[m].setDone();
-                while(collapsedVariants.size() > 0 && collapsedVariants.front().nPvals() > 0 &&
-                      (collapsedVariants.size() < batchSize || collapsedVariants[batchSize-1].nPvals() > 0)){
-                    results.push_back(collapsedVariants.front());
-                    collapsedVariants.pop_front();
-                    if(!req.shouldRetainGenotypes())
-                        results.back().shrink();
-                }
-            }
+    //prints the progress every statsInterval seconds until the other stages are done
+    void monitor(int interval){
+        traceThreadName("monitor");
+        std::unique_lock<std::mutex> guard(monitorLock);
+        while(!monitorSignal.wait_for(guard, std::chrono::seconds(interval), [this]{ return finished; }))
+            printInfo(stats.progress(parsed.size(), tested.size(), reorderDepth));
+    }
 
-            if(threads[m].isRunning())
-                allDone = false;
-        }
+public:
 
-        if(allCollapsingDone && collapsedVariants.size() == 0 && allDone){
-            allTestingDone = true;
-            break;
+    VCFPipeline(Request *r, SampleInfo *si, ThreadPool* threads, int parseBatches, int testBatches, Checkpoint& from, uint64_t vcfSize,
+                PipelineStats& counters) :
+        req(r), sampleInfo(si), pool(threads), batchSize(static_cast<size_t>(r->getBatchSize())),
+        nsamples(si->nsamp()), nboot(r->useBootstrap() ? r->bootstrapSize() : 0),
+        setsPerBatch((r->getCollapseType() == CollapseType::COLLAPSE_EXON || r->getCollapseType() == CollapseType::COLLAPSE_GENE) ?
+                     std::min(GENE_TEST_BATCH, batchSize) : batchSize),
+        parseSlots(static_cast<size_t>(std::max(1, parseBatches))), testSlots(static_cast<size_t>(std::max(1, testBatches))),
+        parsed(static_cast<size_t>(std::max(1, parseBatches))), tested(static_cast<size_t>(std::max(1, testBatches))),
+        memory(r->useMemoryBudget() ? static_cast<size_t>(r->getMaxMemory()) * BYTES_PER_MB : 0),
+        stats(counters), sendWait(0), reorderDepth(0), finished(false), start(from), checkpointInterval(r->getCheckpointInterval()),
+        filteredEnd(from.filteredEnd), filteredBytes(from.filteredBytes),
+        shardBegin(0), shardEnd(UINT64_MAX), pastShard(false), firstSequence(from.sequence), owning(false) {
+
+        if(r->isShard()){
+            uint64_t count = static_cast<uint64_t>(r->getShardCount());
+            uint64_t index = static_cast<uint64_t>(r->getShardIndex());
+            shardBegin = shardBoundary(vcfSize, index, count);
+            shardEnd = shardBoundary(vcfSize, index + 1, count);
         }
 
-        //set up test thread
-        if(readyToRun.size() >= batchSize || (readyToRun.size() > 0 && allCollapsingDone)){
-            for(size_t m = 0; m < nthreads; m++){
-                 if(!threads[m].isRunning()){
-                     int size = batchSize;
-                     if(allCollapsingDone) size = readyToRun.size();
-                     threads[m].beginAssociationTest(readyToRun, size);
-                     break;
-                 }
-             }
-        }
+        stats.setWorkers(StatStage::PARSE, std::min(std::max(1, parseBatches), static_cast<int>(threads->size())));
+        stats.setWorkers(StatStage::TEST, std::min(std::max(1, testBatches), static_cast<int>(threads->size())));
+        stats.setCapacity(StatQueue::PARSED, static_cast<size_t>(std::max(1, parseBatches)));
+        stats.setCapacity(StatQueue::TESTED, static_cast<size_t>(std::max(1, testBatches)));
+    }
 
-        //set up collapse thread
-        if(collapseOrder.size() == 0 && (constructedVariants.size() >= batchSize ||
-                (constructedVariants.size() > 0 && allParsingDone))){
-            for(size_t m = 0; m < nthreads; m++){
-                 if(!threads[m].isRunning()){
-                     threads[m].collapse(constructedVariants, leftover, batchSize);
-                     collapseOrder.push(&threads[m]);
-                     VariantSet empty; leftover = empty;
-                     break;
-                 }
-             }
-        }
+    /*
+    Runs every stage until the whole VCF has been tested and its p-values written.
 
+    @param vcf Opened VCF file, positioned at start.offset.
+    @param totalLineCount Receives the number of variant lines read, start.lines included.
+    @param resumed The output files already hold the results up to start.
 
-        //set up parse thread
-        if(lines.size() >= batchSize || (!vcf.hasNext() && lines.size() > 0)){
-            //start new thread
-            for(size_t m = 0; m < nthreads; m++){
-                 if(!threads[m].isRunning()){
-                     threads[m].parseAndFilter(lines, batchSize);
-                     parseOrder.push(&threads[m]);
-                     break;
-                 }
-             }
-        }
+    @return Tested variant sets in VCF order if they are kept for plotting, otherwise empty.
+    */
+    std::vector<VariantSet> run(File& vcf, size_t& totalLineCount, bool resumed){
 
-        //set up small test thread
-        if(readyToRun.size() > 0){
-            if(req.getCollapseType() == CollapseType::COLLAPSE_EXON ||
-                    req.getCollapseType() == CollapseType::COLLAPSE_GENE){
-                for(size_t m = 0; m < nthreads; m++){
-                     if(!threads[m].isRunning()){
-                         int size = (readyToRun.size() < 3) ? readyToRun.size() : 3;
-                         threads[m].beginAssociationTest(readyToRun, size);
-                         break;
-                     }
-                }
-            }
+        std::vector<TestSettings> tests = req->getTests();
+        ResultWriter results(req->getOutputDir(), req->getRequestName(), tests[0], sampleInfo->nphenotypes(), req->shouldPlot(),
+                             start, resumed);
+
+        stats.start();
+        std::thread reader([this, &vcf, &totalLineCount]{ read(vcf, totalLineCount); });
+        std::thread collapser([this]{ collapse(); });
+        std::thread writer([this, &results]{ write(results); });
+
+        int interval = req->getStatsInterval();
+        std::thread monitoring;
+        if(interval > 0)
+            monitoring = std::thread([this, interval]{ monitor(interval); });
+
+        reader.join();
+        collapser.join();
+        writer.join();
+
+        {
+            std::lock_guard<std::mutex> guard(monitorLock);
+            finished = true;
         }
+        monitorSignal.notify_all();
+        if(monitoring.joinable())
+            monitoring.join();
+
+        stats.stop();
+        stats.recordMemory(memory);
+
+        if(error)
+            std::rethrow_exception(error);
+
+        StatStage busiest = stats.getBusiestStage();
+        printInfo("Busiest pipeline stage: " + stats.getStage(busiest).name + " (" +
+                  std::to_string(static_cast<int>(100 * stats.getUtilisation(busiest) + 0.5)) + "% of the time of its workers)");
+
+        if(memory.getLimit() > 0)
+            printInfo("Peak memory held by the VCF batches: " + std::to_string((memory.getPeak() + BYTES_PER_MB - 1) / BYTES_PER_MB) +
+                      " MB (budget " + std::to_string(memory.getLimit() / BYTES_PER_MB) + " MB)");
+
+        std::vector<VariantSet> kept = results.finish();
+
+        if(req->isShard() && !STOP_RUNNING_THREAD){
+            ShardInfo shard;
+            shard.index = req->getShardIndex();
+            shard.count = req->getShardCount();
+            shard.vcf = req->getVCFDir();
+            shard.vcfSize = vcf.size();
+            shard.pvalues = fileName("", pfile, req->getRequestName()).substr(1);
+            shard.filtered = fileName("", ffile, req->getRequestName()).substr(1);
+            shard.pvalueBytes = results.getBytes();
+            saveShardInfo(shard, shardFile(req->getOutputDir(), req->getRequestName()));
+        }
+
+        //a stopped run keeps its last checkpoint
+        if(!STOP_RUNNING_THREAD)
+            std::remove(checkpointFile(req->getOutputDir()).c_str());
 
+        return kept;
     }
+};
+
+std::vector<VariantSet> processVCF(Request &req, SampleInfo &sampleInfo, size_t& totalLineCount, PipelineStats& stats, Checkpoint* resumeFrom) {
+
+    File vcf;
+    vcf.open(req.getVCFDir());
 
-    while(true){
-        bool threadsDone = true;
-        for(size_t m = 0; m < nthreads; m++){
-             if(threads[m].isRunning()){
-                 threadsDone = false;
-                 if(threads[m].isTestingDone())
-                     threads[m].setDone();
-                 if(threads[m].isCollapseDone())
-                     threads[m].getCollapseResults();
-                 if(threads[m].isParseDone())
-                     threads[m].getFilterResults();
-             }
+    totalLineCount = 0;
+
+    //skips header
+    extractHeaderLine(vcf);
+
+    Checkpoint start;
+    start.name = req.getRequestName();
+    start.vcf = req.getVCFDir();
+    start.seed = req.getSeed();
+    start.analysis = req.describeAnalysis();
+    start.offset = vcf.offset();
+
+    //a shard skips the lines before it when its first set does not depend on them
+    if(req.isShard() && resumeFrom == nullptr){
+        uint64_t count = static_cast<uint64_t>(req.getShardCount());
+        uint64_t index = static_cast<uint64_t>(req.getShardIndex());
+        uint64_t from = shardStartOffset(&req, start.offset, shardBoundary(vcf.size(), index, count));
+        if(from > start.offset){
+            vcf.seek(from);
+            start.offset = from;
+            printInfo("Shard starts reading the VCF at byte " + std::to_string(from));
         }
+    }
 
-        if(threadsDone)
-            break;
+    if(resumeFrom != nullptr){
+        start = *resumeFrom;
+        truncateFile(fileName(req.getOutputDir(), ffile, req.getRequestName()), start.filteredBytes);
+        vcf.seek(start.offset);
+        totalLineCount = static_cast<size_t>(start.lines);
+        printInfo("Resuming after " + std::to_string(start.lines) + " variant lines and " +
+                  std::to_string(start.sequence) + " variant sets.");
+    }
+
+    printInfo("Parsing VCF file...");
+
+    //without a shared pool (single threaded) the stages use a pool of one worker
+    std::unique_ptr<ThreadPool> single;
+    ThreadPool* pool = THREAD_POOL;
+    if(pool == nullptr){
+        single.reset(new ThreadPool(1));
+        pool = single.get();
     }
 
-    return results;
+    //by default two test batches per worker keep every worker busy while results are collected
+    int testBatches = req.getTestBatches();
+
+    if(req.isShard())
+        printInfo("Testing shard " + std::to_string(req.getShardIndex() + 1) + " of " + std::to_string(req.getShardCount()));
+
+    VCFPipeline pipeline(&req, &sampleInfo, pool, req.getParseThreads(), testBatches, start, vcf.size(), stats);
+    return pipeline.run(vcf, totalLineCount, resumeFrom != nullptr);
 }
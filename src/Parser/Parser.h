@@ -17,7 +17,7 @@ SampleInfo parseSampleInfo(Request & req);
 
 //SampleParser.cpp
 bool validateSampleIDs(std::string sampleDir, std::map<std::string, int> &IDmap);
-VectorXd parseSamplePhenotype(std::string sampleDir, std::map<std::string, int> &IDmap);
+MatrixXd parseSamplePhenotype(std::string sampleDir, std::map<std::string, int> &IDmap);
 VectorXi parseSampleGroupID(std::string sampleDir, std::map<std::string, int> &IDmap);
 std::map<int, Depth> parseSampleReadDepth(std::string sampleDir, std::map<std::string, int> &IDmap, VectorXi& G, int highLowCutOff);
 MatrixXd parseSampleCovariates(std::string sampleDir, std::map<std::string, int> &IDmap);
@@ -12,6 +12,7 @@ static const int GROUP_COL = 2;
 static const int DEPTH_COL = 3;
 static const int COV_COL = 4;
 static const char SAMPLE_SEP = '\t';
+static const char PHENOTYPE_SEP = ',';
 
 /**
 Parses a data file containing tab-separated info for each sample. Verifies the ID column
@@ -79,19 +80,18 @@ bool validateSampleIDs(std::string sampleDir, std::map<std::string, int> &IDmap)
 }
 
 /**
-Parses a data file containing tab-separated info for each sample. Extracts phenotype column as vector.
+Parses a data file containing tab-separated info for each sample. Extracts phenotype column as a matrix.
+Several phenotypes can be given as comma-separated values in the phenotype column, every sample
+must then have the same number of values.
 
 @param sampleDir Directory of tab-separated data file.
 @param IDmap Map that gives a unique int for each sample name.
 
-@return Vector of phenotype data
+@return Matrix of phenotype data, one column per phenotype
 */
-VectorXd parseSamplePhenotype(std::string sampleDir, std::map<std::string, int> &IDmap){
+MatrixXd parseSamplePhenotype(std::string sampleDir, std::map<std::string, int> &IDmap){
 
-
-    VectorXd Y = VectorXd(IDmap.size());
-    for(int i = 0; i < Y.rows(); i++)
-        Y[i] = NAN;
+    MatrixXd Y;
 
     std::vector<std::string> lineSplit;
     std::string line;
@@ -111,16 +111,30 @@ VectorXd parseSamplePhenotype(std::string sampleDir, std::map<std::string, int>
         std::string sampleID = lineSplit[ID_COL];
         int index = IDmap[sampleID];
 
-        try {
+        std::vector<std::string> values = splitString(lineSplit[PHENOTYPE_COL], PHENOTYPE_SEP);
+
+        if(Y.cols() == 0)
+            Y = MatrixXd::Constant(static_cast<int>(IDmap.size()), static_cast<int>(values.size()), NAN);
 
-            Y[index] = std::stod(lineSplit[PHENOTYPE_COL]);
+        if(static_cast<int>(values.size()) != Y.cols()){
+            std::string message = "Line " + std::to_string(lineIndex) +
+            " in sample information file - Expected " + std::to_string(Y.cols()) + " phenotype values.";
+            file.close();
+            throwError(ERROR_SOURCE, message, lineSplit[PHENOTYPE_COL]);
         }
-        catch (...) {
-            if(! (lineSplit[PHENOTYPE_COL] == "NA")){
-                std::string message = "Line " + std::to_string(lineIndex) +
-                " in sample information file - Unexpected value non-numeric value in phenotype column. Use NA if missing.";
-                file.close();
-                throwError(ERROR_SOURCE, message, lineSplit[PHENOTYPE_COL]);
+
+        for(size_t j = 0; j < values.size(); j++){
+            try {
+
+                Y(index, static_cast<int>(j)) = std::stod(values[j]);
+            }
+            catch (...) {
+                if(! (trim(values[j]) == "NA")){
+                    std::string message = "Line " + std::to_string(lineIndex) +
+                    " in sample information file - Unexpected value non-numeric value in phenotype column. Use NA if missing.";
+                    file.close();
+                    throwError(ERROR_SOURCE, message, values[j]);
+                }
             }
         }
     }
@@ -0,0 +1,347 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//========================================================
+// Hardware counters of the kernels, read with Linux
+// perf_event_open when --perf-counters is given. Every
+// thread opens one group of counters on its first
+// PerfScope. A scope reads the group when it starts and
+// when it ends and adds the difference to its stage in the
+// thread's totals, so nothing is shared while counting.
+// Scopes nest: parse includes EM. A scope opened for every
+// variant costs two reads of the counters, so EM counts one
+// scope in PERF_EM_SAMPLE and the totals of a sampled stage
+// are scaled up to all of its items. Hosts without a PMU,
+// such as most virtual machines and CI runners, count the
+// software events instead. Without the option, or when the
+// kernel allows neither, the global PERF_COUNTERS is null
+// and a scope costs a single check.
+//========================================================
+
+enum class PerfStage { PARSE, EM, VARIANCE, CQF };
+static const int PERF_STAGES = 4;
+
+enum class PerfEvent { CYCLES, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES };
+static const int PERF_EVENTS = 4;
+
+//counted when the hardware events cannot be opened, task clock is in nanoseconds
+enum class PerfSoftwareEvent { TASK_CLOCK, PAGE_FAULTS };
+static const int PERF_SOFTWARE_EVENTS = 2;
+
+//EM runs once per variant, one of this many is counted
+static const uint32_t PERF_EM_SAMPLE = 64;
+
+inline std::string perfStageName(PerfStage stage){
+    const char* names[PERF_STAGES] = { "parse", "EM", "variance", "CQF" };
+    return names[static_cast<int>(stage)];
+}
+
+//what the items of a stage are, variance is counted once per call as one call covers a whole set
+//or bootstrap chunk
+inline std::string perfStageUnit(PerfStage stage){
+    const char* units[PERF_STAGES] = { "variant", "variant", "variance evaluation", "p-value" };
+    return units[static_cast<int>(stage)];
+}
+
+struct PerfReading {
+    uint64_t enabled = 0;
+    uint64_t running = 0;
+    uint64_t values[PERF_EVENTS] = {};
+};
+
+struct PerfThread {
+    std::vector<int> fds;
+    double counts[PERF_STAGES][PERF_EVENTS] = {};
+    //items of the scopes that were counted, and of every scope
+    uint64_t items[PERF_STAGES] = {};
+    uint64_t seen[PERF_STAGES] = {};
+    uint64_t scopes[PERF_STAGES] = {};
+};
+
+//counter sets of successive runs in one process get different ids, see PerfCounters::thread
+inline uint64_t nextPerfCountersId(){
+    static std::atomic<uint64_t> next(0);
+    return ++next;
+}
+
+class PerfCounters;
+extern PerfCounters* PERF_COUNTERS;
+
+class PerfCounters {
+private:
+    uint64_t id;
+    std::mutex lock;
+    std::vector<std::unique_ptr<PerfThread>> threads;
+    //threads whose counters could not be opened
+    int failedThreads;
+    std::string error;
+    //set by the first thread when the hardware events cannot be opened, before any other thread counts
+    bool software;
+
+    //opens the group of the calling thread, false if the kernel refuses any counter
+    inline bool open(PerfThread& t){
+#ifdef __linux__
+        const uint64_t hardware[PERF_EVENTS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                 PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+        const uint64_t softwareEvents[PERF_SOFTWARE_EVENTS] = { PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_PAGE_FAULTS };
+
+        for(int e = 0; e < events(); e++){
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = software ? PERF_TYPE_SOFTWARE : PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = software ? softwareEvents[e] : hardware[e];
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            //user space only, which perf_event_paranoid up to 2 allows
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            int group = (t.fds.size() > 0) ? t.fds[0] : -1;
+            long fd = syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+            if(fd < 0){
+                std::lock_guard<std::mutex> guard(lock);
+                if(error.size() < 1)
+                    error = std::string("perf_event_open failed: ") + std::strerror(errno);
+                else if(software)
+                    error += std::string(", also for software events: ") + std::strerror(errno);
+                return false;
+            }
+            t.fds.push_back(static_cast<int>(fd));
+        }
+        return true;
+#else
+        std::lock_guard<std::mutex> guard(lock);
+        error = "hardware counters are only available on Linux";
+        return false;
+#endif
+    }
+
+    inline void closeAll(PerfThread& t){
+#ifdef __linux__
+        for(int fd : t.fds)
+            close(fd);
+#endif
+        t.fds.clear();
+    }
+
+    //count of an event of the open group, by its index in PerfEvent or PerfSoftwareEvent
+    inline double count(PerfStage stage, int event){
+        std::lock_guard<std::mutex> guard(lock);
+        int s = static_cast<int>(stage);
+        double sum = 0;
+        for(std::unique_ptr<PerfThread>& t : threads)
+            if(t->items[s] > 0)
+                sum += t->counts[s][event] * t->seen[s] / t->items[s];
+        return sum;
+    }
+
+    inline double countPerItem(PerfStage stage, int event){
+        uint64_t items = getItems(stage);
+        return (items > 0) ? count(stage, event) / items : 0;
+    }
+
+public:
+
+    PerfCounters() : id(nextPerfCountersId()), failedThreads(0), software(false) { }
+
+    ~PerfCounters(){
+        if(PERF_COUNTERS == this)
+            PERF_COUNTERS = nullptr;
+        for(std::unique_ptr<PerfThread>& t : threads)
+            closeAll(*t);
+    }
+
+    //events in the group of every thread
+    inline int events(){ return software ? PERF_SOFTWARE_EVENTS : PERF_EVENTS; }
+
+    //true when the hardware events could not be opened and the software ones are counted
+    inline bool isSoftware(){ return software; }
+
+    //counters of the calling thread, null if they could not be opened
+    inline PerfThread* thread(){
+        static thread_local uint64_t cachedId = 0;
+        static thread_local PerfThread* cached = nullptr;
+
+        if(cachedId != id){
+            std::unique_ptr<PerfThread> t(new PerfThread());
+            bool opened = open(*t);
+
+            //the first thread is opened before the pool starts, see vikNGS.cpp, so the
+            //other threads all open the same events
+            if(!opened && !software && threads.size() < 1 && failedThreads < 1){
+                closeAll(*t);
+                software = true;
+                opened = open(*t);
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            cached = nullptr;
+            if(opened){
+                cached = t.get();
+                threads.push_back(std::move(t));
+            }
+            else{
+                failedThreads++;
+                closeAll(*t);
+            }
+            cachedId = id;
+        }
+        return cached;
+    }
+
+    inline bool read(PerfThread* t, PerfReading& r){
+#ifdef __linux__
+        int n = events();
+        uint64_t buffer[3 + PERF_EVENTS];
+        ssize_t size = static_cast<ssize_t>((3 + n) * sizeof(uint64_t));
+        ssize_t bytes = ::read(t->fds[0], buffer, static_cast<size_t>(size));
+        if(bytes != size || buffer[0] != static_cast<uint64_t>(n))
+            return false;
+
+        r.enabled = buffer[1];
+        r.running = buffer[2];
+        for(int e = 0; e < n; e++)
+            r.values[e] = buffer[3 + e];
+        return true;
+#else
+        (void) t; (void) r;
+        return false;
+#endif
+    }
+
+    inline std::string getError(){ std::lock_guard<std::mutex> guard(lock); return error; }
+    inline int getFailedThreads(){ std::lock_guard<std::mutex> guard(lock); return failedThreads; }
+
+    //totals of every thread, scaled from the counted items to all of them, to be read once the threads are done
+    inline double getCount(PerfStage stage, PerfEvent event){
+        return software ? 0 : count(stage, static_cast<int>(event));
+    }
+
+    inline double getCount(PerfStage stage, PerfSoftwareEvent event){
+        return software ? count(stage, static_cast<int>(event)) : 0;
+    }
+
+    inline uint64_t getItems(PerfStage stage){
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t sum = 0;
+        for(std::unique_ptr<PerfThread>& t : threads)
+            sum += t->seen[static_cast<int>(stage)];
+        return sum;
+    }
+
+    //items whose scopes read the counters
+    inline uint64_t getCountedItems(PerfStage stage){
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t sum = 0;
+        for(std::unique_ptr<PerfThread>& t : threads)
+            sum += t->items[static_cast<int>(stage)];
+        return sum;
+    }
+
+    inline double getIPC(PerfStage stage){
+        double cycles = getCount(stage, PerfEvent::CYCLES);
+        return (cycles > 0) ? getCount(stage, PerfEvent::INSTRUCTIONS) / cycles : 0;
+    }
+
+    //count of an event per item of the stage
+    inline double perItem(PerfStage stage, PerfEvent event){
+        return software ? 0 : countPerItem(stage, static_cast<int>(event));
+    }
+
+    inline double perItem(PerfStage stage, PerfSoftwareEvent event){
+        return software ? countPerItem(stage, static_cast<int>(event)) : 0;
+    }
+
+    //one line on a stage for the run summary
+    inline std::string summary(PerfStage stage){
+        char line[256];
+        if(software){
+            std::snprintf(line, sizeof(line), "%s: %.2f us of task clock and %.2f page faults per %s over %llu %ss",
+                          perfStageName(stage).c_str(), perItem(stage, PerfSoftwareEvent::TASK_CLOCK) / 1000,
+                          perItem(stage, PerfSoftwareEvent::PAGE_FAULTS), perfStageUnit(stage).c_str(),
+                          static_cast<unsigned long long>(getItems(stage)), perfStageUnit(stage).c_str());
+            return line;
+        }
+        std::snprintf(line, sizeof(line), "%s: IPC %.2f, %.2f LLC misses and %.2f branch misses per %s over %llu %ss",
+                      perfStageName(stage).c_str(), getIPC(stage), perItem(stage, PerfEvent::LLC_MISSES),
+                      perItem(stage, PerfEvent::BRANCH_MISSES), perfStageUnit(stage).c_str(),
+                      static_cast<unsigned long long>(getItems(stage)), perfStageUnit(stage).c_str());
+        return line;
+    }
+};
+
+class PerfScope {
+private:
+    PerfCounters* counters;
+    PerfThread* thread;
+    PerfStage stage;
+    uint64_t items;
+    PerfReading begin;
+
+public:
+
+    /*
+    @param stage Stage charged with the counts.
+    @param items Items of the stage handled in the scope, see perfStageUnit.
+    @param sample Counts one scope of the stage in this many on each thread.
+    */
+    PerfScope(PerfStage stage, uint64_t items, uint32_t sample = 1) :
+        counters(PERF_COUNTERS), thread(nullptr), stage(stage), items(items) {
+        if(counters == nullptr)
+            return;
+
+        thread = counters->thread();
+        if(thread == nullptr){
+            counters = nullptr;
+            return;
+        }
+
+        int s = static_cast<int>(stage);
+        thread->seen[s] += items;
+        if(thread->scopes[s]++ % sample != 0 || !counters->read(thread, begin))
+            counters = nullptr;
+    }
+
+    ~PerfScope(){
+        if(counters == nullptr)
+            return;
+
+        PerfReading end;
+        if(!counters->read(thread, end))
+            return;
+
+        //counters sharing the hardware run part of the time, their counts are scaled up to the whole scope
+        uint64_t running = end.running - begin.running;
+        uint64_t enabled = end.enabled - begin.enabled;
+        double scale = (running > 0) ? static_cast<double>(enabled) / running : 0;
+
+        int s = static_cast<int>(stage);
+        for(int e = 0; e < counters->events(); e++)
+            thread->counts[s][e] += (end.values[e] - begin.values[e]) * scale;
+        thread->items[s] += items;
+    }
+
+    //only for scopes that count every time
+    inline void setItems(uint64_t n){
+        if(thread != nullptr)
+            thread->seen[static_cast<int>(stage)] += n - items;
+        items = n;
+    }
+
+    PerfScope(const PerfScope&) = delete;
+    PerfScope& operator=(const PerfScope&) = delete;
+};
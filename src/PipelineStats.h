@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "MemoryBudget.h"
+
+//========================================================
+// Counters of the VCF pipeline, updated once per batch.
+// Every stage counts the items it handled, the time spent
+// on its batches and the time it was blocked waiting for
+// input or for room in the next stage. Stages run on their
+// own thread or on the workers of the pool, so a stage is
+// busy for its share of the time its workers had. The one
+// with the largest share limits the run. Queue depths are
+// sampled as batches are added to them.
+//========================================================
+
+enum class StatStage { READ, PARSE, COLLAPSE, TEST, WRITE };
+static const int STAT_STAGES = 5;
+
+enum class StatQueue { PARSED, TESTED, REORDER };
+static const int STAT_QUEUES = 3;
+
+//batch times are counted in buckets below 1, 2, 4 ... ms, the last one holds the rest
+static const int STAT_BUCKETS = 16;
+
+typedef std::chrono::steady_clock StatClock;
+
+inline double secondsSince(StatClock::time_point t){
+    return std::chrono::duration<double>(StatClock::now() - t).count();
+}
+
+struct StageStats {
+    std::string name;
+    std::string unit;
+    int workers = 1;
+    uint64_t batches = 0;
+    uint64_t items = 0;
+    double busy = 0;
+    double inputWait = 0;
+    double outputWait = 0;
+    uint64_t histogram[STAT_BUCKETS] = {};
+};
+
+struct QueueStats {
+    std::string name;
+    //0 for a buffer without a limit
+    size_t capacity = 0;
+    uint64_t samples = 0;
+    double total = 0;
+    size_t max = 0;
+};
+
+class PipelineStats {
+private:
+    StageStats stages[STAT_STAGES];
+    QueueStats queues[STAT_QUEUES];
+    size_t memoryPeak[PIPELINE_STAGES];
+    size_t memoryPeakTotal;
+
+    StatClock::time_point started;
+    double wall;
+    bool running;
+
+    //items at the last progress line
+    uint64_t reported[STAT_STAGES];
+    StatClock::time_point lastReport;
+
+    std::mutex lock;
+
+    inline double elapsed(){
+        return running ? secondsSince(started) : wall;
+    }
+
+    inline double utilisation(int s, double seconds){
+        if(seconds <= 0)
+            return 0;
+        //threads outside the pool run some of the last batches while they wait for them, on top of the workers
+        return std::min(1.0, stages[s].busy / (seconds * stages[s].workers));
+    }
+
+    inline int busiest(double seconds){
+        int b = 0;
+        for(int s = 1; s < STAT_STAGES; s++)
+            if(utilisation(s, seconds) > utilisation(b, seconds))
+                b = s;
+        return b;
+    }
+
+public:
+
+    PipelineStats() : memoryPeakTotal(0), wall(0), running(false) {
+        const char* names[STAT_STAGES] = { "read", "parse", "collapse", "test", "write" };
+        const char* units[STAT_STAGES] = { "lines", "variants", "sets", "sets", "sets" };
+        for(int s = 0; s < STAT_STAGES; s++){
+            stages[s].name = names[s];
+            stages[s].unit = units[s];
+            reported[s] = 0;
+        }
+
+        const char* queueNames[STAT_QUEUES] = { "parsed", "tested", "reorder" };
+        for(int q = 0; q < STAT_QUEUES; q++)
+            queues[q].name = queueNames[q];
+
+        for(int s = 0; s < PIPELINE_STAGES; s++)
+            memoryPeak[s] = 0;
+
+        started = StatClock::now();
+        lastReport = started;
+    }
+
+    inline void start(){
+        std::lock_guard<std::mutex> guard(lock);
+        started = StatClock::now();
+        lastReport = started;
+        running = true;
+    }
+
+    inline void stop(){
+        std::lock_guard<std::mutex> guard(lock);
+        wall = secondsSince(started);
+        running = false;
+    }
+
+    inline void setWorkers(StatStage stage, int workers){
+        std::lock_guard<std::mutex> guard(lock);
+        stages[static_cast<int>(stage)].workers = std::max(1, workers);
+    }
+
+    inline void setCapacity(StatQueue queue, size_t capacity){
+        std::lock_guard<std::mutex> guard(lock);
+        queues[static_cast<int>(queue)].capacity = capacity;
+    }
+
+    /*
+    Counts a batch handled by a stage.
+
+    @param stage Stage of the batch.
+    @param items Lines, variants or sets in the batch.
+    @param seconds Time spent on the batch, waits excluded.
+    */
+    inline void addBatch(StatStage stage, size_t items, double seconds){
+        int bucket = 0;
+        for(double ms = 1; bucket < STAT_BUCKETS - 1 && seconds * 1000 >= ms; ms *= 2)
+            bucket++;
+
+        std::lock_guard<std::mutex> guard(lock);
+        StageStats& s = stages[static_cast<int>(stage)];
+        s.batches++;
+        s.items += items;
+        s.busy += seconds;
+        s.histogram[bucket]++;
+    }
+
+    inline void addInputWait(StatStage stage, double seconds){
+        std::lock_guard<std::mutex> guard(lock);
+        stages[static_cast<int>(stage)].inputWait += seconds;
+    }
+
+    inline void addOutputWait(StatStage stage, double seconds){
+        std::lock_guard<std::mutex> guard(lock);
+        stages[static_cast<int>(stage)].outputWait += seconds;
+    }
+
+    inline void sampleQueue(StatQueue queue, size_t depth){
+        std::lock_guard<std::mutex> guard(lock);
+        QueueStats& q = queues[static_cast<int>(queue)];
+        q.samples++;
+        q.total += depth;
+        q.max = std::max(q.max, depth);
+    }
+
+    inline void recordMemory(MemoryBudget& memory){
+        std::lock_guard<std::mutex> guard(lock);
+        for(int s = 0; s < PIPELINE_STAGES; s++)
+            memoryPeak[s] = memory.getPeak(static_cast<PipelineStage>(s));
+        memoryPeakTotal = memory.getPeak();
+    }
+
+    /*
+    One line on the progress since the last call: items per second of the read, parse and test
+    stages, queue depths and the stage that is busiest so far.
+
+    @param parsed Batches waiting to be collapsed.
+    @param tested Batches waiting to be written.
+    @param reorder Sets waiting for an earlier set to be written.
+    */
+    inline std::string progress(size_t parsed, size_t tested, size_t reorder){
+        std::lock_guard<std::mutex> guard(lock);
+        double seconds = secondsSince(lastReport);
+        lastReport = StatClock::now();
+
+        std::string line = "Pipeline:";
+        const StatStage shown[3] = { StatStage::READ, StatStage::PARSE, StatStage::TEST };
+        for(StatStage stage : shown){
+            int s = static_cast<int>(stage);
+            double rate = (seconds > 0) ? (stages[s].items - reported[s]) / seconds : 0;
+            line += " " + std::to_string(stages[s].items) + " " + stages[s].unit + " " +
+                    (stage == StatStage::READ ? "read" : stage == StatStage::PARSE ? "parsed" : "tested") +
+                    " (" + std::to_string(static_cast<long long>(rate)) + "/s),";
+        }
+        for(int s = 0; s < STAT_STAGES; s++)
+            reported[s] = stages[s].items;
+
+        line += " queues " + std::to_string(parsed) + "/" + std::to_string(queues[static_cast<int>(StatQueue::PARSED)].capacity) +
+                " parsed, " + std::to_string(tested) + "/" + std::to_string(queues[static_cast<int>(StatQueue::TESTED)].capacity) +
+                " tested, " + std::to_string(reorder) + " sets to reorder";
+
+        double total = elapsed();
+        int b = busiest(total);
+        line += ", busiest stage " + stages[b].name + " (" +
+                std::to_string(static_cast<int>(100 * utilisation(b, total) + 0.5)) + "%)";
+        return line;
+    }
+
+    inline double getWallTime(){ std::lock_guard<std::mutex> guard(lock); return elapsed(); }
+    inline StageStats getStage(StatStage stage){ std::lock_guard<std::mutex> guard(lock); return stages[static_cast<int>(stage)]; }
+    inline QueueStats getQueue(StatQueue queue){ std::lock_guard<std::mutex> guard(lock); return queues[static_cast<int>(queue)]; }
+    inline size_t getMemoryPeak(){ std::lock_guard<std::mutex> guard(lock); return memoryPeakTotal; }
+    inline size_t getMemoryPeak(PipelineStage stage){
+        std::lock_guard<std::mutex> guard(lock);
+        return memoryPeak[static_cast<int>(stage)];
+    }
+
+    inline double getUtilisation(StatStage stage){
+        std::lock_guard<std::mutex> guard(lock);
+        return utilisation(static_cast<int>(stage), elapsed());
+    }
+
+    inline StatStage getBusiestStage(){
+        std::lock_guard<std::mutex> guard(lock);
+        return static_cast<StatStage>(busiest(elapsed()));
+    }
+};
@@ -1,7 +1,9 @@
 #include "Request.h"
 #include "Log.h"
+#include "Math/Math.h"
 
 #include <fstream>
+#include <sstream>
 
 static const std::string ERROR_SOURCE = "REQUEST_BUILDER";
 
@@ -24,15 +26,33 @@ Request getDefaultRequest() {
     r.setAsSimulation(false);
     r.setInputFiles("", "");
     r.setOutputDir(".");
+    r.setSummaryFile("");
+    r.setTraceFile("");
 
     r.setCollapse(1);
     r.setBootstrap(0);
+    r.setBootstrapBatchSize(64);
+    r.setSeed(randomSeed(), false);
     r.setStopEarly(false);
+    r.setSaddlepoint(false);
+    r.setStopHits(10);
+    r.setDaviesThreshold(0.05);
+    r.setDaviesAccuracy(1e-4);
+    r.setDaviesLimit(10000);
     r.setNumberThreads(1);
+    r.setParseThreads(1);
+    r.setTestBatches(0);
     r.setBatchSize(1000);
+    r.setMaxMemory(0);
+    r.setCheckpointInterval(0);
+    r.setStatsInterval(0);
+    r.setReport(false);
+    r.setResume(false);
+    r.setShard(0, 1);
     r.setKeepFiltered(true);
     r.setMakePlot(false);
     r.setRetainGenotypes(false);
+    r.setPerfCounters(false);
 
     r.setMustPASS(true);
     r.setOnlySNPs(true);
@@ -82,16 +102,34 @@ bool Request::validate() {
         throwError(ERROR_SOURCE, "Output directory is invalid.", outputDir);
 
 
-    for(size_t i = 0; i < tests.size(); i++){
-        if (nboot < 1 && tests[i].isRareTest() )
-            throwError(ERROR_SOURCE, "Requested a bootstrap test but number of permutions is less than 1.", std::to_string(nboot));
-
-        if (shouldCollapseK() && tests[i].isRareTest() && collapseSize < 2)
-            throwError(ERROR_SOURCE, "Please set variant collapse value to a number greater than 1.", std::to_string(collapseSize));
-    }
+    //rare tests without bootstrap take asymptotic p-values, and without -k every variant is its own set
 
     if (nthreads < 1)
         throwError(ERROR_SOURCE, "Number of threads should be greater than 0.", std::to_string(nthreads));
+    if (parseThreads < 1)
+        throwError(ERROR_SOURCE, "Number of parsing threads should be greater than 0.", std::to_string(parseThreads));
+    if (testBatches < 0)
+        throwError(ERROR_SOURCE, "Number of test batches should not be negative.", std::to_string(testBatches));
+    if (maxMemory < 0)
+        throwError(ERROR_SOURCE, "Memory budget should not be negative.", std::to_string(maxMemory));
+    if (checkpointInterval < 0)
+        throwError(ERROR_SOURCE, "Time between checkpoints should not be negative.", std::to_string(checkpointInterval));
+    if (statsInterval < 0)
+        throwError(ERROR_SOURCE, "Time between progress lines should not be negative.", std::to_string(statsInterval));
+    if (resume && shouldExportSummary())
+        throwError(ERROR_SOURCE, "Summary statistics cannot be exported by a resumed run, as sets tested after the checkpoint would be exported twice.");
+    if (shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount)
+        throwError(ERROR_SOURCE, "Shard should be a number from 1 to the number of shards.", std::to_string(shardIndex + 1) + "/" + std::to_string(shardCount));
+    if(bootBatch < 1)
+        throwError(ERROR_SOURCE, "Bootstrap batch size should be greater than 0.", std::to_string(bootBatch));
+    if(stopHits < 1)
+        throwError(ERROR_SOURCE, "Number of exceedances needed to stop bootstrapping should be greater than 0.", std::to_string(stopHits));
+    if(daviesThreshold < 0 || daviesThreshold > 1)
+        throwError(ERROR_SOURCE, "Threshold for using Davies' method should be between 0 and 1.", std::to_string(daviesThreshold));
+    if(daviesAccuracy <= 0 || daviesAccuracy >= 1)
+        throwError(ERROR_SOURCE, "Accuracy of Davies' method should be between 0 and 1.", std::to_string(daviesAccuracy));
+    if(daviesLimit < 1)
+        throwError(ERROR_SOURCE, "Integration limit of Davies' method should be greater than 0.", std::to_string(daviesLimit));
     if(batchSize < 1)
         throwError(ERROR_SOURCE, "Batch size should be greater than 0.", std::to_string(batchSize));
     if (highLowCutOff < 1)
@@ -103,3 +141,31 @@ bool Request::validate() {
 
     return true;
 }
+
+/**
+Settings that decide which sets are tested and their p-values, as one line. A resumed
+run must have the same, or its results would not continue those of the checkpoint.
+The seed, threads, batch sizes and memory budget are left out: the seed is checked on
+its own and the others do not change the results.
+
+@return Description of the analysis.
+*/
+std::string Request::describeAnalysis() {
+    std::ostringstream out;
+    out.precision(17);
+
+    out << "tests";
+    for(TestSettings& t : tests)
+        out << " [" << t.toShortString() << " " << static_cast<int>(t.getVariance()) << "]";
+
+    out << "; sampleInfo " << sampleDir << "; bed " << bedDir;
+    out << "; collapse " << static_cast<int>(collapse) << " " << collapseSize;
+    out << "; nboot " << nboot << "; stopEarly " << stopEarly << " " << stopHits;
+    out << "; saddlepoint " << saddlepoint;
+    out << "; davies " << daviesThreshold << " " << daviesAccuracy << " " << daviesLimit;
+    out << "; shard " << shardIndex << " " << shardCount << "; keepFiltered " << keepFiltered;
+    out << "; filters " << highLowCutOff << " " << mafCutoff << " " << missingThreshold << " " << onlySNPsFilter << " " <<
+           mustPASSFilter << " " << minPos << " " << maxPos << " " << filterChrName;
+
+    return out.str();
+}
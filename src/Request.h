@@ -14,11 +14,14 @@ private:
     std::string sampleDir;
     std::string bedDir;
     std::string outputDir;
+    std::string summaryFile;
+    std::string traceFile;
 
     bool simulation;
     bool keepFiltered;
     bool makePlot;
     bool retainGt;
+    bool perfCounters;
 
     std::vector<TestSettings> tests;
 
@@ -27,9 +30,33 @@ private:
     int collapseSize;
 
     int nboot;
+    int bootBatch;
+    uint64_t seed;
+    //the seed was given rather than drawn at random
+    bool seedChosen;
     bool stopEarly;
+    bool saddlepoint;
+    int stopHits;
+    double daviesThreshold;
+    double daviesAccuracy;
+    int daviesLimit;
     int nthreads;
+    int parseThreads;
+    //0 means twice nthreads
+    int testBatches;
     int batchSize;
+    //MB, 0 means no limit
+    int maxMemory;
+    //seconds, 0 means no checkpoints
+    int checkpointInterval;
+    //seconds, 0 means no progress lines
+    int statsInterval;
+    //writes the run report next to the p-values
+    bool report;
+    bool resume;
+    //0 based, a count of 1 means the whole VCF
+    int shardIndex;
+    int shardCount;
 
     //filtering paramaters
     int highLowCutOff;
@@ -56,6 +83,8 @@ public:
     }
     inline void setCollapseFile(std::string bedDir){ this->bedDir = bedDir; }
     inline void setOutputDir(std::string outputDir){ this->outputDir = outputDir; }
+    inline void setSummaryFile(std::string summaryFile){ this->summaryFile = summaryFile; }
+    inline void setTraceFile(std::string traceFile){ this->traceFile = traceFile; }
 
     inline void addTest(TestSettings t) { this->tests.push_back(t); }
 
@@ -64,12 +93,28 @@ public:
     inline void setCollapse(int k) { collapse = CollapseType::COLLAPSE_K; collapseSize = k; }
 
     inline void setBootstrap(int value) { nboot = value; }
+    inline void setBootstrapBatchSize(int size) { bootBatch = size; }
+    inline void setSeed(uint64_t value, bool chosen = true) { seed = value; seedChosen = chosen; }
     inline void setStopEarly(bool value) { stopEarly = value; }
+    inline void setSaddlepoint(bool value) { saddlepoint = value; }
+    inline void setStopHits(int hits) { stopHits = hits; }
+    inline void setDaviesThreshold(double threshold) { daviesThreshold = threshold; }
+    inline void setDaviesAccuracy(double accuracy) { daviesAccuracy = accuracy; }
+    inline void setDaviesLimit(int limit) { daviesLimit = limit; }
     inline void setNumberThreads(int nthreads) { this->nthreads = nthreads; }
+    inline void setParseThreads(int nthreads) { this->parseThreads = nthreads; }
+    inline void setTestBatches(int nbatches) { this->testBatches = nbatches; }
     inline void setBatchSize(int size) { this->batchSize = size; }
+    inline void setMaxMemory(int megabytes) { this->maxMemory = megabytes; }
+    inline void setCheckpointInterval(int seconds) { this->checkpointInterval = seconds; }
+    inline void setStatsInterval(int seconds) { this->statsInterval = seconds; }
+    inline void setReport(bool value) { this->report = value; }
+    inline void setResume(bool value) { this->resume = value; }
+    inline void setShard(int index, int count) { this->shardIndex = index; this->shardCount = count; }
     inline void setKeepFiltered(bool value) { this->keepFiltered = value; }
     inline void setMakePlot(bool value) { this->makePlot = value; if(!value) setRetainGenotypes(false); }
     inline void setRetainGenotypes(bool value) { this->retainGt = value; }
+    inline void setPerfCounters(bool value) { this->perfCounters = value; }
 
     inline void setMustPASS(bool value) { mustPASSFilter = value; }
     inline void setOnlySNPs(bool value) { onlySNPsFilter = value; }
@@ -117,12 +162,28 @@ public:
     inline std::string getBEDDir() { return bedDir; }
     inline std::string getSampleDir() { return sampleDir; }
     inline std::string getOutputDir() { return outputDir; }
+    inline std::string getSummaryFile() { return summaryFile; }
+    inline bool shouldExportSummary() { return summaryFile.size() > 0; }
+    inline std::string getTraceFile() { return traceFile; }
+    inline bool shouldTrace() { return traceFile.size() > 0; }
     inline CollapseType getCollapseType() { return collapse; }
     inline int getCollapseSize() { return collapseSize; }
     inline int getNumberThreads() { return nthreads; }
+    inline int getParseThreads() { return parseThreads; }
+    inline int getTestBatches() { return testBatches > 0 ? testBatches : 2 * nthreads; }
     inline int getBatchSize() { return this->batchSize; }
+    inline int getMaxMemory() { return this->maxMemory; }
+    inline bool useMemoryBudget() { return this->maxMemory > 0; }
+    inline int getCheckpointInterval() { return this->checkpointInterval; }
+    inline int getStatsInterval() { return this->statsInterval; }
+    inline bool shouldWriteReport() { return this->report; }
+    inline bool shouldResume() { return this->resume; }
+    inline int getShardIndex() { return this->shardIndex; }
+    inline int getShardCount() { return this->shardCount; }
+    inline bool isShard() { return this->shardCount > 1; }
     inline bool shouldPlot() { return this->makePlot; }
     inline bool shouldRetainGenotypes() { return this->retainGt; }
+    inline bool usePerfCounters() { return this->perfCounters; }
 
     inline int getHighLowCutOff() { return highLowCutOff; }
     inline bool mustPASS() { return mustPASSFilter; }
@@ -138,8 +199,16 @@ public:
     inline int getMinPosition() { return minPos; }
     inline int getMaxPosition() { return maxPos; }
     inline int bootstrapSize() { return nboot; }
+    inline int getBootstrapBatchSize() { return bootBatch; }
+    inline uint64_t getSeed() { return seed; }
+    inline bool isSeedChosen() { return seedChosen; }
     inline bool useBootstrap() { return nboot>0; }
     inline bool useStopEarly() { return stopEarly; }
+    inline bool useSaddlepoint() { return saddlepoint; }
+    inline int getStopHits() { return stopHits; }
+    inline double getDaviesThreshold() { return daviesThreshold; }
+    inline double getDaviesAccuracy() { return daviesAccuracy; }
+    inline int getDaviesLimit() { return daviesLimit; }
 
     inline bool shouldKeepFiltered() { return keepFiltered; }
     inline IntervalSet* getIntervals() { return intervals; }
@@ -147,6 +216,7 @@ public:
     inline std::string getRequestName() { return requestName; }
 
     bool validate();
+    std::string describeAnalysis();
 };
 
 //-------------------------------------------------------------------------------------
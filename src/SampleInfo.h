@@ -10,7 +10,7 @@ using Eigen::VectorXi;
 
 struct SampleInfo {
 private:
-    VectorXd Y;
+    MatrixXd Y; //one column per phenotype
     VectorXi G;
     MatrixXd Z;
     std::map<int, Depth> groupDepth;
@@ -19,12 +19,13 @@ private:
     void determineFamily() {
         double epsilon = 1e-8;
         //if a value not 0 or 1 is found, assume quantitative data
-        for(int i = 0; i < Y.rows(); i++){
-            if( !(std::abs(Y[i]) < epsilon || std::abs(Y[i] - 1) < epsilon)){
-                family=Family::NORMAL;
-                return;
+        for(int j = 0; j < Y.cols(); j++)
+            for(int i = 0; i < Y.rows(); i++){
+                if( !(std::abs(Y(i, j)) < epsilon || std::abs(Y(i, j) - 1) < epsilon)){
+                    family=Family::NORMAL;
+                    return;
+                }
             }
-        }
 
         family=Family::BINOMIAL;
     }
@@ -32,12 +33,15 @@ private:
 public:
 
     inline void setY(VectorXd Y){ this->Y = Y; determineFamily(); }
+    //all phenotypes share one family
+    inline void setPhenotypes(MatrixXd Y){ this->Y = Y; determineFamily(); }
     inline void setZ(MatrixXd Z){ this->Z = Z; }
     inline void setG(VectorXi G){ this->G = G; }
     inline void setGroupDepthMap(std::map<int, Depth> groupDepth){ this->groupDepth = groupDepth; }
 
     inline VectorXi getG(){ return G; }
-    inline VectorXd getY(){ return Y; }
+    inline VectorXd getY(int phenotype = 0){ return Y.col(phenotype); }
+    inline MatrixXd getPhenotypes(){ return Y; }
     inline MatrixXd getZ(){ return Z; }
     inline Family getFamily(){ return family; }
     inline void setFamily(Family fam){ family = fam; }
@@ -45,6 +49,7 @@ public:
     inline bool hasCovariates() { return Z.rows() > 0 && Z.cols() > 0; }
     inline int ncov() { return Z.cols() -1; }
     inline int nsamp() { return Y.rows(); }
+    inline int nphenotypes() { return Y.cols(); }
     inline int ngroup() { return 1 + G.maxCoeff(); }
     inline std::map<int, Depth> getGroupDepthMap(){ return groupDepth; }
 
@@ -0,0 +1,250 @@
+#include "Test.h"
+#include "Phenotype.h"
+#include "../vikNGS.h"
+#include "../Math/Math.h"
+#include "../Log.h"
+#include "../Trace.h"
+#include "../PerfCounters.h"
+
+static const std::string ERROR_SOURCE = "COMMON_TEST";
+
+/*
+Variance of the score of every column of X for every phenotype. Same as getVarianceMatrix
+for a single variant, but the weighted norms and covariate projections are computed for the
+whole block with matrix products. Whenever the weights are constant within a phenotype the
+genotype part is computed once and scaled for each phenotype.
+
+@param X n x B genotype block.
+@param Ycenter n x T centred phenotypes.
+@param Mu n x T fitted values of the null models.
+@param Z Covariates (including the intercept).
+@param G Group of every sample.
+@param depths Read depth of every group.
+@param robustVar Robust variance of every column, only used with vRVS.
+@param test Indicates which variance to use.
+@param family Statistical distribution family.
+
+@return B x T variance of each score.
+*/
+MatrixXd getCommonVarianceBlock(MatrixXd& X, MatrixXd& Ycenter, MatrixXd& Mu, MatrixXd& Z, VectorXi& G,
+                                std::map<int, Depth>& depths, VectorXd& robustVar, TestSettings& test, Family family){
+
+    PerfScope counters(PerfStage::VARIANCE, 1);
+    int nsnp = static_cast<int>(X.cols());
+    int ntraits = static_cast<int>(Ycenter.cols());
+    double n = X.rows();
+
+    if(test.getVariance() != Variance::RVS){
+
+        //Mu is constant without covariates
+        if(family == Family::NORMAL || Z.cols() < 2){
+            MatrixXd ZX = Z.transpose() * X;
+            MatrixXd ZZ = Z.transpose() * Z;
+            VectorXd projection = (ZX.array() * ZZ.ldlt().solve(ZX).array()).colwise().sum();
+            VectorXd base = X.array().square().colwise().sum().transpose() - projection.array();
+
+            VectorXd w(ntraits);
+            for(int t = 0; t < ntraits; t++)
+                if(family == Family::BINOMIAL)
+                    w[t] = Mu(0, t) * (1 - Mu(0, t));
+                else
+                    w[t] = Ycenter.col(t).array().pow(2).sum() / Mu.rows();
+
+            return base * w.transpose();
+        }
+
+        MatrixXd variance(nsnp, ntraits);
+        for(int t = 0; t < ntraits; t++){
+            VectorXd w = Mu.col(t).array() * (1 - Mu.col(t).array());
+
+            MatrixXd WX = w.asDiagonal() * X;
+            MatrixXd ZWX = Z.transpose() * WX;
+            MatrixXd ZWZ = Z.transpose() * w.asDiagonal() * Z;
+
+            VectorXd projection = (ZWX.array() * ZWZ.ldlt().solve(ZWX).array()).colwise().sum();
+            variance.col(t) = (X.array() * WX.array()).colwise().sum().transpose() - projection.array();
+        }
+        return variance;
+    }
+
+    //per group sums of x and x^2 give the within group variance of every column
+    int ngroups = static_cast<int>(depths.size());
+    MatrixXd indicator = MatrixXd::Constant(static_cast<int>(n), ngroups, 0);
+    for(int i = 0; i < G.rows(); i++)
+        indicator(i, G[i]) = 1;
+
+    VectorXd groupSize = indicator.colwise().sum();
+    MatrixXd sumX = indicator.transpose() * X;
+    MatrixXd sumX2 = indicator.transpose() * X.array().square().matrix();
+    VectorXd robust = robustVar.array().square();
+
+    MatrixXd groupVar = MatrixXd::Constant(nsnp, ngroups, 0);
+    for(int g = 0; g < ngroups; g++){
+        if(groupSize[g] < 1)
+            continue;
+
+        if(depths.at(g) == Depth::HIGH)
+            groupVar.col(g) = robust;
+        else{
+            VectorXd mean = sumX.row(g).transpose() / groupSize[g];
+            groupVar.col(g) = sumX2.row(g).transpose().array() / groupSize[g] - mean.array().square();
+        }
+    }
+
+    if(family == Family::BINOMIAL){
+        MatrixXd ym = indicator.transpose() * Ycenter.array().square().matrix();
+        return groupVar * ym * (n / (n - 1));
+    }
+
+    VectorXd pooled = groupVar * groupSize;
+    VectorXd ym = Ycenter.array().square().colwise().sum().transpose();
+    return pooled * ym.transpose() / n;
+}
+
+/*
+Evaluates the block for the phenotypes in traits, all of which are observed on the samples
+kept by toRemove. Results are written to the columns of pvals given by traits.
+*/
+void commonTestBlock(SampleInfo* sampleInfo, std::vector<VariantSet*>& variants, TestSettings& test,
+                     std::vector<int>& traits, VectorXi& toRemove, MatrixXd& pvals){
+
+    int ntraits = static_cast<int>(traits.size());
+    MatrixXd phenotypes = sampleInfo->getPhenotypes();
+    MatrixXd Z = sampleInfo->getZ();
+    if(Z.rows() < 1 || Z.cols() < 1)
+        Z = MatrixXd::Constant(phenotypes.rows(), 1, 1);
+    VectorXi G = sampleInfo->getG();
+    std::map<int, Depth> depths = sampleInfo->getGroupDepthMap();
+    Family family = sampleInfo->getFamily();
+
+    Z = extractRows(Z, toRemove, 0);
+    G = extractRows(G, toRemove, 0);
+
+    //the null model of each phenotype is fitted once for the whole block
+    MatrixXd Ycenter(Z.rows(), ntraits);
+    MatrixXd Mu(Z.rows(), ntraits);
+    for(int t = 0; t < ntraits; t++){
+        VectorXd y = phenotypes.col(traits[t]);
+        y = extractRows(y, toRemove, 0);
+
+        Phenotype pheno(y, Z, family);
+        Ycenter.col(t) = pheno.getYCenter();
+        Mu.col(t) = *pheno.getMu();
+    }
+
+    std::vector<size_t> block;
+    std::vector<VectorXd> columns;
+    std::vector<double> robustVar;
+
+    for(size_t s = 0; s < variants.size(); s++){
+
+        if(STOP_RUNNING_THREAD)
+            return;
+
+        if(variants[s]->validSize() < 1)
+            continue;
+
+        VectorXd x;
+        if(variants[s]->validSize() == 1){
+            MatrixXd X = variants[s]->getX(test.getGenotype());
+            x = X.col(0).head(toRemove.rows());
+            x = extractRows(x, toRemove, 0);
+        }
+
+        //missing genotypes change the samples, and so the null model, of this variant only
+        if(variants[s]->validSize() > 1 || whereNAN(x).sum() > 0){
+            for(int t = 0; t < ntraits; t++){
+                TestSettings single = test;
+                single.setPhenotype(traits[t]);
+                pvals(static_cast<int>(s), traits[t]) = runTest(sampleInfo, variants[s], single, 0, false);
+            }
+            continue;
+        }
+
+        MatrixXd P = variants[s]->getP(test.getGenotype());
+        block.push_back(s);
+        columns.push_back(x);
+        robustVar.push_back(std::sqrt(calcRobustVar(P(0, 1), P(0, 2))));
+    }
+
+    if(block.size() < 1)
+        return;
+
+    int nsnp = static_cast<int>(block.size());
+    MatrixXd X(Z.rows(), nsnp);
+    VectorXd robust(nsnp);
+    for(int j = 0; j < nsnp; j++){
+        X.col(j) = columns[j];
+        robust[j] = robustVar[j];
+    }
+
+    MatrixXd score = X.transpose() * Ycenter;
+    MatrixXd variance = getCommonVarianceBlock(X, Ycenter, Mu, Z, G, depths, robust, test, family);
+    MatrixXd testStat = score.array().square() / variance.array();
+
+    for(int t = 0; t < ntraits; t++)
+        for(int j = 0; j < nsnp; j++)
+            pvals(static_cast<int>(block[j]), traits[t]) = chiSquareOneDOF(testStat(j, t));
+}
+
+/*
+Runs the common variant test on a block of single variant sets for every phenotype.
+Samples with a missing covariate are removed once, the null model of each phenotype is
+fitted once and all scores come from one product of the n x B genotype block with the
+n x T centred phenotypes. Phenotypes with missing values are evaluated on their own
+samples. Sets with more than one variant or with missing genotypes go through runTest.
+
+@param sampleInfo Phenotypes, covariates and groups.
+@param variants Variant sets to test.
+@param test Common variant test to use.
+
+@return p-values, one row per set and one column per phenotype. NAN for sets without valid variants.
+*/
+MatrixXd runCommonTestBlock(SampleInfo* sampleInfo, std::vector<VariantSet*>& variants, TestSettings test){
+    TraceSpan span("common test block", "sets", static_cast<long long>(variants.size()));
+
+    if(!test.isCommonTest())
+        throwError(ERROR_SOURCE, "Block evaluation is only available for the common variant test.");
+
+    MatrixXd phenotypes = sampleInfo->getPhenotypes();
+    MatrixXd Z = sampleInfo->getZ();
+    int nsamp = static_cast<int>(phenotypes.rows());
+    int ntraits = static_cast<int>(phenotypes.cols());
+
+    MatrixXd pvals = MatrixXd::Constant(static_cast<int>(variants.size()), ntraits, NAN);
+
+    int size = nsamp;
+    if(test.getSampleSize() > 0)
+        size = test.getSampleSize();
+
+    VectorXi toRemove = VectorXi::Constant(nsamp, 0);
+    if(Z.rows() > 0 && Z.cols() > 1)
+        toRemove = whereNAN(Z);
+    for(int i = size; i < nsamp; i++)
+        toRemove[i] = 1;
+
+    std::vector<int> complete;
+    for(int t = 0; t < ntraits; t++){
+        VectorXd y = phenotypes.col(t);
+        VectorXi missing = whereNAN(y);
+
+        bool isComplete = true;
+        for(int i = 0; i < nsamp; i++)
+            if(missing[i] > 0 && toRemove[i] == 0)
+                isComplete = false;
+
+        if(isComplete){
+            complete.push_back(t);
+            continue;
+        }
+
+        std::vector<int> single(1, t);
+        VectorXi remove = toRemove + missing;
+        commonTestBlock(sampleInfo, variants, test, single, remove, pvals);
+    }
+
+    if(complete.size() > 0)
+        commonTestBlock(sampleInfo, variants, test, complete, toRemove, pvals);
+
+    return pvals;
+}
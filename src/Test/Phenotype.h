@@ -4,17 +4,20 @@
 class Phenotype {
     VectorXd Y;
     VectorXd Mu;
+    VectorXd beta;
 
     Family family;
     MatrixXd Z;
 
     inline void calculateMu() {
         if(hasCovariates()){
-            VectorXd beta = getBeta(Y, Z, family);
+            beta = getBeta(Y, Z, family);
             Mu = fitModel(beta, Z, family);
         }
         else
             Mu = VectorXd::Constant(Y.rows(), Y.mean());
+
+        isMuCalculated = true;
     }
 
     bool isMuCalculated = false;
@@ -33,14 +36,18 @@ public:
     //toRemove: 0 = keep, 1 = remove
     inline void filterY(VectorXi& toRemove){
         this->Y = extractRows(this->Y, toRemove, 0);
+        isMuCalculated = false;
     }
     inline void filterZ(VectorXi& toRemove){
         this->Z = extractRows(this->Z, toRemove, 0);
+        isMuCalculated = false;
     }
 
     inline VectorXd* getY() { return &Y; }
     inline VectorXd* getMu() { if(!isMuCalculated) calculateMu(); return &Mu; }
     inline VectorXd getYCenter() { if(!isMuCalculated) calculateMu(); return (Y-Mu); }
+    //null model coefficients, empty without covariates
+    inline VectorXd* getCoefficients() { if(!isMuCalculated) calculateMu(); return &beta; }
     inline Family getFamily() { return family; }
 
     inline MatrixXd* getZ() { return &Z; }
@@ -3,6 +3,7 @@
 #include "Group.h"
 #include "../Math/Math.h"
 #include "../Log.h"
+#include "../PerfCounters.h"
 
 VectorXd getScoreVector(VectorXd& Ycenter, MatrixXd& X) {
     int nsnp = X.cols();
@@ -30,18 +31,9 @@ MatrixXd getVarianceMatrix2(VectorXd& Ycenter, VectorXd& Mu, MatrixXd& X, Matrix
 }
 
 MatrixXd getVarianceMatrix(TestObject& o, TestSettings& test, Family family){
-
-    if(test.getVariance() == Variance::RVS){
-        if(family == Family::BINOMIAL)
-            return getRobustVarianceBinomial(*o.getYcenter(), *o.getX(), *o.getGroup(), o.robustVarVector(), !test.isRVSFalse());
-        if(family == Family::NORMAL)
-            return getRobustVarianceNormal(*o.getYcenter(), *o.getX(), *o.getGroup(), o.robustVarVector(), !test.isRVSFalse());
-    }
-    else
-        return getRegularVariance(*o.getYcenter(), *o.getX(), *o.getZ(), *o.getMU(), family);
-
-
-    throwError("ScoreTestFunctions", "Unsure how to calculate variance in score test. This should not happen.");
+    PerfScope counters(PerfStage::VARIANCE, 1);
+    VarianceKernel kernel = getVarianceKernel(test.getVariance(), family, static_cast<int>(o.getX()->cols()));
+    return kernel(o, *o.getX(), !test.isRVSFalse());
 }
 
 MatrixXd getRobustVarianceBinomial(VectorXd& Ycenter, MatrixXd& X, Group& group, VectorXd robustVar, bool rvs){
@@ -107,36 +99,266 @@ MatrixXd getRobustVarianceNormal(VectorXd& Ycenter, MatrixXd& X, Group& group, V
     return diagS;
 }
 
-MatrixXd getRegularVariance(VectorXd& Ycenter, MatrixXd& X, MatrixXd& Z, VectorXd& Mu, Family family){
+/*
+Regular score variance X'WX - X'WZ (Z'WZ)^-1 Z'WX with W the variance of each phenotype
+under the null model. K is the number of variants, or Eigen::Dynamic.
+*/
+template <Family F, int K>
+MatrixXd regularVariance(VectorXd& Ycenter, MatrixXd& X, MatrixXd& Z, VectorXd& Mu){
 
-    VectorXd var1;
+    Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, K>> x(X.data(), X.rows(), X.cols());
 
-    if(family == Family::BINOMIAL)
-        var1 = Mu.array() * (1 - Mu.array());
-    else{
-       double var = (Ycenter.array().pow(2).sum())/Mu.rows();
-       var1 = VectorXd::Constant(Mu.rows(), var);
+    VectorXd w;
+    if(F == Family::BINOMIAL)
+        w = Mu.array() * (1 - Mu.array());
+    else
+        w = VectorXd::Constant(Mu.rows(), Ycenter.squaredNorm() / Mu.rows());
+
+    Eigen::Matrix<double, Eigen::Dynamic, K> wx = w.asDiagonal() * x;
+    Eigen::Matrix<double, K, K> xwx = x.transpose() * wx;
+    Eigen::Matrix<double, K, Eigen::Dynamic> xwz = wx.transpose() * Z;
+    MatrixXd zwz = Z.transpose() * w.asDiagonal() * Z;
+
+    return xwx - xwz * zwz.inverse() * xwz.transpose();
+}
+
+/*
+Robust score variance for a set of K variants, with K fixed. Same as getRobustVarianceBinomial
+and getRobustVarianceNormal, but the covariance of every group is accumulated from the rows of
+X directly instead of from a copy of each group.
+*/
+template <Family F, int K>
+MatrixXd robustVariance(VectorXd& Ycenter, MatrixXd& X, Group& group, VectorXd robustVar, bool rvs){
+
+    typedef Eigen::Matrix<double, K, K> SquareK;
+
+    int n = static_cast<int>(X.rows());
+    int ngroups = group.ngroups();
+    Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, K>> x(X.data(), n, K);
+
+    Eigen::Matrix<double, K, Eigen::Dynamic> mean = Eigen::Matrix<double, K, Eigen::Dynamic>::Zero(K, ngroups);
+    VectorXd count = VectorXd::Zero(ngroups);
+    VectorXd ysq = VectorXd::Zero(ngroups);
+
+    for(int i = 0; i < n; i++){
+        mean.col(group[i]) += x.row(i).transpose();
+        count[group[i]]++;
+        ysq[group[i]] += Ycenter[i] * Ycenter[i];
+    }
+    for(int g = 0; g < ngroups; g++)
+        if(count[g] > 0)
+            mean.col(g) /= count[g];
+
+    std::vector<SquareK, Eigen::aligned_allocator<SquareK>> cross(ngroups, SquareK::Zero());
+    for(int i = 0; i < n; i++){
+        Eigen::Matrix<double, K, 1> d = x.row(i).transpose() - mean.col(group[i]);
+        cross[group[i]] += d * d.transpose();
     }
 
+    Eigen::Matrix<double, K, 1> scale = robustVar;
+    SquareK total = SquareK::Zero();
+    double ntotal = 0;
+
+    for(int g = 0; g < ngroups; g++){
+        if(count[g] < 1)
+            continue;
+
+        SquareK v;
+        if(group.depth(g) == Depth::HIGH && rvs){
+            if(K == 1)
+                v = SquareK::Constant(1);
+            else{
+                Eigen::Matrix<double, K, 1> sd = cross[g].diagonal().array().sqrt();
+                v = cross[g].array() / (sd * sd.transpose()).array();
+            }
+            v = scale.asDiagonal() * v * scale.asDiagonal();
+        }
+        else
+            v = cross[g] / count[g];
+
+        if(F == Family::BINOMIAL)
+            total += ysq[g] * (n / (n - 1.0)) * v;
+        else{
+            total += count[g] * v;
+            ntotal += count[g];
+        }
+    }
+
+    if(F == Family::NORMAL)
+        total *= ysq.sum() / ntotal;
+
+    return total;
+}
+
+MatrixXd getRegularVariance(VectorXd& Ycenter, MatrixXd& X, MatrixXd& Z, VectorXd& Mu, Family family){
+    if(family == Family::BINOMIAL)
+        return regularVariance<Family::BINOMIAL, Eigen::Dynamic>(Ycenter, X, Z, Mu);
+
+    return regularVariance<Family::NORMAL, Eigen::Dynamic>(Ycenter, X, Z, Mu);
+}
+
+template <bool Robust, Family F, int K>
+MatrixXd varianceKernel(TestObject& o, MatrixXd& X, bool rvs){
+
+    if(!Robust)
+        return regularVariance<F, K>(*o.getYcenter(), X, *o.getZ(), *o.getMU());
+
+    if(K != Eigen::Dynamic)
+        return robustVariance<F, (K == Eigen::Dynamic) ? 1 : K>(*o.getYcenter(), X, *o.getGroup(), o.robustVarVector(), rvs);
+
+    if(F == Family::BINOMIAL)
+        return getRobustVarianceBinomial(*o.getYcenter(), X, *o.getGroup(), o.robustVarVector(), rvs);
+
+    return getRobustVarianceNormal(*o.getYcenter(), X, *o.getGroup(), o.robustVarVector(), rvs);
+}
+
+//index 0 is any set size, index k a set of k variants
+#define VARIANCE_KERNELS(R, F) { \
+    &varianceKernel<R, F, Eigen::Dynamic>, &varianceKernel<R, F, 1>, &varianceKernel<R, F, 2>, \
+    &varianceKernel<R, F, 3>, &varianceKernel<R, F, 4>, &varianceKernel<R, F, 5>, \
+    &varianceKernel<R, F, 6>, &varianceKernel<R, F, 7>, &varianceKernel<R, F, 8> }
+
+static const VarianceKernel KERNEL_TABLE[2][2][MAX_FIXED_VARIANTS + 1] = {
+    { VARIANCE_KERNELS(false, Family::NORMAL), VARIANCE_KERNELS(false, Family::BINOMIAL) },
+    { VARIANCE_KERNELS(true, Family::NORMAL), VARIANCE_KERNELS(true, Family::BINOMIAL) }
+};
+
+#undef VARIANCE_KERNELS
+
+/*
+Picks the variance kernel for a variance, family and set size.
+
+@param variance Variance of the test, everything but RVS uses the regular variance.
+@param family Statistical distribution family.
+@param nsnp Number of variants in the set.
+
+@return Kernel computing the k x k score variance.
+*/
+VarianceKernel getVarianceKernel(Variance variance, Family family, int nsnp){
+
+    bool robust = variance == Variance::RVS;
+    if(robust && family != Family::NORMAL && family != Family::BINOMIAL)
+        throwError("ScoreTestFunctions", "Unsure how to calculate variance in score test. This should not happen.");
+
+    int size = (nsnp >= 1 && nsnp <= MAX_FIXED_VARIANTS) ? nsnp : 0;
+    return KERNEL_TABLE[robust ? 1 : 0][family == Family::BINOMIAL ? 1 : 0][size];
+}
+
+/*
+Picks the kernel of a test once, so repeated evaluations (bootstrap iterations) do not
+branch on the test settings again.
+
+@param test Indicates which test to use.
+@param family Statistical distribution family.
+@param nsnp Number of variants in the set.
+
+@return Variance kernel and whether only the burden needs to be evaluated.
+*/
+ScoreKernel getScoreKernel(TestSettings& test, Family family, int nsnp){
+
+    ScoreKernel kernel;
+    Statistic s = test.getStatistic();
+
+    //1'(X'WX - X'WZ (Z'WZ)^-1 Z'WX)1 is the same expression for the single column X1
+    kernel.burden = (s == Statistic::COMMON || s == Statistic::CAST) && test.getVariance() != Variance::RVS;
+    kernel.variance = getVarianceKernel(test.getVariance(), family, kernel.burden ? 1 : nsnp);
+    kernel.rvs = !test.isRVSFalse();
+
+    return kernel;
+}
+
+
+/*
+Splits the variance matrix into parts which only depend on X. Used by the batched
+bootstrap where X is fixed and only the centred phenotype changes between iterations.
+
+@param o Test object containing data.
+@param test Indicates which variance to use.
+@param family Statistical distribution family.
+
+@return k x k matrices, one for each weight of getVarianceWeights.
+*/
+std::vector<MatrixXd> getVarianceComponents(TestObject& o, TestSettings& test, Family family){
+    PerfScope counters(PerfStage::VARIANCE, 1);
+
+    MatrixXd X = *o.getX();
     int nsnp = X.cols();
-    int ncov = Z.cols();
+    std::vector<MatrixXd> components;
+
+    //mirrors getVarianceMatrix, where RVSFALSE also falls back to the regular variance
+    if(test.getVariance() != Variance::RVS){
+        MatrixXd Z = *o.getZ();
+        MatrixXd XZ = X.transpose() * Z;
+        components.push_back(X.transpose() * X - XZ * (Z.transpose() * Z).inverse() * XZ.transpose());
+        return components;
+    }
 
-    MatrixXd sum1 = MatrixXd::Constant(nsnp, nsnp, 0);
-    MatrixXd sum2 = MatrixXd::Constant(nsnp, ncov, 0);
-    MatrixXd sum3 = MatrixXd::Constant(ncov, ncov, 0);
+    bool rvs = !test.isRVSFalse();
+    Group* group = o.getGroup();
+    VectorXd robustVar = o.robustVarVector();
+    MatrixXd diagRobustVar = robustVar.asDiagonal();
+    std::vector<MatrixXd> x = splitIntoGroups(X, *group);
+
+    MatrixXd total = MatrixXd::Constant(nsnp, nsnp, 0);
+    double n = 0;
 
-    for(int i = 0; i < X.rows(); i++){
-        MatrixXd one = var1[i] * (X.row(i).transpose() * X.row(i)).array();
-        sum1 += one;
+    for (size_t i = 0; i < x.size(); i++) {
+        MatrixXd var = MatrixXd::Constant(nsnp, nsnp, 0);
 
-        MatrixXd two = var1[i] * (X.row(i).transpose() * Z.row(i)).array();
-        sum2 += two;
+        if(x[i].size() > 0){
+            if (group->depth(i) == Depth::HIGH && rvs)
+                var = diagRobustVar.transpose() * correlation(x[i]) * diagRobustVar;
+            else
+                var = covariance(x[i]);
+        }
 
-        MatrixXd three = var1[i] * (Z.row(i).transpose() * Z.row(i)).array();
-        sum3 += three;
+        if(family == Family::BINOMIAL)
+            components.push_back(var);
+        else{
+            n += x[i].rows();
+            total += x[i].rows() * var;
+        }
     }
 
-    MatrixXd var = sum2 * sum3.inverse() * sum2.transpose();
-    return sum1 - var;
+    if(family == Family::NORMAL)
+        components.push_back(total / n);
+
+    return components;
 }
 
+/*
+Computes the phenotype dependent weights of the variance components.
+
+@param o Test object containing data.
+@param Ycenter Centred phenotype of one bootstrap iteration.
+@param test Indicates which variance to use.
+@param family Statistical distribution family.
+
+@return One weight per variance component.
+*/
+VectorXd getVarianceWeights(TestObject& o, VectorXd& Ycenter, TestSettings& test, Family family){
+
+    double n = Ycenter.rows();
+
+    if(test.getVariance() != Variance::RVS){
+        if(family == Family::BINOMIAL){
+            //Mu is constant without covariates
+            double mu = (*o.getMU())[0];
+            return VectorXd::Constant(1, mu * (1 - mu));
+        }
+
+        return VectorXd::Constant(1, Ycenter.squaredNorm() / n);
+    }
+
+    if(family == Family::NORMAL)
+        return VectorXd::Constant(1, Ycenter.squaredNorm());
+
+    Group* group = o.getGroup();
+    VectorXd weights = VectorXd::Zero(group->ngroups());
+    double minus1Factor = n/(n-1);
+
+    for(int i = 0; i < Ycenter.rows(); i++)
+        weights[(*group)[i]] += Ycenter[i] * Ycenter[i];
+
+    return weights * minus1Factor;
+}
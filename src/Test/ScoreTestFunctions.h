@@ -1,11 +1,38 @@
 #pragma once
 #include "../Math/EigenStructures.h"
+#include <vector>
 
 class Group;
+class TestObject;
+struct TestSettings;
 enum class Family;
+enum class Variance;
 
 VectorXd getScoreVector(VectorXd& Ycenter, MatrixXd& X);
 
 MatrixXd getRobustVarianceBinomial(VectorXd& Ycenter, MatrixXd& X, Group& group, VectorXd robustVar, bool rvs);
 MatrixXd getRobustVarianceNormal(VectorXd& Ycenter, MatrixXd& X, Group& group, VectorXd robustVar, bool rvs);
 MatrixXd getRegularVariance(VectorXd& Ycenter, MatrixXd& X, MatrixXd& Z, VectorXd& MU, Family family);
+
+//batched bootstrap: variance of an iteration is sum_g weights[g] * components[g]
+std::vector<MatrixXd> getVarianceComponents(TestObject& o, TestSettings& test, Family family);
+VectorXd getVarianceWeights(TestObject& o, VectorXd& Ycenter, TestSettings& test, Family family);
+
+//========================================================
+// Variance kernels, instantiated for every variance, family
+// and set size. Sets of up to MAX_FIXED_VARIANTS variants
+// work on fixed size matrices.
+//========================================================
+static const int MAX_FIXED_VARIANTS = 8;
+typedef MatrixXd (*VarianceKernel)(TestObject& o, MatrixXd& X, bool rvs);
+
+//kernel of one test, chosen once for all of its bootstrap iterations
+struct ScoreKernel {
+    VarianceKernel variance;
+    //COMMON and CAST with regular variance only need the variance of the burden X * 1
+    bool burden;
+    bool rvs;
+};
+
+VarianceKernel getVarianceKernel(Variance variance, Family family, int nsnp);
+ScoreKernel getScoreKernel(TestSettings& test, Family family, int nsnp);
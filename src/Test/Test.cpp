@@ -1,9 +1,391 @@
 #include "Test.h"
-#include "../Eigen/src/MatrixFunctions/MatrixSquareRoot.h"
 #include "../Math/CompQuadForm.h"
 #include "ScoreTestFunctions.h"
 #include "TestObject.h"
 #include "../Log.h"
+#include "../ThreadPool.h"
+#include "../Trace.h"
+#include "../PerfCounters.h"
+#include "../Output/SummaryStatistics.h"
+
+#include <atomic>
+
+//eigenvalues of a score variance, shared by the C-alpha fallback check and the p-value
+struct VarianceSpectrum {
+    VectorXd eigenvalues;
+    //eigenvalues of the SKAT kernel V^1/2 W V^1/2
+    VectorXd kernel;
+    //SKAT-O only: the burden direction L^1/2 Q' W^1/2 1 in the eigenbasis of the kernel
+    VectorXd burden;
+    bool negative;
+};
+
+inline bool usesKernel(Statistic s) { return s == Statistic::SKAT || s == Statistic::SKATO; }
+
+/*
+Decomposes the variance matrix once with a self-adjoint solver. With V = Q L Q', the SKAT
+kernel V^1/2 W V^1/2 has the same eigenvalues as the symmetric L^1/2 Q'WQ L^1/2, so no
+matrix square root is needed.
+
+@param s Indicates which statistic to use.
+@param variance Variance matrix of the score vector.
+@param weights Variant weights used by SKAT and SKAT-O.
+
+@return Eigenvalues of the variance and, for SKAT and SKAT-O, of the weighted kernel.
+*/
+VarianceSpectrum decomposeVariance(Statistic s, MatrixXd& variance, VectorXd& weights) {
+
+    VarianceSpectrum spectrum;
+
+    Eigen::SelfAdjointEigenSolver<MatrixXd> solver(variance,
+            usesKernel(s) ? Eigen::ComputeEigenvectors : Eigen::EigenvaluesOnly);
+    spectrum.eigenvalues = solver.eigenvalues();
+    spectrum.negative = spectrum.eigenvalues.minCoeff() < 0;
+
+    //the kernel is not used when C-alpha is the fallback
+    if(usesKernel(s) && !spectrum.negative){
+        MatrixXd Q = solver.eigenvectors();
+        VectorXd rootL = spectrum.eigenvalues.array().sqrt();
+        MatrixXd QWQ = Q.transpose() * weights.asDiagonal() * Q;
+        MatrixXd kernel = rootL.asDiagonal() * QWQ * rootL.asDiagonal();
+
+        if(s == Statistic::SKAT){
+            spectrum.kernel = Eigen::SelfAdjointEigenSolver<MatrixXd>(kernel, Eigen::EigenvaluesOnly).eigenvalues();
+            return spectrum;
+        }
+
+        Eigen::SelfAdjointEigenSolver<MatrixXd> kernelSolver(kernel);
+        VectorXd burden = rootL.asDiagonal() * (Q.transpose() * weights.array().sqrt().matrix());
+        spectrum.kernel = kernelSolver.eigenvalues();
+        spectrum.burden = kernelSolver.eigenvectors().transpose() * burden;
+    }
+
+    return spectrum;
+}
+
+//number of quadratic form p-values taken from each tier, see quadFormPvalue
+static std::atomic<long long> LIU_COUNT(0);
+static std::atomic<long long> DAVIES_COUNT(0);
+
+void resetQuadFormCounts() {
+    LIU_COUNT = 0;
+    DAVIES_COUNT = 0;
+}
+
+QuadFormCounts getQuadFormCounts() {
+    QuadFormCounts counts;
+    counts.liu = LIU_COUNT;
+    counts.davies = DAVIES_COUNT;
+    return counts;
+}
+
+/*
+Calculates P[Q > q] for a weighted sum of chi-squared variables. Liu's moment matching is
+tried first and Davies' method is only used when that approximation falls below the
+threshold, where the accuracy of the tail matters. If Davies' method does not converge
+within its limit the Liu approximation is kept.
+
+@param lambda Coefficients of the chi-squared variables.
+@param q Observed value of the quadratic form.
+@param test Davies threshold, accuracy and limit to use.
+
+@return p-value
+*/
+double quadFormPvalue(const std::vector<double>& lambda, double q, TestSettings& test) {
+    TraceDetail span("CQF", "terms", static_cast<long long>(lambda.size()));
+    PerfScope counters(PerfStage::CQF, 1);
+    //one workspace per thread, reused for every set the thread evaluates
+    static thread_local CQF pval;
+
+    double liu = NAN;
+    if(test.getDaviesThreshold() < 1){
+        liu = pval.liu(lambda, q);
+        if(!std::isnan(liu) && liu >= test.getDaviesThreshold()){
+            LIU_COUNT++;
+            return liu;
+        }
+    }
+
+    double p = pval.qfc(lambda, q, static_cast<int>(lambda.size()), test.getDaviesAccuracy(), test.getDaviesLimit());
+    if(pval.failed()){
+        if(std::isnan(liu))
+            liu = pval.liu(lambda, q);
+        if(!std::isnan(liu)){
+            LIU_COUNT++;
+            return liu;
+        }
+    }
+
+    DAVIES_COUNT++;
+    return p;
+}
+
+//rho grid of SKAT-O, from SKAT only (0) to burden only (1, used as 0.999 as in Lee et al. 2012)
+static const double OPTIMAL_RHO[] = { 0, 0.01, 0.04, 0.09, 0.16, 0.25, 0.5, 0.999 };
+static const int NRHO = 8;
+
+//mean, sd and degrees of freedom of the chi-squared matched to a quadratic form (Liu et al. 2009,
+//modified so the kurtosis is matched when the skewness cannot be)
+struct LiuParameters {
+    double muQ, sigmaQ, muX, sigmaX, df;
+
+    LiuParameters(VectorXd& lambda) {
+        double c1 = lambda.sum();
+        double c2 = lambda.array().square().sum();
+        double c3 = lambda.array().cube().sum();
+        double c4 = lambda.array().square().square().sum();
+
+        double s1 = c3 / std::pow(c2, 1.5);
+        double s2 = c4 / (c2 * c2);
+
+        double a, d;
+        if(s1 * s1 > s2){
+            a = 1 / (s1 - std::sqrt(s1 * s1 - s2));
+            d = s1 * a * a * a - a * a;
+            df = a * a - 2 * d;
+        }
+        else{
+            df = 1 / s2;
+            a = std::sqrt(df);
+            d = 0;
+        }
+
+        muQ = c1;
+        sigmaQ = std::sqrt(2 * c2);
+        muX = df + d;
+        sigmaX = std::sqrt(2.0) * a;
+    }
+
+    //value of the quadratic form with upper tail probability p
+    inline double quantile(double p) {
+        return (chiSquareUpperQuantile(p, df) - muX) / sigmaX * sigmaQ + muQ;
+    }
+};
+
+/*
+Calculates the SKAT-O p-value (Lee et al. 2012), the minimum over a grid of rho of the p-values of
+Q_rho = (1 - rho) Q_SKAT + rho Q_burden. Everything is derived from the kernel decomposition of
+SKAT: in the kernel eigenbasis with eigenvalues g and burden direction d, Q_rho has the eigenvalues
+of (1 - rho) diag(g) + rho d d'. The p-value of the minimum is found by integrating over the
+chi-squared component shared by every rho, using Liu's approximation for the rest.
+
+@param test Davies threshold, accuracy and limit used for the p-value of each rho.
+@param score Score vector.
+@param spectrum Eigenvalues from decomposeVariance(SKATO).
+@param weights Variant weights.
+@param scale Factor applied to the decomposed variance.
+
+@return p-value
+*/
+double optimalPvalue(TestSettings& test, VectorXd& score, VarianceSpectrum& spectrum, VectorXd& weights, double scale) {
+
+    VectorXd g = scale * spectrum.kernel;
+    VectorXd d = std::sqrt(scale) * spectrum.burden;
+
+    double skat = 0;
+    double burden = 0;
+    for(int i = 0; i < score.rows(); i++){
+        skat += score[i] * weights[i] * score[i];
+        burden += std::sqrt(weights[i]) * score[i];
+    }
+    burden *= burden;
+
+    static thread_local std::vector<double> eigenvalues;
+    double dd = d.squaredNorm();
+    if(dd <= 0){
+        eigenvalues.assign(g.data(), g.data() + g.size());
+        return quadFormPvalue(eigenvalues, skat, test);
+    }
+
+    //p-value and eigenvalues of each Q_rho
+    double q[NRHO];
+    double pvals[NRHO];
+    std::vector<VectorXd> lambdas(NRHO);
+    double pmin = 1;
+
+    for(int r = 0; r < NRHO; r++){
+        double rho = OPTIMAL_RHO[r];
+        if(rho == 0)
+            lambdas[r] = g;
+        else{
+            MatrixXd M = rho * d * d.transpose();
+            M.diagonal() += (1 - rho) * g;
+            lambdas[r] = Eigen::SelfAdjointEigenSolver<MatrixXd>(M, Eigen::EigenvaluesOnly).eigenvalues();
+            lambdas[r] = lambdas[r].cwiseMax(0);
+        }
+
+        q[r] = (1 - rho) * skat + rho * burden;
+        eigenvalues.assign(lambdas[r].data(), lambdas[r].data() + lambdas[r].size());
+        pvals[r] = quadFormPvalue(eigenvalues, q[r], test);
+        pmin = std::min(pmin, pvals[r]);
+    }
+
+    //value every Q_rho would need to reach the smallest p-value
+    double quantiles[NRHO];
+    for(int r = 0; r < NRHO; r++)
+        quantiles[r] = LiuParameters(lambdas[r]).quantile(pmin);
+
+    //Q_rho = (1 - rho) K + tau_rho X with X ~ chi^2_1, K independent of X with eigenvalues of P diag(g) P,
+    //P the projection orthogonal to d
+    VectorXd gd = g.cwiseProduct(d);
+    double dgd = d.dot(gd);
+    MatrixXd P = MatrixXd::Identity(d.rows(), d.rows()) - d * d.transpose() / dd;
+    MatrixXd PGP = P * g.asDiagonal() * P;
+    VectorXd rest = Eigen::SelfAdjointEigenSolver<MatrixXd>(PGP, Eigen::EigenvaluesOnly).eigenvalues().cwiseMax(0);
+
+    //only the burden direction is left (a single variant), so every Q_rho is the same test
+    if(rest.sum() <= 1e-8 * g.sum())
+        return pmin;
+
+    double tau[NRHO];
+    for(int r = 0; r < NRHO; r++)
+        tau[r] = OPTIMAL_RHO[r] * dd + (1 - OPTIMAL_RHO[r]) * dgd / dd;
+
+    double remaining = 4 * (gd.squaredNorm() - dgd * dgd / dd) / dd;
+    LiuParameters K(rest);
+    double muK = K.muQ;
+    double sdK = std::sqrt(K.sigmaQ * K.sigmaQ + remaining);
+
+    //integrate P[K < min_rho (quantile_rho - tau_rho x) / (1 - rho)] over the chi^2_1 density of x,
+    //substituting x = t^2 to remove the singularity at 0 (Simpson's rule on [0, sqrt(40)])
+    int nstep = 200;
+    double upper = std::sqrt(40.0);
+    double h = upper / nstep;
+    double integral = 0;
+    for(int i = 0; i <= nstep; i++){
+        double t = i * h;
+        double x = t * t;
+
+        double bound = INFINITY;
+        for(int r = 0; r < NRHO; r++)
+            bound = std::min(bound, (quantiles[r] - tau[r] * x) / (1 - OPTIMAL_RHO[r]));
+
+        double cdf = 0;
+        if(bound > 0){
+            double chi = (bound - muK) / sdK * std::sqrt(2 * K.df) + K.df;
+            cdf = 1 - chiSquareUpperTail(chi, K.df);
+        }
+
+        double density = 2 * std::exp(-x / 2) / std::sqrt(2 * M_PI);
+        double coef = (i == 0 || i == nstep) ? 1 : ((i % 2 == 1) ? 4 : 2);
+        integral += coef * cdf * density;
+    }
+    integral *= h / 3;
+
+    double p = 1 - integral;
+
+    //the integral loses precision in the far tail, where the Bonferroni bound is close
+    if(p <= 0 || pmin * 3 < p)
+        p = pmin * 3;
+
+    return std::min(p, 1.0);
+}
+
+/*
+Calculates the SKAT, SKAT-O or C-alpha p-value from a decomposed variance. The variance may be
+scaled by a constant, which scales every eigenvalue.
+
+@param test Indicates which statistic and p-value threshold to use.
+@param score Score vector.
+@param spectrum Eigenvalues from decomposeVariance.
+@param weights Variant weights used by SKAT and SKAT-O.
+@param scale Factor applied to the decomposed variance.
+
+@return p-value
+*/
+double evaluateSpectrum(TestSettings& test, VectorXd& score, VarianceSpectrum& spectrum, VectorXd& weights, double scale = 1) {
+
+    //todo: temporary solution to eigenvalue issue
+    bool useCalpha = spectrum.negative || scale * spectrum.eigenvalues.sum() < 1e-4;
+
+    if (test.getStatistic() == Statistic::CALPHA)
+        useCalpha = true;
+
+    static thread_local std::vector<double> eigenvalues;
+
+    if(useCalpha){
+        eigenvalues.assign(spectrum.eigenvalues.data(), spectrum.eigenvalues.data() + spectrum.eigenvalues.size());
+        for(double& e : eigenvalues)
+            e *= scale;
+        return quadFormPvalue(eigenvalues, score.array().pow(2).sum(), test);
+    }
+
+    if(test.getStatistic() == Statistic::SKATO)
+        return optimalPvalue(test, score, spectrum, weights, scale);
+
+    //skat-Z
+    double quad = 0;
+    for(int i = 0; i < score.rows(); i++)
+        quad += score[i]*weights[i]*score[i];
+
+    eigenvalues.assign(spectrum.kernel.data(), spectrum.kernel.data() + spectrum.kernel.size());
+    for(double& e : eigenvalues)
+        e *= scale;
+    return quadFormPvalue(eigenvalues, quad, test);
+}
+
+/*
+Calculates the p-value of a score test from its score vector and variance matrix.
+
+@param test Indicates which statistic and p-value threshold to use.
+@param score Score vector.
+@param variance Variance matrix of the score vector.
+@param weights Variant weights used by SKAT and SKAT-O.
+
+@return p-value
+*/
+double evaluateStatistic(TestSettings& test, VectorXd& score, MatrixXd& variance, VectorXd& weights) {
+
+    Statistic s = test.getStatistic();
+
+    if(s == Statistic::COMMON || s == Statistic::CAST){
+
+        double testStat = std::pow(score.sum(), 2) / variance.sum();
+        return chiSquareOneDOF(testStat);
+    }
+
+    if(s == Statistic::SKAT || s == Statistic::CALPHA || s == Statistic::SKATO){
+        VarianceSpectrum spectrum = decomposeVariance(s, variance, weights);
+        return evaluateSpectrum(test, score, spectrum, weights);
+    }
+
+    throwError("Test", "Unsure which score test to use. This should not happen.");
+    return NAN;
+}
+
+/*
+Calculates the p-value of the COMMON or CAST score with the saddlepoint approximation of
+its distribution under the binomial null. Both statistics are a sum over samples of the
+(burden) genotype times the centred phenotype.
+
+@param o Test object containing data.
+
+@return p-value
+*/
+double saddlepointStatistic(TestObject& o) {
+
+    VectorXd g = o.getX()->rowwise().sum();
+    VectorXd mu = *o.getMU();
+    MatrixXd* Z = o.getZ();
+
+    //project the intercept and covariates out of g, so its variance under the CGF is the score variance
+    if(Z->cols() > 0){
+        VectorXd w = mu.array() * (1 - mu.array());
+        MatrixXd ZW = Z->transpose() * w.asDiagonal();
+        MatrixXd ZWZ = ZW * *Z;
+        g -= *Z * ZWZ.ldlt().solve(ZW * g);
+    }
+
+    double score = g.dot(*o.getYcenter());
+    return saddlepointPvalue(score, g, mu);
+}
+
+//the CGF assumes Y given X is Bernoulli(mu), which vRVS does not
+inline bool canUseSaddlepoint(TestSettings& test, Family family) {
+    Statistic s = test.getStatistic();
+    return test.useSaddlepoint() && family == Family::BINOMIAL && test.getVariance() != Variance::RVS &&
+            (s == Statistic::COMMON || s == Statistic::CAST);
+}
 
 /*
 Calculates test statistic.
@@ -11,107 +393,378 @@ Calculates test statistic.
 @param TestObject Test object containing data.
 @param test Indicates which test to use.
 @param family Statistical distribution family.
+@param kernel Variance kernel of the test, see getScoreKernel.
 
 @return test statistic
 */
-double calculateTestStatistic(TestObject& o, TestSettings& test, Family family, bool print) {
+double calculateTestStatistic(TestObject& o, TestSettings& test, Family family, ScoreKernel& kernel) {
+
+    if(canUseSaddlepoint(test, family))
+        return saddlepointStatistic(o);
+
+    if(kernel.burden){
+        MatrixXd burden = o.getX()->rowwise().sum();
+        double score = burden.col(0).dot(*o.getYcenter());
+        MatrixXd variance = kernel.variance(o, burden, kernel.rvs);
+        return chiSquareOneDOF(score * score / variance(0, 0));
+    }
 
     VectorXd score = getScoreVector(*o.getYcenter(), *o.getX());
-    MatrixXd variance = getVarianceMatrix(o, test, family);
+    MatrixXd variance = kernel.variance(o, *o.getX(), kernel.rvs);
+    VectorXd weights;
+    if(usesKernel(test.getStatistic()))
+        weights = o.mafWeightVector();
 
-    Statistic s = test.getStatistic();
+    return evaluateStatistic(test, score, variance, weights);
+}
 
-    if(s == Statistic::COMMON || s == Statistic::CAST){
+/*
+Calculates the statistic of several tests on the same test object. The score and variance
+are computed once and SKAT and C-alpha share one decomposition of the variance.
 
-        double sc = std::pow(score.sum(), 2);
-        double vr = variance.sum();
-        double testStat = std::pow(score.sum(), 2) / variance.sum();
+@param o Test object containing data.
+@param tests Tests to evaluate, all using the variance of the first.
+@param family Statistical distribution family.
+@param summary If not null, receives the score, variance and weights.
 
-        //std::cout << chiSquareOneDOF(testStat) << "\n";
-        return chiSquareOneDOF(testStat);
+@return test statistic of each test
+*/
+VectorXd calculateTestStatistics(TestObject& o, std::vector<TestSettings>& tests, Family family, SummaryRecord* summary = nullptr) {
+
+    VectorXd statistics(tests.size());
+    VectorXd score;
+    MatrixXd variance;
+    VectorXd weights;
+    VarianceSpectrum spectrum;
+    bool decomposed = false;
+
+    if(summary != nullptr){
+        score = getScoreVector(*o.getYcenter(), *o.getX());
+        variance = getVarianceMatrix(o, tests[0], family);
+        weights = o.mafWeightVector();
+
+        summary->score = score;
+        summary->variance = variance;
+        summary->weights = weights;
+    }
 
+    //SKAT-O needs the most of the decomposition, then SKAT, then C-alpha
+    Statistic decomposition = Statistic::CALPHA;
+    for(TestSettings& t : tests){
+        if(t.getStatistic() == Statistic::SKATO)
+            decomposition = Statistic::SKATO;
+        else if(t.getStatistic() == Statistic::SKAT && decomposition != Statistic::SKATO)
+            decomposition = Statistic::SKAT;
     }
 
-    if(s == Statistic::SKAT || s == Statistic::CALPHA){
+    for(size_t j = 0; j < tests.size(); j++){
+        TestSettings& test = tests[j];
+        int k = static_cast<int>(j);
 
-        auto g = variance.eigenvalues();
-        VectorXd f = variance.eigenvalues().real();
+        if(canUseSaddlepoint(test, family)){
+            statistics[k] = saddlepointStatistic(o);
+            continue;
+        }
 
-        //todo: temporary solution to eigenvalue issue
-        bool useCalpha = f.sum() < 1e-4;
-        for(int e = 0; e < f.rows(); e++)
-            if(f[e] < 0)
-                useCalpha = true;
+        if(score.rows() < 1){
+            score = getScoreVector(*o.getYcenter(), *o.getX());
+            variance = getVarianceMatrix(o, test, family);
+            if(usesKernel(decomposition))
+                weights = o.mafWeightVector();
+        }
 
-        if (s == Statistic::CALPHA)
-            useCalpha = true;
+        Statistic s = test.getStatistic();
+        if(s == Statistic::SKAT || s == Statistic::CALPHA || s == Statistic::SKATO){
+            //a larger decomposition also holds everything needed by the smaller ones
+            if(!decomposed){
+                spectrum = decomposeVariance(decomposition, variance, weights);
+                decomposed = true;
+            }
+            statistics[k] = evaluateSpectrum(test, score, spectrum, weights);
+        }
+        else
+            statistics[k] = evaluateStatistic(test, score, variance, weights);
+    }
+
+    return statistics;
+}
+
+/*
+Evaluates the statistic for a batch of bootstrap iterations which share X. The variance
+of each iteration is rebuilt from fixed components (see getVarianceComponents). Every
+column is copied out and summed on its own, so an iteration gets the same statistic in
+a batch of any size and at any place in it.
+
+@param o Test object containing data.
+@param test Indicates which test to use.
+@param family Statistical distribution family.
+@param Ycenter n x B matrix of bootstrapped centred phenotypes.
+@param components Variance components from getVarianceComponents.
+
+@return p-value for each bootstrap iteration.
+*/
+VectorXd calculateTestStatisticBatch(TestObject& o, TestSettings& test, Family family, MatrixXd& Ycenter,
+                                     std::vector<MatrixXd>& components) {
+
+    int nboot = static_cast<int>(Ycenter.cols());
+    VectorXd pvals(nboot);
+
+    Statistic s = test.getStatistic();
+    bool burden = s == Statistic::COMMON || s == Statistic::CAST;
 
-        if(useCalpha){
-            VectorXd e = variance.eigenvalues().real();
-            std::vector<double> eigenvals(e.data(), e.data() + e.size());
-            CQF pval;
-            return pval.qfc(eigenvals, score.array().pow(2).sum(), score.rows());
+    VectorXd componentSum(components.size());
+    for(size_t g = 0; g < components.size(); g++)
+        componentSum[g] = components[g].sum();
+
+    VectorXd weights;
+    if(usesKernel(s))
+        weights = o.mafWeightVector();
+
+    //with a single component every variance is a multiple of it, so one
+    //decomposition serves the whole batch
+    VarianceSpectrum spectrum;
+    if(!burden && components.size() == 1)
+        spectrum = decomposeVariance(s, components[0], weights);
+
+    for(int b = 0; b < nboot; b++){
+        VectorXd y = Ycenter.col(b);
+        VectorXd score = o.getX()->transpose() * y;
+        VectorXd w = getVarianceWeights(o, y, test, family);
+
+        if(burden){
+            double variance = 0;
+            for(int g = 0; g < w.rows(); g++)
+                variance += w[g] * componentSum[g];
+
+            pvals[b] = chiSquareOneDOF(std::pow(score.sum(), 2) / variance);
+        }
+        else if(components.size() == 1)
+            pvals[b] = evaluateSpectrum(test, score, spectrum, weights, w[0]);
+        else{
+            MatrixXd variance = w[0] * components[0];
+            for(size_t g = 1; g < components.size(); g++)
+                variance += w[static_cast<int>(g)] * components[g];
+
+            pvals[b] = evaluateStatistic(test, score, variance, weights);
         }
+    }
 
-        //skat-Z
-        VectorXd A = o.mafWeightVector();
+    return pvals;
+}
+
+/*
+Calculates the statistic of the observed data the way bootstrapChunk evaluates its
+iterations, so both sides of the comparison come from the same sums.
+
+@param o Test object containing data, not bootstrapped yet.
+@param test Indicates which test to use.
+@param family Statistical distribution family.
 
-        double quad = 0;
-        for(int i = 0; i < score.rows(); i++)
-            quad += score[i]*A[i]*score[i];
+@return test statistic
+*/
+double observedStatistic(TestObject& o, TestSettings& test, Family family) {
 
-        MatrixXd sigma = variance.sqrt() * A.asDiagonal() * variance.sqrt();
-        VectorXd e = sigma.eigenvalues().real();
-        std::vector<double> eigenvalues(e.data(), e.data() + e.size());
-        CQF pval;
-        return pval.qfc(eigenvalues, quad, score.rows());
+    if(o.canBootstrapBatch(test, family)){
+        std::vector<MatrixXd> components = getVarianceComponents(o, test, family);
+        MatrixXd Ycenter = *o.getYcenter();
+        return calculateTestStatisticBatch(o, test, family, Ycenter, components)[0];
     }
 
-    throwError("Test", "Unsure which score test to use. This should not happen.");
-    return NAN;
+    ScoreKernel kernel = getScoreKernel(test, family, static_cast<int>(o.getX()->cols()));
+    return calculateTestStatistic(o, test, family, kernel);
 }
 
-double bootstrapTest(double testStatistic, TestObject& o, TestSettings bootTest, Family bootFam, int nboot, bool stopEarly){
+//iterations of a round kept in memory at once, counted in bootstrap batches so that larger
+//batches still fill a round; longer rounds are evaluated in several parts
+static const int BOOTSTRAP_ROUND_BATCHES = 1024;
 
-    bootTest.setRVSFalse();
+/*
+End of the bootstrap budget that iteration bootCount falls in. With early stopping a set
+only moves on to the next budget once the previous one is used up without reaching the
+required number of exceedances. The first budget of 100 * hits iterations is enough to stop
+for p-values down to about 0.01, and every further one is ten times longer so it resolves
+p-values ten times smaller, up to the nboot iterations of -n.
+*/
+inline long long budgetEnd(int bootCount, int hits, int nboot){
+    long long budget = 100LL * hits;
+    while(budget <= bootCount && budget < nboot)
+        budget *= 10;
+
+    return std::min(budget, static_cast<long long>(nboot));
+}
+
+//end of the next round of bootstrap iterations, never crossing a budget when stopping early
+inline int nextRoundEnd(int bootCount, long long round, int nboot, bool stopEarly, int hits, int batchSize){
+    long long roundMax = static_cast<long long>(BOOTSTRAP_ROUND_BATCHES) * std::max(batchSize, 1);
+    long long end = bootCount + std::min(round, roundMax);
+    if(stopEarly)
+        end = std::min(end, budgetEnd(bootCount, hits, nboot));
+
+    return static_cast<int>(std::min(end, static_cast<long long>(nboot)));
+}
+
+inline bool exceedsObserved(double tsamp, double testStatistic){
+    return std::abs(tsamp) < std::abs(testStatistic);
+}
+
+/*
+Evaluates bootstrap iterations [first, first + nboot) and records for each one whether it
+exceeds the observed statistic. Iteration h always draws from RandomStream(key, h) and is
+evaluated on its own column of the batch, so the outcome does not depend on the batch size
+or on the thread running the chunk.
+*/
+void bootstrapChunk(double testStatistic, TestObject& o, TestSettings& bootTest, Family bootFam, RandomKey key,
+                    int first, int nboot, char* exceed){
+
+    TraceDetail span("bootstrap", "iterations", nboot);
+    int batchSize = std::max(bootTest.getBootstrapBatchSize(), 1);
+
+    if(o.canBootstrapBatch(bootTest, bootFam)){
+
+        std::vector<MatrixXd> components = getVarianceComponents(o, bootTest, bootFam);
 
-    double bootCount = 0;
-    double tcount = 0;
-    double tsamp;
+        for (int h = 0; h < nboot; h += batchSize) {
+
+            if(STOP_RUNNING_THREAD)
+                return;
+
+            int b = std::min(batchSize, nboot - h);
+            MatrixXd Ycenter = o.bootstrapYcenterBatch(bootTest, key, first + h, b);
+            VectorXd tsamp = calculateTestStatisticBatch(o, bootTest, bootFam, Ycenter, components);
+
+            for(int i = 0; i < b; i++)
+                exceed[h + i] = exceedsObserved(tsamp[i], testStatistic);
+        }
+        return;
+    }
+
+    ScoreKernel kernel = getScoreKernel(bootTest, bootFam, static_cast<int>(o.getX()->cols()));
 
     for (int h = 0; h < nboot; h++) {
 
         if(STOP_RUNNING_THREAD)
-            return NAN;
+            return;
 
-        o.bootstrap(bootTest, bootFam);
+        RandomStream rng(key, static_cast<uint32_t>(first + h));
+        o.bootstrap(bootTest, bootFam, rng);
 
-        tsamp = calculateTestStatistic(o, bootTest, bootFam, false);
+        double tsamp = calculateTestStatistic(o, bootTest, bootFam, kernel);
+        exceed[h] = exceedsObserved(tsamp, testStatistic);
+    }
+}
 
-        if (std::abs(tsamp) < std::abs(testStatistic))
-                tcount++;
+/*
+Evaluates bootstrap iterations [first, first + nboot), split over the shared pool when
+there is enough work.
+*/
+void bootstrapRound(double testStatistic, TestObject& o, TestSettings& bootTest, Family bootFam, RandomKey key,
+                    int first, int nboot, char* exceed){
+
+    //a few chunks per worker so that chunks finishing early leave no thread idle
+    int nchunk = 1;
+    if(THREAD_POOL != nullptr){
+        int minChunk = std::max(bootTest.getBootstrapBatchSize(), 100);
+        nchunk = std::min(static_cast<int>(THREAD_POOL->size()) * 4, nboot / minChunk);
+    }
+
+    if(nchunk <= 1){
+        bootstrapChunk(testStatistic, o, bootTest, bootFam, key, first, nboot, exceed);
+        return;
+    }
 
-        bootCount++;
+    int chunkSize = (nboot + nchunk - 1) / nchunk;
+    TaskGroup chunks;
+    for(int start = 0; start < nboot; start += chunkSize){
+        int size = std::min(chunkSize, nboot - start);
+
+        THREAD_POOL->submit(chunks, [=, &o, &bootTest]() {
+            TestObject chunk(o);
+            TestSettings settings(bootTest);
+            bootstrapChunk(testStatistic, chunk, settings, bootFam, key, first + start, size, exceed + start);
+        });
+    }
+    THREAD_POOL->wait(chunks);
+}
+
+/*
+Bootstrap p-value. With early stopping this is the sequential Monte Carlo p-value of Besag
+and Clifford (1991): sampling stops as soon as h bootstrap samples are as extreme as the
+observed one and the p-value is h / L for the L iterations used. Sets with large p-values
+stop after a few dozen iterations and only small p-values use the full budget.
+
+Iterations run in rounds that double in size, up to BOOTSTRAP_ROUND_BATCHES bootstrap
+batches, each split over the shared pool. The stopping rule is applied in iteration order so the result
+matches a serial run, and only the exceedances of the current round are kept.
+*/
+double bootstrapTest(TestObject& o, TestSettings test, Family bootFam, RandomKey key, int nboot, bool stopEarly){
 
-        if (stopEarly && bootCount > 10) {
-            double pstar = 5 / ((bootCount + 0.0737224)*(1 + 0.0737224));
-            if (tcount / (1.0*h) > pstar)
-                break;
+    double testStatistic = observedStatistic(o, test, bootFam);
+
+    TestSettings bootTest(test);
+    bootTest.setRVSFalse();
+
+    int hits = bootTest.getStopHits();
+    long long round = stopEarly ? 2LL * hits : nboot;
+    std::vector<char> exceed;
+
+    int tcount = 0;
+    int bootCount = 0;
+    while(bootCount < nboot){
+
+        int size = nextRoundEnd(bootCount, round, nboot, stopEarly, hits, bootTest.getBootstrapBatchSize()) - bootCount;
+        exceed.resize(static_cast<size_t>(size));
+        bootstrapRound(testStatistic, o, bootTest, bootFam, key, bootCount, size, exceed.data());
+
+        if(STOP_RUNNING_THREAD)
+            return NAN;
+
+        for(int i = 0; i < size; i++){
+            tcount += exceed[i];
+            bootCount++;
+
+            if (stopEarly && tcount >= hits)
+                return tcount / static_cast<double>(bootCount);
         }
+
+        //a round never needs to be longer than the whole run
+        round = std::min(round, static_cast<long long>(nboot)) * 2;
     }
 
-    return (tcount + 1) / (bootCount + 1) ;
+    return (tcount + 1.0) / (bootCount + 1.0);
 }
 
 double runTest(SampleInfo* sampleInfo, VariantSet* variant, TestSettings test, int nboot, bool stopEarly){
+    std::vector<TestSettings> tests(1, test);
+    VectorXd pvals = runTests(sampleInfo, variant, tests, nboot, stopEarly);
+    return pvals[0];
+}
+
+/*
+Runs several tests on one variant set. X is extracted and filtered, and the score and
+variance computed, once for all of them, so the tests must share their genotypes, variance
+and samples (see TestSettings::sharesTestObject).
+
+@param sampleInfo Phenotypes, covariates and groups.
+@param variant Variant set to test.
+@param tests Tests to run.
+@param nboot Number of bootstrap iterations, asymptotic p-values if not more than 1.
+@param stopEarly Stop bootstrapping once enough exceedances are found.
+
+@return p-value of each test.
+*/
+VectorXd runTests(SampleInfo* sampleInfo, VariantSet* variant, std::vector<TestSettings> tests, int nboot, bool stopEarly){
 
-    if(STOP_RUNNING_THREAD)
-        return NAN;
+    TraceDetail span("runTests", "variants", variant->validSize());
+    VectorXd pvals = VectorXd::Constant(static_cast<int>(tests.size()), NAN);
+
+    if(STOP_RUNNING_THREAD || tests.size() < 1)
+        return pvals;
     if(variant->validSize() < 1)
-        return NAN;
+        return pvals;
 
+    TestSettings test = tests[0];
     MatrixXd X = variant->getX(test.getGenotype());
-    VectorXd Y = sampleInfo->getY();
+    VectorXd Y = sampleInfo->getY(test.getPhenotype());
     MatrixXd Z = sampleInfo->getZ();
     if(Z.cols()<1)
         Z = MatrixXd::Constant(Y.rows(), 1, 1);
@@ -138,10 +791,48 @@ double runTest(SampleInfo* sampleInfo, VariantSet* variant, TestSettings test, i
 
     TestObject o(geno, pheno, group, test.isRareTest());
 
-    double testStatistic = calculateTestStatistic(o, test, sampleInfo->getFamily(), true);
-
+    //bootstrap p-values are calibrated already and the bootstrap compares score statistics
     if(nboot > 1)
-        return bootstrapTest(testStatistic, o, test, sampleInfo->getFamily(), nboot, stopEarly);
+        for(TestSettings& t : tests)
+            t.setSaddlepoint(false);
+
+    //a bootstrapped test computes its observed statistic with its iterations, see bootstrapTest
+    VectorXd testStatistics;
+    if(SUMMARY_WRITER == nullptr){
+        if(nboot <= 1)
+            testStatistics = calculateTestStatistics(o, tests, sampleInfo->getFamily());
+    }
+    else{
+        SummaryRecord summary;
+        testStatistics = calculateTestStatistics(o, tests, sampleInfo->getFamily(), &summary);
+
+        summary.position = variant->getKey();
+        summary.phenotype = static_cast<uint32_t>(test.getPhenotype());
+        summary.genotype = static_cast<uint8_t>(test.getGenotype());
+        summary.varianceType = static_cast<uint8_t>(test.getVariance());
+        summary.setID = variant->getSetID();
+        summary.P = P;
+        for(Variant& v : *variant->getVariants())
+            if(v.isValid())
+                summary.variants.push_back(v.toString());
+
+        SUMMARY_WRITER->write(summary);
+    }
+
+    if(nboot <= 1)
+        return testStatistics;
+
+    //a shard draws the numbers of the whole run without numbering the sets before it
+    uint64_t setKey = variant->getRandomKey();
+
+    for(size_t j = 0; j < tests.size(); j++){
+        int k = static_cast<int>(j);
+        RandomKey key = { tests[j].getSeed(), setKey, static_cast<uint32_t>(tests[j].getIndex()) };
+
+        //bootstrapping changes the test object, so every test starts from its own copy
+        TestObject boot(o);
+        pvals[k] = bootstrapTest(boot, tests[j], sampleInfo->getFamily(), key, nboot, stopEarly);
+    }
 
-    return testStatistic;
+    return pvals;
 }
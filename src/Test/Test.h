@@ -1,5 +1,6 @@
 #pragma once
 #include "../Math/EigenStructures.h"
+#include <vector>
 
 enum class Family;
 struct SampleInfo;
@@ -8,8 +9,21 @@ struct VariantSet;
 class TestSettings;
 class TestObject;
 
+//number of SKAT/C-alpha p-values taken from each tier
+struct QuadFormCounts {
+    long long liu;
+    long long davies;
+};
+
 //Test.cpp
+void resetQuadFormCounts();
+QuadFormCounts getQuadFormCounts();
 double runTest(SampleInfo* sampleInfo, VariantSet* variant, TestSettings test, int nboot, bool stopEarly);
+VectorXd runTests(SampleInfo* sampleInfo, VariantSet* variant, std::vector<TestSettings> tests, int nboot, bool stopEarly);
+double evaluateStatistic(TestSettings& test, VectorXd& score, MatrixXd& variance, VectorXd& weights);
+
+//CommonTest.cpp
+MatrixXd runCommonTestBlock(SampleInfo* sampleInfo, std::vector<VariantSet*>& variants, TestSettings test);
 
 //TestRareHelper.cpp
 MatrixXd getVarianceMatrix(TestObject& o, TestSettings& test, Family family);
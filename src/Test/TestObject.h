@@ -1,6 +1,7 @@
 #pragma once
 #include "../vikNGS.h"
 #include "../Math/Math.h"
+#include "../Math/RandomStream.h"
 #include "Group.h"
 #include "Genotype.h"
 #include "Phenotype.h"
@@ -37,8 +38,8 @@ public:
         geno.filterX(toRemove);
         group.filterG(toRemove);
         pheno.filterY(toRemove);
-        if(pheno.hasCovariates())
-            pheno.filterZ(toRemove);
+        //the intercept column too, the variance kernels take Z with the rows of X
+        pheno.filterZ(toRemove);
 
         Zboot = *pheno.getZ();
         Ycenter = pheno.getYCenter();
@@ -67,54 +68,112 @@ public:
     inline VectorXd* getMU(){ return pheno.getMu(); }
     inline VectorXd* getYcenter(){ return &Ycenter; }
 
-    inline void bootstrap(TestSettings& test, Family family) {
+    inline void bootstrap(TestSettings& test, Family family, RandomStream& rng) {
 
        if(test.isExpectedGenotypes()){
            calculateXcenter();
            calculateGroupVector();
 
            if(family == Family::NORMAL)
-               normalBootstrap();
+               normalBootstrap(rng);
            if(family == Family::BINOMIAL)
-               binomialBootstrap();
+               binomialBootstrap(rng);
        }
        else
-           permute();
+           permute(rng);
 
        bootstrapped = true;
        calculateYCenterBoot();
    }
 
+    //batched bootstrap is only possible when X stays fixed and
+    //the null model refit is linear in Y
+    inline bool canBootstrapBatch(TestSettings& test, Family family) {
+        if(test.isExpectedGenotypes())
+            return family == Family::NORMAL;
+
+        return !pheno.hasCovariates();
+    }
+
+    /*
+    Generates nbatch bootstrapped centred phenotypes at once, one per column.
+    Must be used instead of bootstrap(), not alongside it.
+
+    @param test Indicates which test is being bootstrapped.
+    @param key Identifies the random streams of this test.
+    @param first Bootstrap iteration of the first column.
+    @param nbatch Number of bootstrap iterations in the batch.
+    @return n x nbatch matrix of centred phenotypes.
+    */
+    inline MatrixXd bootstrapYcenterBatch(TestSettings& test, RandomKey key, int first, int nbatch) {
+
+        VectorXd* Y = pheno.getY();
+        MatrixXd Yb(Y->rows(), nbatch);
+
+        if(!test.isExpectedGenotypes()){
+            for(int b = 0; b < nbatch; b++){
+                RandomStream rng(key, first + b);
+                Yb.col(b) = shuffleWithoutReplacement(*Y, rng);
+            }
+
+            return Yb.array() - Y->mean();
+        }
+
+        calculateGroupVector();
+
+        if(pheno.hasCovariates()){
+            //refit the linear model for every column with one decomposition, column by
+            //column so the residuals do not depend on the batch size
+            MatrixXd* Z = pheno.getZ();
+            Eigen::HouseholderQR<MatrixXd> qr(*Z);
+
+            for(int b = 0; b < nbatch; b++){
+                RandomStream rng(key, first + b);
+                VectorXd y = *Y - Ycenter + groupwiseShuffleWithoutReplacement(Ycenter, *group.getG(), groupVector, rng);
+                Yb.col(b) = y - *Z * qr.solve(y);
+            }
+
+            return Yb;
+        }
+
+        for(int b = 0; b < nbatch; b++){
+            RandomStream rng(key, first + b);
+            Yb.col(b) = groupwiseShuffleWithoutReplacement(*Y, *group.getG(), groupVector, rng);
+        }
+
+        return Yb.array() - Y->mean();
+    }
+
 
 //bootstrap functions
 private:
 
     bool bootstrapped;
 
-    inline void permute() {
+    inline void permute(RandomStream& rng) {
 
         if(!bootstrapped)
             Xboot = *geno.getX();
 
-        Yboot = shuffleWithoutReplacement(*pheno.getY());
-        //Xboot = shuffleColumnwiseWithoutReplacement(*geno.getX());
+        Yboot = shuffleWithoutReplacement(*pheno.getY(), rng);
+        //Xboot = shuffleColumnwiseWithoutReplacement(*geno.getX(), rng);
 
         if(pheno.hasCovariates())
-           Zboot = shuffleColumnwiseWithoutReplacement(*pheno.getZ());
+           Zboot = shuffleColumnwiseWithoutReplacement(*pheno.getZ(), rng);
     }
 
-    void binomialBootstrap() {
+    void binomialBootstrap(RandomStream& rng) {
         if(!bootstrapped)
             Yboot = *pheno.getY();
-        Xboot = groupwiseShuffleWithReplacement(Xcenter, *group.getG(), groupVector);
+        Xboot = groupwiseShuffleWithReplacement(Xcenter, *group.getG(), groupVector, rng);
 
 
         //todo?
         if(pheno.hasCovariates())
-            Zboot = groupwiseShuffleWithReplacement(*pheno.getZ(), *group.getG(), groupVector);
+            Zboot = groupwiseShuffleWithReplacement(*pheno.getZ(), *group.getG(), groupVector, rng);
     }
 
-    void normalBootstrap() {
+    void normalBootstrap(RandomStream& rng) {
 
 
        if(pheno.hasCovariates()){
@@ -125,12 +184,12 @@ private:
                Ycenter_original = Ycenter;
            }
 
-           VectorXd residuals = groupwiseShuffleWithoutReplacement(Ycenter_original, *group.getG(), groupVector);
+           VectorXd residuals = groupwiseShuffleWithoutReplacement(Ycenter_original, *group.getG(), groupVector, rng);
            Yboot = *pheno.getY() - Ycenter_original + residuals;
 
        }
        else{
-           Yboot = groupwiseShuffleWithoutReplacement(*pheno.getY(), *group.getG(), groupVector);
+           Yboot = groupwiseShuffleWithoutReplacement(*pheno.getY(), *group.getG(), groupVector, rng);
            if(!bootstrapped)
                Xboot = *geno.getX();
        }
@@ -168,9 +227,20 @@ private:
         XcenterCache = true;
     }
 
+    VectorXd bootBeta;
+    IRLSWorkspace irls;
+
     inline void calculateYCenterBoot() {
 
-        if(pheno.hasCovariates()){
+        if(pheno.hasCovariates() && pheno.getFamily() == Family::BINOMIAL){
+            //bootstrap samples stay close to the null model, so its fit is a good
+            //starting point. Starting from the previous sample instead would make
+            //the result depend on the order in which iterations run.
+            bootBeta = *pheno.getCoefficients();
+            logisticRegression(Yboot, Zboot, bootBeta, irls);
+            this->MU = fitModel(bootBeta, Zboot, pheno.getFamily());
+        }
+        else if(pheno.hasCovariates()){
             VectorXd beta = getBeta(Yboot, Zboot, pheno.getFamily());
             this->MU = fitModel(beta, Zboot, pheno.getFamily());
         }
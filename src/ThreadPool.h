@@ -0,0 +1,239 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//========================================================
+// Tracks a set of tasks submitted to a ThreadPool so the
+// submitting thread can wait for all of them
+//========================================================
+
+struct TaskGroup {
+    std::atomic<int> pending;
+    //tasks of the group still in a deque, checked by the thread waiting on it
+    std::atomic<int> queued;
+    std::exception_ptr error;
+
+    TaskGroup() : pending(0), queued(0) { }
+};
+
+//========================================================
+// Persistent worker threads shared by every stage of an
+// analysis. Each worker has its own deque: it runs its newest
+// task first and, when it has none, steals the oldest task of
+// another worker. Tasks submitted from a worker go to its own
+// deque, others are spread over all deques. A worker waiting
+// on a TaskGroup runs the tasks of that group itself instead
+// of sleeping, so tasks may be submitted from inside other
+// tasks. It never takes the tasks of another group, so a set
+// waiting on its bootstrap chunks cannot end up running the
+// long bootstrap of another set. Other threads sleep while
+// they wait, so no more than size() threads run tasks.
+//========================================================
+
+class ThreadPool {
+private:
+    struct Task {
+        TaskGroup* group;
+        std::function<void()> run;
+    };
+
+    struct WorkerQueue {
+        std::deque<Task> tasks;
+        std::mutex lock;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+
+    //tasks in all deques, checked by sleeping threads
+    std::atomic<int> queued;
+    std::atomic<size_t> nextQueue;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::mutex errorLock;
+    bool stopping;
+
+    //pool and deque of the calling thread, if it is a worker
+    struct WorkerID {
+        ThreadPool* pool;
+        int index;
+    };
+    static WorkerID& currentWorker(){
+        static thread_local WorkerID id = { nullptr, -1 };
+        return id;
+    }
+
+    inline int selfIndex(){
+        WorkerID& id = currentWorker();
+        return (id.pool == this) ? id.index : -1;
+    }
+
+    inline void notify(bool all){
+        std::lock_guard<std::mutex> guard(sleepLock);
+        if(all)
+            wake.notify_all();
+        else
+            wake.notify_one();
+    }
+
+    //takes the newest or oldest task of the deque, only one of the group if group is not null
+    inline bool take(WorkerQueue& q, bool newest, TaskGroup* group, Task& task){
+        std::lock_guard<std::mutex> guard(q.lock);
+        if(q.tasks.empty())
+            return false;
+
+        if(group == nullptr){
+            task = std::move(newest ? q.tasks.back() : q.tasks.front());
+            if(newest)
+                q.tasks.pop_back();
+            else
+                q.tasks.pop_front();
+        }
+        else{
+            auto it = q.tasks.end();
+            if(newest){
+                for(auto r = q.tasks.rbegin(); r != q.tasks.rend() && it == q.tasks.end(); ++r)
+                    if(r->group == group)
+                        it = std::prev(r.base());
+            }
+            else{
+                for(auto f = q.tasks.begin(); f != q.tasks.end() && it == q.tasks.end(); ++f)
+                    if(f->group == group)
+                        it = f;
+            }
+            if(it == q.tasks.end())
+                return false;
+
+            task = std::move(*it);
+            q.tasks.erase(it);
+        }
+
+        queued--;
+        task.group->queued--;
+        return true;
+    }
+
+    //finds a task for the calling thread, only one of the group if group is not null
+    inline bool findTask(Task& task, int self, TaskGroup* group = nullptr){
+        if(queued.load() < 1 || (group != nullptr && group->queued.load() < 1))
+            return false;
+
+        int n = static_cast<int>(queues.size());
+
+        if(self >= 0 && take(*queues[self], true, group, task))
+            return true;
+
+        int start = (self >= 0) ? self + 1 : 0;
+        for(int i = 0; i < n; i++)
+            if(take(*queues[(start + i) % n], false, group, task))
+                return true;
+
+        return false;
+    }
+
+    inline void run(Task& task){
+        try{ task.run(); }
+        catch(...){
+            std::lock_guard<std::mutex> guard(errorLock);
+            if(!task.group->error)
+                task.group->error = std::current_exception();
+        }
+
+        if(--task.group->pending == 0)
+            notify(true);
+    }
+
+    inline void work(int index){
+        currentWorker() = { this, index };
+
+        while(true){
+            Task task;
+            if(findTask(task, index)){
+                run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wake.wait(guard, [this]{ return stopping || queued.load() > 0; });
+            if(stopping && queued.load() < 1)
+                return;
+        }
+    }
+
+public:
+
+    ThreadPool(size_t nthreads) : queued(0), nextQueue(0), stopping(false) {
+        for(size_t i = 0; i < nthreads; i++)
+            queues.emplace_back(new WorkerQueue());
+        for(size_t i = 0; i < nthreads; i++)
+            workers.emplace_back([this, i]{ work(static_cast<int>(i)); });
+    }
+
+    ~ThreadPool(){
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    inline size_t size(){ return workers.size(); }
+
+    inline void submit(TaskGroup& group, std::function<void()> task){
+        group.pending++;
+
+        //without workers the task runs right away
+        if(queues.empty()){
+            Task t = { &group, std::move(task) };
+            run(t);
+            return;
+        }
+
+        int self = selfIndex();
+        size_t index = (self >= 0) ? static_cast<size_t>(self) : nextQueue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> guard(queues[index]->lock);
+            queues[index]->tasks.push_back({ &group, std::move(task) });
+            queued++;
+            group.queued++;
+        }
+
+        //idle workers and workers helping in wait() sleep on the same condition, and only
+        //the workers waiting on this group or idle workers can take it
+        notify(true);
+    }
+
+    //blocks until every task in the group is done, rethrows the first error
+    inline void wait(TaskGroup& group){
+        int self = selfIndex();
+
+        while(group.pending > 0){
+            //only workers help, the reader and collapse threads would run tasks beyond size()
+            Task task;
+            if(self >= 0 && findTask(task, self, &group)){
+                run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(sleepLock);
+            if(self >= 0)
+                wake.wait(guard, [&group]{ return group.pending == 0 || group.queued.load() > 0; });
+            else
+                wake.wait(guard, [&group]{ return group.pending == 0; });
+        }
+
+        if(group.error)
+            std::rethrow_exception(group.error);
+    }
+};
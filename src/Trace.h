@@ -0,0 +1,247 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//========================================================
+// Timeline of a run written in the Chrome trace event
+// format, for chrome://tracing or ui.perfetto.dev. A
+// TraceSpan records the time from its construction to its
+// destruction on the thread that made it. Every thread
+// keeps its spans in a buffer of its own, so recording a
+// span takes no lock, and the buffers are only read by
+// write once the threads are done. Without --trace the
+// global TRACER is null and a span costs a single check.
+// Each thread keeps at most TRACE_EVENTS_PER_THREAD spans,
+// so a long run cannot fill the memory with its trace. A
+// TraceDetail is a span of work done once per variant, set
+// or bootstrap chunk (EM, CQF, ...). A thread records the
+// first TRACE_DETAIL_ALL spans of each detail name and one
+// in TRACE_DETAIL_SAMPLE after that, and stops recording
+// them at TRACE_DETAIL_EVENTS_PER_THREAD, so every kind of
+// span shows up and the stage spans always have room left.
+//========================================================
+
+//about 40 MB per thread
+static const size_t TRACE_EVENTS_PER_THREAD = 1 << 20;
+static const size_t TRACE_DETAIL_EVENTS_PER_THREAD = TRACE_EVENTS_PER_THREAD / 2;
+static const uint64_t TRACE_DETAIL_ALL = 1 << 12;
+static const uint64_t TRACE_DETAIL_SAMPLE = 64;
+
+struct TraceEvent {
+    const char* name;
+    //optional count shown with the span, argName null if none
+    const char* argName;
+    long long arg;
+    //ns since the tracer was created
+    uint64_t begin;
+    uint64_t duration;
+};
+
+struct TraceBuffer {
+    int tid;
+    std::string thread;
+    std::vector<TraceEvent> events;
+    uint64_t dropped = 0;
+    //detail spans seen per name, and those left out by sampling
+    std::vector<std::pair<const char*, uint64_t>> details;
+    uint64_t sampledOut = 0;
+
+    //false if the next detail span of this name is left out by sampling
+    inline bool sampleDetail(const char* name){
+        size_t i = 0;
+        while(i < details.size() && details[i].first != name)
+            i++;
+        if(i == details.size())
+            details.emplace_back(name, 0);
+
+        uint64_t seen = details[i].second++;
+        if(seen < TRACE_DETAIL_ALL || seen % TRACE_DETAIL_SAMPLE == 0)
+            return true;
+        sampledOut++;
+        return false;
+    }
+};
+
+//tracers of successive runs in one process get different ids, see Tracer::buffer
+inline uint64_t nextTracerId(){
+    static std::atomic<uint64_t> next(0);
+    return ++next;
+}
+
+class Tracer;
+extern Tracer* TRACER;
+
+class Tracer {
+private:
+    std::string path;
+    uint64_t id;
+    std::chrono::steady_clock::time_point origin;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+
+public:
+
+    Tracer(std::string file) : path(file), id(nextTracerId()), origin(std::chrono::steady_clock::now()) { }
+
+    ~Tracer(){
+        if(TRACER == this)
+            TRACER = nullptr;
+    }
+
+    inline std::string getPath() { return path; }
+
+    //spans left out once a thread had TRACE_EVENTS_PER_THREAD
+    inline uint64_t getDropped(){
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t dropped = 0;
+        for(std::unique_ptr<TraceBuffer>& b : buffers)
+            dropped += b->dropped;
+        return dropped;
+    }
+
+    //detail spans left out by sampling
+    inline uint64_t getSampledOut(){
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t sampled = 0;
+        for(std::unique_ptr<TraceBuffer>& b : buffers)
+            sampled += b->sampledOut;
+        return sampled;
+    }
+
+    inline uint64_t now(){
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now() - origin).count());
+    }
+
+    //buffer of the calling thread, made on its first span
+    inline TraceBuffer* buffer(){
+        static thread_local uint64_t cachedId = 0;
+        static thread_local TraceBuffer* cached = nullptr;
+
+        if(cachedId != id){
+            std::lock_guard<std::mutex> guard(lock);
+            buffers.emplace_back(new TraceBuffer());
+            cached = buffers.back().get();
+            cached->tid = static_cast<int>(buffers.size());
+            cached->thread = "worker";
+            cachedId = id;
+        }
+        return cached;
+    }
+
+    //name shown for the calling thread in the timeline
+    inline void nameThread(std::string name){
+        buffer()->thread = name;
+    }
+
+    /*
+    Writes every span recorded so far. Threads must not record spans meanwhile.
+
+    @return false if the file could not be opened.
+    */
+    inline bool write(){
+        FILE* out = std::fopen(path.c_str(), "w");
+        if(out == nullptr)
+            return false;
+
+        uint64_t dropped = getDropped();
+        uint64_t sampled = getSampledOut();
+        std::lock_guard<std::mutex> guard(lock);
+        std::fprintf(out, "{\"displayTimeUnit\":\"ms\",\"droppedSpans\":%llu,\"sampledOutSpans\":%llu,\"traceEvents\":[\n",
+                     static_cast<unsigned long long>(dropped), static_cast<unsigned long long>(sampled));
+
+        bool first = true;
+        for(std::unique_ptr<TraceBuffer>& b : buffers){
+            std::fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                         first ? "" : ",\n", b->tid, b->thread.c_str(), b->tid);
+            first = false;
+        }
+
+        for(std::unique_ptr<TraceBuffer>& b : buffers){
+            for(TraceEvent& e : b->events){
+                std::fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"vikNGS\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                             e.name, b->tid, e.begin / 1000.0, e.duration / 1000.0);
+                if(e.argName != nullptr)
+                    std::fprintf(out, ",\"args\":{\"%s\":%lld}", e.argName, e.arg);
+                std::fprintf(out, "}");
+            }
+        }
+
+        std::fprintf(out, "\n]}\n");
+        std::fclose(out);
+        return true;
+    }
+};
+
+class TraceSpan {
+private:
+    Tracer* tracer;
+    const char* name;
+    const char* argName;
+    long long arg;
+    uint64_t begin;
+    //see TraceDetail
+    bool detail;
+
+protected:
+
+    TraceSpan(const char* name, const char* argName, long long arg, bool detail) :
+        tracer(TRACER), name(name), argName(argName), arg(arg), begin(0), detail(detail) {
+        if(tracer != nullptr)
+            begin = tracer->now();
+    }
+
+public:
+
+    /*
+    @param name Name of the span, a string literal.
+    @param argName Name of the count shown with the span, a string literal or null.
+    @param arg Count shown with the span.
+    */
+    TraceSpan(const char* name, const char* argName = nullptr, long long arg = 0) :
+        TraceSpan(name, argName, arg, false) { }
+
+    ~TraceSpan(){
+        if(tracer == nullptr)
+            return;
+
+        TraceBuffer* b = tracer->buffer();
+        if(detail && !b->sampleDetail(name))
+            return;
+        if(b->events.size() >= (detail ? TRACE_DETAIL_EVENTS_PER_THREAD : TRACE_EVENTS_PER_THREAD)){
+            b->dropped++;
+            return;
+        }
+
+        TraceEvent e;
+        e.name = name;
+        e.argName = argName;
+        e.arg = arg;
+        e.begin = begin;
+        e.duration = tracer->now() - begin;
+        b->events.push_back(e);
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+//span of work done once per variant, set or chunk, sampled and dropped before the spans of the stages
+class TraceDetail : public TraceSpan {
+public:
+    TraceDetail(const char* name, const char* argName = nullptr, long long arg = 0) :
+        TraceSpan(name, argName, arg, true) { }
+};
+
+//names the calling thread in the trace, if there is one
+inline void traceThreadName(std::string name){
+    if(TRACER != nullptr)
+        TRACER->nameThread(name);
+}
@@ -7,6 +7,8 @@
 #include <string>
 #include <iostream>
 
+//bookkeeping of one std::map node (colour, parent and two children), used by memoryUsage
+static const size_t MAP_NODE_BYTES = 4 * sizeof(void*);
 
 struct Variant {
 private:
@@ -22,6 +24,10 @@ private:
     Filter filter;
     bool shrunk;
 
+    //byte offset just past the VCF line and number of variant lines up to it, used by checkpoints
+    uint64_t vcfEnd = 0;
+    uint64_t vcfLine = 0;
+
 public:
 
     Variant(std::string chromosome, int position, std::string unique_id, std::string reference, std::string alternative) :
@@ -54,6 +60,9 @@ public:
     }
 
     inline void setFilter(Filter f) { this->filter = f; }
+    inline void setVCFLocation(uint64_t end, uint64_t line) { vcfEnd = end; vcfLine = line; }
+    inline uint64_t getVCFEnd() { return vcfEnd; }
+    inline uint64_t getVCFLine() { return vcfLine; }
 
     inline std::string getChromosome() { return this->chrom; }
     inline std::string getRef() { return this->ref; }
@@ -101,6 +110,15 @@ public:
     }
     inline bool hasGenotypes(){ return !shrunk && genotypes.size()>0; }
 
+    //approximate number of bytes held by the variant, genotype vectors included
+    inline size_t memoryUsage(){
+        size_t bytes = sizeof(Variant) + chrom.capacity() + id.capacity() + ref.capacity() + alt.capacity();
+        for(auto const& gt : genotypes)
+            bytes += MAP_NODE_BYTES + sizeof(gt) + static_cast<size_t>(gt.second.size()) * sizeof(double);
+        bytes += P.size() * (MAP_NODE_BYTES + sizeof(std::pair<GenotypeSource, Vector3d>));
+        return bytes;
+    }
+
 };
 
 inline bool variantCompare(Variant lhs, Variant rhs) { return lhs < rhs; }
@@ -110,6 +128,7 @@ private:
     std::vector<Variant> variants;
     std::vector<double> pval;
     int nvalid = 0;
+    int sequence = 0;
     Interval *interval;
     bool hasInterval = false;
     bool shrunk = false;
@@ -118,6 +137,28 @@ public:
     VariantSet() { }
 
     inline void setInterval(Interval * inv) { interval = inv; hasInterval = true;}
+    inline void setSequence(int i) { sequence = i; }
+    inline int getSequence() { return sequence; }
+    //sequences count from where the run started reading, which for a shard may be its own first
+    //set; the offset in the VCF names a set the same way in every run, simulated sets have none
+    inline uint64_t getKey() { return (getFirstVCFEnd() > 0) ? getFirstVCFEnd() : static_cast<uint64_t>(sequence); }
+    //names a set by its variants (FNV-1a of chrom:pos:ref:alt of each), so its bootstrap draws do not
+    //change with the VCF header, the shard or the order of the sets; simulated sets use their sequence
+    inline uint64_t getRandomKey() {
+        if(getFirstVCFEnd() < 1)
+            return static_cast<uint64_t>(sequence);
+
+        uint64_t hash = 14695981039346656037ULL;
+        for(Variant& v : variants){
+            std::string name = v.getChromosome() + ":" + std::to_string(v.getPosition()) + ":" + v.getRef() + ":" + v.getAlt() + ";";
+            for(unsigned char c : name){
+                hash ^= c;
+                hash *= 1099511628211ULL;
+            }
+        }
+        return hash;
+    }
+    inline std::string getSetID() { return hasInterval ? interval->id : std::to_string(sequence); }
     inline bool isIn(Variant &variant) { return interval->isIn(variant.getChromosome(), variant.getPosition()); }
 
     inline void addVariant(Variant &variant) {
@@ -126,6 +167,11 @@ public:
     }
 
     inline std::vector<Variant>* getVariants() { return &variants; }
+    //the VCF can be read again from here without touching this set
+    inline uint64_t getVCFEnd() { return (variants.size() < 1) ? 0 : variants.back().getVCFEnd(); }
+    inline uint64_t getVCFLine() { return (variants.size() < 1) ? 0 : variants.back().getVCFLine(); }
+    //decides the shard of the set
+    inline uint64_t getFirstVCFEnd() { return (variants.size() < 1) ? 0 : variants[0].getVCFEnd(); }
     inline std::string getChromosome() { return (variants.size() < 1) ? "na" : variants[0].getChromosome(); }
     inline int getMinPos() {
         for(size_t i = 0; i < variants.size(); i++)
@@ -194,6 +240,13 @@ public:
 
     inline bool hasGenotypes(){ return !shrunk; }
 
+    inline size_t memoryUsage(){
+        size_t bytes = sizeof(VariantSet) + pval.capacity() * sizeof(double);
+        for(size_t i = 0; i < variants.size(); i++)
+            bytes += variants[i].memoryUsage();
+        return bytes;
+    }
+
     inline std::string toString(std::string test, int pvalIndex, int setID){
 
         std::string str = "";
@@ -0,0 +1,273 @@
+#include "../vikNGS.h"
+#include "../Math/CompQuadForm.h"
+#include "../Math/RandomStream.h"
+#include "../Test/Test.h"
+#include "../Test/TestObject.h"
+#include "../Test/ScoreTestFunctions.h"
+
+#include <iostream>
+
+//========================================================
+// Unit checks of the numerical building blocks against
+// known values, run by "make check" before the end to end
+// comparison. Reference values come from published test
+// vectors, closed forms of the distributions, or the code
+// the optimized version replaced.
+//
+// Usage: ./vikNGScheck
+// Exits with 1 if any check fails.
+//========================================================
+
+static bool FAILED = false;
+
+static void report(std::string name, bool pass){
+    std::cout << (pass ? "PASS " : "FAIL ") << name << std::endl;
+    if(!pass)
+        FAILED = true;
+}
+
+static bool close(double value, double expected, double relative){
+    return std::fabs(value - expected) <= relative * std::fabs(expected);
+}
+
+static bool close(const MatrixXd& value, const MatrixXd& expected, double relative){
+    if(value.rows() != expected.rows() || value.cols() != expected.cols())
+        return false;
+    return (value - expected).cwiseAbs().maxCoeff() <= relative * expected.cwiseAbs().maxCoeff();
+}
+
+// -------------------------------------
+// Philox4x32-10, vectors of the Random123 distribution (kat_vectors)
+
+static void checkPhilox(){
+    const uint32_t vectors[3][10] = {
+        { 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+          0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 },
+        { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+          0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd },
+        { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344, 0xa4093822, 0x299f31d0,
+          0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 }
+    };
+
+    bool pass = true;
+    for(const uint32_t* v : vectors){
+        uint32_t out[4];
+        RandomStream::philox(v, v + 4, out);
+        for(int i = 0; i < 4; i++)
+            pass = pass && out[i] == v[6 + i];
+    }
+    report("Philox4x32-10 known answers", pass);
+
+    //a zero key and iteration start from the zero counter
+    RandomKey key = { 0, 0, 0 };
+    RandomStream rng(key, 0);
+    pass = true;
+    for(int i = 0; i < 4; i++)
+        pass = pass && rng.next() == vectors[0][6 + i];
+    report("RandomStream draws the Philox blocks", pass);
+}
+
+// -------------------------------------
+// chi-squared tails, from the closed forms for 1 to 4 degrees of freedom:
+// df 1 erfc(sqrt(x/2)), df 2 exp(-x/2), df 3 adds sqrt(2x/pi) exp(-x/2),
+// df 4 exp(-x/2)(1 + x/2), and with non-centrality d and df 1 (or 3)
+// Q(sqrt(x) - sqrt(d)) + Q(sqrt(x) + sqrt(d)) (+ (phi(.) - phi(.)) / sqrt(d))
+
+static void checkChiSquare(){
+    const double tails[][4] = {
+        //statistic, df, non-centrality, P[X > statistic]
+        { 0.5, 1, 0, 0.4795001221869535 },
+        { 3.841458820694124, 1, 0, 0.05 },
+        { 10.827566170662733, 1, 0, 0.001 },
+        { 30, 1, 0, 4.320463057827492e-08 },
+        { 1, 2, 0, 0.6065306597126334 },
+        { 10, 2, 0, 0.006737946999085467 },
+        { 2, 3, 0, 0.5724067044708798 },
+        { 7.814727903251178, 3, 0, 0.05 },
+        { 3, 4, 0, 0.5578254003710745 },
+        { 20, 4, 0, 0.0004993992273873334 },
+        { 4, 1, 1.5, 0.21972488403378543 },
+        { 12, 1, 3, 0.04163236005950594 },
+        { 5, 3, 2, 0.40659481991684443 },
+        { 20, 3, 6, 0.04261508455007085 }
+    };
+
+    bool pass = true;
+    for(const double* t : tails)
+        if(!close(chiSquareUpperTail(t[0], t[1], t[2]), t[3], 1e-10)){
+            std::cout << "  chiSquareUpperTail(" << t[0] << ", " << t[1] << ", " << t[2] << ") = "
+                      << chiSquareUpperTail(t[0], t[1], t[2]) << ", expected " << t[3] << std::endl;
+            pass = false;
+        }
+    report("chiSquareUpperTail against closed forms", pass);
+
+    //1 - the lower tail, accurate to an absolute 1e-14 like its floor
+    pass = true;
+    for(const double* t : tails)
+        if(t[1] == 1 && t[2] == 0 && std::fabs(chiSquareOneDOF(t[0]) - t[3]) > 1e-14)
+            pass = false;
+    report("chiSquareOneDOF against closed forms", pass);
+}
+
+// -------------------------------------
+// Liu's approximation: with equal weights Q is a scaled chi-squared and the
+// approximation is exact, otherwise the reference evaluates the moment matching
+// of Liu et al. (2009) with the non-central tail integrated numerically
+
+static void checkLiu(){
+    CQF cqf;
+    bool pass = close(cqf.liu(std::vector<double>(3, 1.0), 7.814727903251178), 0.05, 1e-9) &&
+                close(cqf.liu(std::vector<double>(3, 2.0), 2 * 7.814727903251178), 0.05, 1e-9) &&
+                close(cqf.liu(std::vector<double>(4, 0.5), 1.5), 0.5578254003710745, 1e-9);
+    report("Liu's approximation is exact for equal weights", pass);
+
+    pass = close(cqf.liu({ 2.0, 1.0, 0.5 }, 6), 0.16613520468975873, 1e-9) &&
+           close(cqf.liu({ 3.0, 1.0, 0.25, 0.25 }, 15), 0.037446907123005, 1e-9);
+    report("Liu's approximation against reference values", pass);
+}
+
+// -------------------------------------
+// saddlepoint p-value of S = sum (y_i - p) for y_i ~ Bernoulli(p), where the
+// Lugannani-Rice tails have a closed form: with p' = p + q/n the saddlepoint is
+// log(p'(1 - p) / (p(1 - p'))) and K'' = n p'(1 - p')
+
+static void checkSaddlepoint(){
+    const double cases[][4] = {
+        //samples, p, |score|, two-sided p-value
+        { 200, 0.1, 15, 0.000584606484229511 },
+        { 500, 0.3, 40, 9.591754289680338e-05 }
+    };
+
+    bool pass = true;
+    for(const double* c : cases){
+        int n = static_cast<int>(c[0]);
+        VectorXd g = VectorXd::Ones(n);
+        VectorXd mu = VectorXd::Constant(n, c[1]);
+        pass = pass && close(saddlepointPvalue(c[2], g, mu), c[3], 1e-8) && close(saddlepointPvalue(-c[2], g, mu), c[3], 1e-8);
+    }
+    report("saddlepointPvalue against the binomial closed form", pass);
+
+    //within two standard deviations of the mean the score test is used
+    VectorXd g = VectorXd::Ones(200);
+    VectorXd mu = VectorXd::Constant(200, 0.1);
+    report("saddlepointPvalue near the mean", close(saddlepointPvalue(5, g, mu), chiSquareOneDOF(25 / 18.0), 1e-12));
+}
+
+// -------------------------------------
+// logistic regression, against the Newton iterations with an inverted Hessian
+// that the IRLS/LDLT fit replaced
+
+static VectorXd invertedHessianFit(VectorXd& Y, MatrixXd& X){
+    VectorXd beta = VectorXd::Zero(X.cols());
+
+    for(int iteration = 0; iteration <= 50; iteration++){
+        VectorXd p(X.rows());
+        for(int i = 0; i < X.rows(); i++)
+            p[i] = 1 / (1 + std::exp(-X.row(i).dot(beta)));
+
+        VectorXd first = X.transpose() * (Y - p);
+        MatrixXd hess = -X.transpose() * (p.array() * (1 - p.array())).matrix().asDiagonal() * X;
+
+        VectorXd last = beta;
+        beta = last - hess.inverse() * first;
+        if((beta - last).cwiseAbs().maxCoeff() <= 1e-7)
+            break;
+    }
+    return beta;
+}
+
+static void checkLogisticRegression(){
+    RandomKey key = { 11, 1, 0 };
+    RandomStream rng(key, 0);
+
+    int n = 500;
+    MatrixXd X(n, 3);
+    VectorXd Y(n);
+    for(int i = 0; i < n; i++){
+        X(i, 0) = 1;
+        X(i, 1) = rng.uniform() * 4 - 2;
+        X(i, 2) = rng.uniformInt(0, 2);
+        double eta = -0.5 + 0.8 * X(i, 1) - 0.3 * X(i, 2);
+        Y[i] = (rng.uniform() < 1 / (1 + std::exp(-eta))) ? 1 : 0;
+    }
+
+    VectorXd expected = invertedHessianFit(Y, X);
+    report("logisticRegression against the inverted Hessian fit", close(logisticRegression(Y, X), expected, 1e-8));
+
+    //a warm start converges to the same coefficients
+    IRLSWorkspace ws;
+    VectorXd beta = expected * 0.5;
+    logisticRegression(Y, X, beta, ws);
+    report("logisticRegression from a warm start", close(beta, expected, 1e-8));
+}
+
+// -------------------------------------
+// variance components of the batched bootstrap, weighted by getVarianceWeights,
+// against the regular and robust variance of the serial path
+
+static void checkVarianceComponents(){
+    RandomKey key = { 12, 1, 0 };
+    RandomStream rng(key, 0);
+
+    int n = 300, k = 4;
+    MatrixXd X(n, k);
+    VectorXd binary(n), continuous(n);
+    VectorXi G(n);
+    for(int i = 0; i < n; i++){
+        G[i] = (i < n / 3) ? 0 : 1;
+        for(int j = 0; j < k; j++)
+            X(i, j) = (rng.uniform() < 0.1 * (j + 1)) ? rng.uniformInt(1, 2) : 0;
+        binary[i] = (rng.uniform() < 0.3) ? 1 : 0;
+        continuous[i] = rng.uniform() * 3 + X(i, 0);
+    }
+
+    MatrixXd P(k, 3);
+    for(int j = 0; j < k; j++){
+        for(int a = 0; a < 3; a++)
+            P(j, a) = (X.col(j).array() == a).count() / static_cast<double>(n);
+    }
+
+    std::map<int, Depth> depths;
+    depths[0] = Depth::HIGH;
+    depths[1] = Depth::LOW;
+
+    struct Case { std::string name; Family family; Variance variance; bool rvsFalse; };
+    std::vector<Case> cases = {
+        { "regular, case-control", Family::BINOMIAL, Variance::REGULAR, false },
+        { "regular, quantitative", Family::NORMAL, Variance::REGULAR, false },
+        { "robust, case-control", Family::BINOMIAL, Variance::RVS, false },
+        { "robust, quantitative", Family::NORMAL, Variance::RVS, false },
+        { "robust without RVS, case-control", Family::BINOMIAL, Variance::RVS, true }
+    };
+
+    for(Case& c : cases){
+        Group group(G, depths);
+        Genotype geno(X, P, GenotypeSource::EXPECTED);
+        Phenotype pheno(c.family == Family::BINOMIAL ? binary : continuous, c.family);
+        TestObject o(geno, pheno, group, true);
+
+        TestSettings test(GenotypeSource::EXPECTED, Statistic::SKAT, c.variance);
+        if(c.rvsFalse)
+            test.setRVSFalse();
+
+        std::vector<MatrixXd> components = getVarianceComponents(o, test, c.family);
+        VectorXd weights = getVarianceWeights(o, *o.getYcenter(), test, c.family);
+        MatrixXd variance = MatrixXd::Zero(k, k);
+        for(size_t g = 0; g < components.size(); g++)
+            variance += weights[static_cast<int>(g)] * components[g];
+
+        report("getVarianceComponents, " + c.name, close(variance, getVarianceMatrix(o, test, c.family), 1e-10));
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    checkPhilox();
+    checkChiSquare();
+    checkLiu();
+    checkSaddlepoint();
+    checkLogisticRegression();
+    checkVarianceComponents();
+
+    return FAILED ? 1 : 0;
+}
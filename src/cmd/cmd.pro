@@ -41,6 +41,7 @@ SOURCES += \
     ../Math/GeneticsHelper.cpp \
     ../Parser/BEDParser.cpp \
     ../Test/Test.cpp \
+    ../Test/CommonTest.cpp \
     ../Global.cpp \
     ../Test/ScoreTestFunctions.cpp \
     Log.cpp \
@@ -248,7 +249,12 @@ HEADERS += \
     ../Eigen/src/SVD/UpperBidiagonalization.h \
     ../Parser/MemoryMapped/MemoryMapped.h \
     ../Variant.h \
+    ../Output/Checkpoint.h \
     ../Output/OutputHandler.h \
+    ../Output/ResultWriter.h \
+    ../Output/RunReport.h \
+    ../Output/ShardInfo.h \
+    ../Output/SummaryStatistics.h \
     ../Request.h \
     ../Parser/File.h \
     ../vikNGS.h \
@@ -256,10 +262,17 @@ HEADERS += \
     ../Parser/Parser.h \
     ../Parser/Filter.h \
     ../Math/Math.h \
+    ../Math/RandomStream.h \
     ../Interval.h \
     ../Test/Test.h \
     ../Test/TestObject.h \
     ../Log.h \
+    ../BlockingQueue.h \
+    ../MemoryBudget.h \
+    ../PerfCounters.h \
+    ../PipelineStats.h \
+    ../ThreadPool.h \
+    ../Trace.h \
     ../Math/CompQuadForm.h \
     ../Test/ScoreTestFunctions.h \
     ../Test/Group.h \
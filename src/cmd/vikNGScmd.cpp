@@ -13,8 +13,98 @@ std::string lower (std::string str){
 }
 
 
+/*
+vikNGS recompute: p-values from summary statistics files written with --export.
+*/
+int recompute(int argc, char* argv[]) {
+
+    CLI::App app{ "Recompute vikNGS p-values from exported summary statistics" };
+
+    std::vector<std::string> summaryFiles;
+    CLI::Option *f = app.add_option("summary", summaryFiles, "Summary statistics files written with --export, one per shard of a run split with --shard (required)");
+    f->required();
+    f->check(CLI::ExistingFile);
+
+    std::string stat = "skat";
+    app.add_option("-r,--rare", stat, "Test to recompute: cast, skat, skato or calpha (default = skat)", "skat");
+
+    double daviesThreshold = 0.05;
+    CLI::Option *dt = app.add_option("--davies-threshold", daviesThreshold, "SKAT, C-alpha and SKAT-O p-values are approximated with Liu's method and only recalculated with Davies' method below this value (1 = always use Davies). P-values kept from Liu's method can differ from Davies' by a few percent, the log counts the p-values from each method", 0.05);
+    dt->check(CLI::Range(0.0, 1.0));
+
+    double daviesAcc = 1e-4;
+    CLI::Option *da = app.add_option("--davies-acc", daviesAcc, "Accuracy of Davies' method, larger values are faster but less precise", 1e-4);
+    da->check(CLI::Range(1e-12, 0.1));
+
+    int daviesLim = 10000;
+    CLI::Option *dl = app.add_option("--davies-lim", daviesLim, "Maximum number of integration terms for Davies' method, Liu's approximation is used if exceeded", 10000);
+    dl->check(CLI::Range(1, 2147483647));
+
+    std::string outputDir = ".";
+    CLI::Option *o = app.add_option("-o,--out", outputDir, "Specify a directory for output (default = current directory)", ".");
+    o->check(CLI::ExistingDirectory);
+
+    CLI11_PARSE(app, argc, argv);
+
+    Request req = getDefaultRequest();
+    if(outputDir.back() == '/')
+        outputDir.pop_back();
+    req.setOutputDir(outputDir);
+
+    //genotype source and variance are read from the file
+    if(lower(stat) == "cast")
+        req.addTest(TestSettings(GenotypeSource::EXPECTED, Statistic::CAST, Variance::REGULAR));
+    else if(lower(stat) == "skato")
+        req.addTest(TestSettings(GenotypeSource::EXPECTED, Statistic::SKATO, Variance::REGULAR));
+    else if(lower(stat) == "calpha")
+        req.addTest(TestSettings(GenotypeSource::EXPECTED, Statistic::CALPHA, Variance::REGULAR));
+    else if(lower(stat) == "skat")
+        req.addTest(TestSettings(GenotypeSource::EXPECTED, Statistic::SKAT, Variance::REGULAR));
+    else
+        throwError("RECOMPUTE", "Unknown test, expected cast, skat, skato or calpha.", stat);
+
+    req.setDaviesThreshold(daviesThreshold);
+    req.setDaviesAccuracy(daviesAcc);
+    req.setDaviesLimit(daviesLim);
+
+    recomputeVikNGS(req, summaryFiles);
+    return 0;
+}
+
+
+/*
+vikNGS merge: one p-value file from the outputs of a run split with --shard.
+*/
+int merge(int argc, char* argv[]) {
+
+    CLI::App app{ "Merge the outputs of vikNGS shards" };
+
+    std::vector<std::string> shardFiles;
+    CLI::Option *f = app.add_option("shards", shardFiles, "Shard information files written next to the outputs of every shard (required)");
+    f->required();
+    f->check(CLI::ExistingFile);
+
+    std::string outputDir = ".";
+    CLI::Option *o = app.add_option("-o,--out", outputDir, "Specify a directory for output (default = current directory)", ".");
+    o->check(CLI::ExistingDirectory);
+
+    CLI11_PARSE(app, argc, argv);
+
+    if(outputDir.back() == '/')
+        outputDir.pop_back();
+
+    mergeShards(shardFiles, outputDir);
+    return 0;
+}
+
+
 int main(int argc, char* argv[]) {
 
+    if(argc > 1 && std::string(argv[1]) == "recompute")
+        return recompute(argc - 1, argv + 1);
+    if(argc > 1 && std::string(argv[1]) == "merge")
+        return merge(argc - 1, argv + 1);
+
     CLI::App app{ "vikNGS Variant Association Toolkit" };
 
     std::string filename = "default";
@@ -26,21 +116,76 @@ int main(int argc, char* argv[]) {
     CLI::Option *r = app.add_option("-r,--rare", rare, "Perform a rare variant association test");
 
     std::string gt = "";
-    CLI::Option *g = app.add_option("-g,--genotype", rare, "Genotype to use");
+    CLI::Option *g = app.add_option("-g,--genotype", gt, "Genotype to use");
 
     // -------------------------------------
 
     // -------------------------------------
     int threads = 1;
-    CLI::Option *t = app.add_option("-t,--threads", threads, "Number of threads", 1);
+    CLI::Option *t = app.add_option("-t,--threads", threads, "Number of worker threads parsing and testing variants. Reading the VCF, collapsing variants into sets and writing results each take one more thread that only waits on the workers, as they follow the VCF order", 1);
 	t->check(CLI::Range(1, 2147483647));
 
+    int parseThreads = 1;
+    CLI::Option *pt = app.add_option("--parse-threads", parseThreads, "Number of VCF batches parsed at the same time by the worker threads", 1);
+    pt->check(CLI::Range(1, 2147483647));
+
+    int testBatches = 0;
+    CLI::Option *tt = app.add_option("--test-batches", testBatches, "Number of test batches in flight at the same time, tested by the worker threads of -t or waiting to be written (default = twice the threads)", 0);
+    tt->check(CLI::Range(0, 2147483647));
+
+    int maxMemory = 0;
+    CLI::Option *mm = app.add_option("--max-memory", maxMemory, "Memory in MB the VCF batches may hold before reading pauses (0 for no limit)", 0);
+    mm->check(CLI::Range(0, 2147483647));
+
+    int checkpointInterval = 0;
+    CLI::Option *ci = app.add_option("--checkpoint", checkpointInterval, "Seconds between checkpoints of the results written so far, needed to --resume an interrupted run (default = 0, none)", 0);
+    ci->check(CLI::Range(0, 2147483647));
+
+    int statsInterval = 0;
+    CLI::Option *si = app.add_option("--stats-interval", statsInterval, "Seconds between progress lines with the throughput and queue depths of the pipeline (default = 0, none)", 0);
+    si->check(CLI::Range(0, 2147483647));
+
+    bool report = false;
+    CLI::Option *rep = app.add_flag("--report", report, "Write the throughput, queue depths, stall times and counters of the run to report_<name>.json in the output directory");
+
+    bool resume = false;
+    CLI::Option *res = app.add_flag("--resume", resume, "Continue the interrupted run in the output directory from its last checkpoint (see --checkpoint)");
+
+    std::string shard = "";
+    CLI::Option *sha = app.add_option("--shard", shard, "Test only part i of N of the VCF, written as i/N (see vikNGS merge)");
+
     int nboot = 1;
     CLI::Option *n = app.add_option("-n,--boot", nboot, "Number of bootstrap iterations to calculate");
     n->check(CLI::Range(0, 2147483647));
 
+    int bootBatch = 64;
+    CLI::Option *nb = app.add_option("--boot-batch", bootBatch, "Number of bootstrap iterations evaluated together in one batch", 64);
+    nb->check(CLI::Range(1, 2147483647));
+
     bool stopEarly = false;
-    CLI::Option *s = app.add_flag("-s,--stop", stopEarly, "Stop bootstrapping if p-value looks to be > 0.05");
+    CLI::Option *s = app.add_flag("-s,--stop", stopEarly, "Stop bootstrapping a variant set once enough bootstrap samples are as extreme as the observed one");
+
+    int stopHits = 10;
+    CLI::Option *sh = app.add_option("--stop-hits", stopHits, "Number of bootstrap samples as extreme as the observed one needed to stop early. Sets get budgets of 100 times this many iterations, then ten times more each time, up to -n", 10);
+    sh->check(CLI::Range(1, 2147483647));
+
+    uint64_t seed = 0;
+    CLI::Option *sd = app.add_option("--seed", seed, "Seed for bootstrap resampling, results are reproducible for a given seed and VCF data as the draws of a set are keyed by the chromosome, position, REF and ALT of its variants (default = random)");
+
+    bool saddlepoint = false;
+    CLI::Option *spa = app.add_flag("--spa", saddlepoint, "Use the saddlepoint approximation for CAST and common variant p-values of case-control data with regular variance (ignored when bootstrapping)");
+
+    double daviesThreshold = 0.05;
+    CLI::Option *dt = app.add_option("--davies-threshold", daviesThreshold, "SKAT, C-alpha and SKAT-O p-values are approximated with Liu's method and only recalculated with Davies' method below this value (1 = always use Davies). P-values kept from Liu's method can differ from Davies' by a few percent, the log and the --report file count the p-values from each method", 0.05);
+    dt->check(CLI::Range(0.0, 1.0));
+
+    double daviesAcc = 1e-4;
+    CLI::Option *da = app.add_option("--davies-acc", daviesAcc, "Accuracy of Davies' method, larger values are faster but less precise", 1e-4);
+    da->check(CLI::Range(1e-12, 0.1));
+
+    int daviesLim = 10000;
+    CLI::Option *dl = app.add_option("--davies-lim", daviesLim, "Maximum number of integration terms for Davies' method, Liu's approximation is used if exceeded", 10000);
+    dl->check(CLI::Range(1, 2147483647));
     // -------------------------------------
 
     // -------------------------------------
@@ -69,7 +214,7 @@ int main(int argc, char* argv[]) {
     d->check(CLI::Range(1, 2147483647));
 
     double missing = 0.1;
-    CLI::Option *x = app.add_option("-x,--missing", missing, "Missing data cut-off (variants with a proportion of missing data more than this threshold will not be tested)", 0.1);
+    CLI::Option *x = app.add_option("-x,--missing", missing, "Missing data cut-off (variants with a proportion of missing data more than this threshold will not be tested, for case-control data among the cases or controls of any phenotype)", 0.1);
     x->check(CLI::Range(0.0, 0.5));
 
     bool mustPass = false;
@@ -93,6 +238,15 @@ int main(int argc, char* argv[]) {
     bool showFiltered = false;
     CLI::Option *filt = app.add_flag("--explain-filter", showFiltered, "Output explaination for filtered variants");
 
+    std::string summaryFile = "";
+    CLI::Option *ex = app.add_option("--export", summaryFile, "Write the score vector and variance matrix of every tested set to this file (see vikNGS recompute)");
+
+    bool perfCounters = false;
+    CLI::Option *pc = app.add_flag("--perf-counters", perfCounters, "Count cycles, instructions, LLC misses and branch misses of the parse, EM, variance and CQF kernels with Linux perf events, or task clock and page faults where there is no PMU (slows down small kernels)");
+
+    std::string traceFile = "";
+    CLI::Option *tr = app.add_option("--trace", traceFile, "Write a timeline of the parse, collapse, test and output spans of every thread to this file in Chrome trace format");
+
     // -------------------------------------
 
     // -------------------------------------
@@ -157,8 +311,16 @@ int main(int argc, char* argv[]) {
     if(nboot > 1){
         req.setBootstrap(nboot);
         req.setStopEarly(stopEarly);
+        req.setStopHits(stopHits);
+        req.setBootstrapBatchSize(bootBatch);
+        if(sd->count() > 0)
+            req.setSeed(seed);
+        //a resumed run takes the seed of its checkpoint
+        if(!resume)
+            printInfo("Random seed: " + std::to_string(req.getSeed()));
         if(stopEarly)
-            printInfo("Using " + std::to_string(nboot) + " bootstrap iterations and early stopping");
+            printInfo("Using up to " + std::to_string(nboot) + " bootstrap iterations, stopping after " +
+                      std::to_string(stopHits) + " exceedances");
         else
             printInfo("Using " + std::to_string(nboot)  + " bootstrap iterations");
     }
@@ -177,6 +339,20 @@ int main(int argc, char* argv[]) {
             printInfo("Preparing to run rare variant association (CAST p-values, expected GT/vRVS)...");
         }
     }
+    else if(lower(rare) == "skato"){
+        if(lower(gt) == "call"){
+            req.addTest(TestSettings(GenotypeSource::CALL, Statistic::SKATO, Variance::REGULAR));
+            printInfo("Preparing to run rare variant association (SKAT-O p-values, called genotypes)...");
+        }
+        else if(lower(gt) == "vcf"){
+            req.addTest(TestSettings(GenotypeSource::VCF_CALL, Statistic::SKATO, Variance::RVS));
+            printInfo("Preparing to run rare variant association (SKAT-O p-values, VCF GT)...");
+        }
+        else{
+            req.addTest(TestSettings(GenotypeSource::EXPECTED, Statistic::SKATO, Variance::REGULAR));
+            printInfo("Preparing to run rare variant association (SKAT-O p-values, expected GT/vRVS)...");
+        }
+    }
     else if(lower(rare) == "skat"){
         if(lower(gt) == "call"){
             req.addTest(TestSettings(GenotypeSource::CALL, Statistic::SKAT, Variance::REGULAR));
@@ -191,6 +367,20 @@ int main(int argc, char* argv[]) {
             printInfo("Preparing to run rare variant association (SKAT p-values, expected GT/vRVS)...");
         }
     }
+    else if(lower(rare) == "calpha"){
+        if(lower(gt) == "call"){
+            req.addTest(TestSettings(GenotypeSource::CALL, Statistic::CALPHA, Variance::REGULAR));
+            printInfo("Preparing to run rare variant association (C-alpha p-values, called genotypes)...");
+        }
+        else if(lower(gt) == "vcf"){
+            req.addTest(TestSettings(GenotypeSource::VCF_CALL, Statistic::CALPHA, Variance::RVS));
+            printInfo("Preparing to run rare variant association (C-alpha p-values, VCF GT)...");
+        }
+        else{
+            req.addTest(TestSettings(GenotypeSource::EXPECTED, Statistic::CALPHA, Variance::REGULAR));
+            printInfo("Preparing to run rare variant association (C-alpha p-values, expected GT/vRVS)...");
+        }
+    }
     else{
         if(lower(gt) == "call"){
             req.addTest(TestSettings(GenotypeSource::CALL, Statistic::COMMON, Variance::REGULAR));
@@ -206,6 +396,22 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    req.setSaddlepoint(saddlepoint);
+    if(saddlepoint){
+        if(nboot > 1)
+            printWarning("Saddlepoint approximation is not used with bootstrap p-values");
+        else
+            printInfo("Using the saddlepoint approximation for case-control CAST and common variant p-values");
+    }
+
+    req.setDaviesThreshold(daviesThreshold);
+    if(dt->count() > 0)
+        printInfo("Davies' method used for SKAT and C-alpha p-values below " + std::to_string(daviesThreshold));
+    req.setDaviesAccuracy(daviesAcc);
+    req.setDaviesLimit(daviesLim);
+    if(da->count() > 0 || dl->count() > 0)
+        printInfo("Davies' method accuracy: " + std::to_string(daviesAcc) + ", limit: " + std::to_string(daviesLim));
+
     if(collapse > 2){
         printInfo("Collapse every " + std::to_string(collapse) + " variants");
         req.setCollapse(collapse);
@@ -234,8 +440,54 @@ int main(int argc, char* argv[]) {
     }
     req.setNumberThreads(threads);
 
+    if(parseThreads != 1)
+        printInfo("Parsing up to " + std::to_string(parseThreads) + " batches at the same time");
+    req.setParseThreads(parseThreads);
+
+    if(tt->count() > 0 && testBatches > 0)
+        printInfo("Testing up to " + std::to_string(testBatches) + " batches at the same time");
+    req.setTestBatches(testBatches);
+
+    if(maxMemory > 0)
+        printInfo("Memory budget: " + std::to_string(maxMemory) + " MB");
+    req.setMaxMemory(maxMemory);
+
+    req.setCheckpointInterval(checkpointInterval);
+    req.setStatsInterval(statsInterval);
+    req.setReport(report);
+    req.setResume(resume);
+
+    if(shard.size() > 0){
+        size_t slash = shard.find('/');
+        int index = 0, count = 0;
+        try {
+            if(slash == std::string::npos)
+                throw std::invalid_argument(shard);
+            index = std::stoi(shard.substr(0, slash));
+            count = std::stoi(shard.substr(slash + 1));
+        } catch(...) {
+            throwError("MAIN", "Shard should be written as i/N.", shard);
+        }
+        req.setShard(index - 1, count);
+    }
+
     req.setKeepFiltered(showFiltered);
 
+    if(summaryFile.size() > 0){
+        printInfo("Exporting summary statistics to " + summaryFile);
+        req.setSummaryFile(summaryFile);
+    }
+
+    if(perfCounters)
+        printInfo("Counting hardware events of the kernels");
+    req.setPerfCounters(perfCounters);
+
+    if(traceFile.size() > 0){
+        printInfo("Tracing to " + traceFile);
+        req.setTraceFile(traceFile);
+    }
+
+    req.validate();
     startVikNGS(req);
     return 0;
 }
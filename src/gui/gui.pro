@@ -48,6 +48,7 @@ SOURCES += \
     ../Math/GeneticsHelper.cpp \
     ../Parser/BEDParser.cpp \
     ../Test/Test.cpp \
+    ../Test/CommonTest.cpp \
     src/windows/PlotWindowPlotter.cpp \
     src/simulation/Simulation.cpp \
     src/windows/SimPlotWindowPlotter.cpp \
@@ -265,7 +266,12 @@ HEADERS += \
     ../Eigen/src/SVD/UpperBidiagonalization.h \
     ../Parser/MemoryMapped/MemoryMapped.h \
     ../Variant.h \
+    ../Output/Checkpoint.h \
     ../Output/OutputHandler.h \
+    ../Output/ResultWriter.h \
+    ../Output/RunReport.h \
+    ../Output/ShardInfo.h \
+    ../Output/SummaryStatistics.h \
     ../Request.h \
     ../Parser/File.h \
     ../vikNGS.h \
@@ -277,11 +283,18 @@ HEADERS += \
     ../Parser/Parser.h \
     ../Parser/Filter.h \
     ../Math/Math.h \
+    ../Math/RandomStream.h \
     ../Interval.h \
     ../Test/Test.h \
     ../Test/TestObject.h \
     src/windows/Chromosome.h \
     ../Log.h \
+    ../BlockingQueue.h \
+    ../MemoryBudget.h \
+    ../PerfCounters.h \
+    ../PipelineStats.h \
+    ../ThreadPool.h \
+    ../Trace.h \
     ../Math/CompQuadForm.h \
     src/windows/TableDisplayWindow.h \
     src/simulation/Simulation.h \
@@ -131,6 +131,12 @@ Data startSimulation(SimulationRequest& simReq) {
     if(STOP_RUNNING_THREAD)
         return result;
 
+    //one seed drives both the simulated data and the bootstrap streams
+    if(simReq.seed == 0)
+        simReq.seed = randomSeed();
+    printInfo("Random seed: " + std::to_string(simReq.seed));
+    seedRandom(simReq.seed);
+
     SampleInfo info;
 
     info.setFamily(fam);
@@ -165,6 +171,7 @@ Data startSimulation(SimulationRequest& simReq) {
         }
 
         VariantSet vs;
+        vs.setSequence(static_cast<int>(result.variants.size()));
         result.variants.push_back(vs);
 
         for (int j = 0; j < simReq.collapse; j++){
@@ -241,6 +248,8 @@ Data startSimulation(SimulationRequest& simReq) {
 
         for(size_t j = 0; j < tests.size(); j++){
             tests[j].setSampleSize(simReq.nsamp(i));
+            tests[j].setSeed(simReq.seed);
+            tests[j].setIndex(static_cast<int>(i * tests.size() + j));
             result.tests.push_back(tests[j]);
 
             VectorXd ones = VectorXd::Constant(Z.rows(), 1);
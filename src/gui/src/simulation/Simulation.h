@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <cstdint>
 
 static const std::string ERROR_SOURCE = "SIMULATION_REQUEST";
 
@@ -98,6 +99,7 @@ struct SimulationRequest {
     int collapse = 1;
     bool stopEarly;
     int nthreads = 1;
+    uint64_t seed = 0; //0 draws a random seed
 
     inline bool underNull(){
         double epsilon = 1e-8;
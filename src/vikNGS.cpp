@@ -2,15 +2,68 @@
 #include "Parser/Parser.h"
 #include "Test/Test.h"
 #include "Output/OutputHandler.h"
+#include "Output/SummaryStatistics.h"
+#include "Output/Checkpoint.h"
+#include "Output/ShardInfo.h"
+#include "Output/RunReport.h"
+#include "PipelineStats.h"
+#include "Trace.h"
+#include "PerfCounters.h"
 #include "Log.h"
+#include "ThreadPool.h"
 
 #include <chrono>
+#include <algorithm>
+#include <memory>
+
+/*
+Objects of a run that the globals THREAD_POOL, SUMMARY_WRITER, TRACER and PERF_COUNTERS
+point at. The workers are joined before the globals are cleared and the rest is destroyed,
+on every way out of startVikNGS, so a run that throws leaves no global pointing at a freed
+object for the next run of the GUI.
+*/
+struct RunGlobals {
+    std::unique_ptr<Tracer> tracer;
+    std::unique_ptr<PerfCounters> counters;
+    std::unique_ptr<SummaryWriter> summary;
+    std::unique_ptr<ThreadPool> pool;
+
+    //joins the workers and clears the globals, the tracer and counters are kept for reporting
+    inline void release(){
+        pool.reset();
+        THREAD_POOL = nullptr;
+        SUMMARY_WRITER = nullptr;
+        TRACER = nullptr;
+        PERF_COUNTERS = nullptr;
+        summary.reset();
+    }
+
+    ~RunGlobals(){ release(); }
+};
 
 Data startVikNGS(Request req) {
 
     printInfo("Starting vikNGS...");
+    auto runStartTime = std::chrono::high_resolution_clock::now();
 
-    initializeOutputFiles(req.getOutputDir(), req.getRequestName());
+    //a resumed run continues the output files of the interrupted one
+    std::unique_ptr<Checkpoint> checkpoint;
+    if(req.shouldResume()){
+        checkpoint.reset(new Checkpoint(loadCheckpoint(checkpointFile(req.getOutputDir()))));
+        if(checkpoint->vcf != req.getVCFDir())
+            throwError("CHECKPOINT", "Checkpoint was written for another VCF file.", checkpoint->vcf);
+        if(checkpoint->analysis != req.describeAnalysis())
+            throwError("CHECKPOINT", "Checkpoint was written with other test settings, resume with the same options as the interrupted run.",
+                       checkpoint->analysis);
+        //the rest of the run has to draw the bootstrap samples of the same seed
+        if(req.isSeedChosen() && req.getSeed() != checkpoint->seed)
+            throwError("CHECKPOINT", "Checkpoint was written with another seed.", std::to_string(checkpoint->seed));
+        req.setSeed(checkpoint->seed);
+        req.setRequestName(checkpoint->name);
+        printInfo("Resuming run " + checkpoint->name + " with random seed " + std::to_string(checkpoint->seed));
+    }
+    else
+        initializeOutputFiles(req.getOutputDir(), req.getRequestName());
 
     printInfo("Parsing files...");
 
@@ -26,18 +79,248 @@ Data startVikNGS(Request req) {
 
     auto startTime = std::chrono::high_resolution_clock::now();
 
-    result.variants = processVCF(req, result.sampleInfo, result.variantsParsed);
+    RunGlobals run;
+
+    //made before the pool, so its workers are done with their spans when it is destroyed
+    if(req.shouldTrace()){
+        run.tracer.reset(new Tracer(req.getTraceFile()));
+        TRACER = run.tracer.get();
+        traceThreadName("main");
+    }
+
+    //without permission for perf events the run goes on without counters
+    if(req.usePerfCounters()){
+        run.counters.reset(new PerfCounters());
+        if(run.counters->thread() != nullptr){
+            PERF_COUNTERS = run.counters.get();
+            if(run.counters->isSoftware())
+                printWarning("Hardware counters are not available, " + run.counters->getError() +
+                             ". Counting task clock and page faults instead.");
+        }
+        else{
+            printWarning("Perf counters are not available, " + run.counters->getError() +
+                         " (see /proc/sys/kernel/perf_event_paranoid). Continuing without them.");
+            run.counters.reset();
+        }
+    }
+
+    if(req.shouldExportSummary()){
+        run.summary.reset(new SummaryWriter(req.getSummaryFile()));
+        SUMMARY_WRITER = run.summary.get();
+    }
+
+    run.pool.reset(new ThreadPool(req.getNumberThreads() > 1 ? req.getNumberThreads() : 0));
+    THREAD_POOL = (run.pool->size() > 0) ? run.pool.get() : nullptr;
+    resetQuadFormCounts();
+
+    PipelineStats stats;
+    result.variants = processVCF(req, result.sampleInfo, result.variantsParsed, stats, checkpoint.get());
+    run.release();
+
+    std::unique_ptr<Tracer> tracer = std::move(run.tracer);
+    std::unique_ptr<PerfCounters> counters = std::move(run.counters);
+
+    if(counters){
+        if(counters->getFailedThreads() > 0)
+            printWarning("Perf counters could not be opened on " + std::to_string(counters->getFailedThreads()) +
+                         " threads, their work is not counted.");
+        printInfo(std::string(counters->isSoftware() ? "Software" : "Hardware") + " counters of the kernels (parse includes EM):");
+        for(int s = 0; s < PERF_STAGES; s++)
+            printInfo(counters->summary(static_cast<PerfStage>(s)));
+    }
+
+    if(tracer){
+        if(tracer->getDropped() > 0)
+            printWarning(std::to_string(tracer->getDropped()) + " spans were left out of the trace, a thread recorded more than " +
+                         std::to_string(TRACE_EVENTS_PER_THREAD));
+        if(tracer->getSampledOut() > 0)
+            printInfo("Trace keeps one in " + std::to_string(TRACE_DETAIL_SAMPLE) + " EM, CQF and other per set spans after the first " +
+                      std::to_string(TRACE_DETAIL_ALL) + " of each on a thread, " + std::to_string(tracer->getSampledOut()) + " were left out");
+        if(tracer->write())
+            printInfo("Trace written to " + tracer->getPath());
+        else
+            printWarning("Could not open file for writing the trace: " + tracer->getPath());
+    }
 
     auto finishTime = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = finishTime - startTime;
     result.evaluationTime = elapsed.count();
-    result.processingTime = 0;
+    elapsed = finishTime - runStartTime;
+    result.processingTime = elapsed.count();
+
+    QuadFormCounts tiers = getQuadFormCounts();
+    if(tiers.liu + tiers.davies > 0)
+        printInfo("SKAT/C-alpha p-values: " + std::to_string(tiers.liu) + " from Liu's approximation, " +
+                  std::to_string(tiers.davies) + " from Davies' method");
+    bool bootstrap = req.useBootstrap() && req.bootstrapSize() > 1;
+    if(tiers.liu + tiers.davies > 0 && pvalueMethod(result.tests[0], bootstrap, req.getDaviesThreshold()).size() > 0)
+        printInfo(pvalueMethod(result.tests[0], bootstrap, req.getDaviesThreshold()));
+
+    if(req.shouldWriteReport())
+        writeRunReport(reportFile(req.getOutputDir(), req.getRequestName()), req, result, stats, counters.get(), tiers,
+                       STOP_RUNNING_THREAD);
 
-    outputPvals(result.variants, req.getOutputDir(), result.tests, req.getRequestName());
     printInfo("Results written to " + req.getOutputDir());
+    if(req.shouldExportSummary())
+        printInfo("Summary statistics written to " + req.getSummaryFile());
     return result;
 }
 
+/*
+Recalculates p-values from exported summary statistics without reading any genotypes.
+The genotype source and variance of each set come from the file, only the statistics
+of the tests in req are used. Output has the same layout as the p-values of startVikNGS.
+
+@param req Tests, Davies' method settings and output location.
+@param summaryFiles Files written with summary statistics export, the shards of a run
+can be given together.
+*/
+void recomputeVikNGS(Request req, std::vector<std::string> summaryFiles) {
+
+    std::vector<SummaryRecord> records;
+    for(std::string& summaryFile : summaryFiles){
+        printInfo("Reading summary statistics from " + summaryFile);
+
+        SummaryReader reader(summaryFile);
+        SummaryRecord record;
+        while(reader.next(record))
+            records.push_back(record);
+    }
+
+    //records arrive in the order sets finished testing, positions are the same in every shard
+    std::sort(records.begin(), records.end(), [](const SummaryRecord& a, const SummaryRecord& b) {
+        if(a.phenotype != b.phenotype) return a.phenotype < b.phenotype;
+        if(a.position != b.position) return a.position < b.position;
+        if(a.genotype != b.genotype) return a.genotype < b.genotype;
+        return a.varianceType < b.varianceType;
+    });
+
+    uint32_t nphenotypes = 0;
+    for(SummaryRecord& r : records)
+        nphenotypes = std::max(nphenotypes, r.phenotype + 1);
+
+    printInfo("Recomputing " + std::to_string(records.size()) + " variant sets...");
+    resetQuadFormCounts();
+
+    std::ofstream pvals(fileName(req.getOutputDir(), pfile, req.getRequestName()));
+    if(!pvals.is_open())
+        throwError("RECOMPUTE", "Could not open output file.", fileName(req.getOutputDir(), pfile, req.getRequestName()));
+
+    std::vector<TestSettings> tests = req.getTests();
+    if(tests.size() > 0 && pvalueMethod(tests[0], false, req.getDaviesThreshold()).size() > 0)
+        printInfo(pvalueMethod(tests[0], false, req.getDaviesThreshold()));
+
+    for(TestSettings& requested : tests){
+        for(SummaryRecord& r : records){
 
+            TestSettings test(static_cast<GenotypeSource>(r.genotype), requested.getStatistic(), static_cast<Variance>(r.varianceType));
+            test.setDaviesThreshold(req.getDaviesThreshold());
+            test.setDaviesAccuracy(req.getDaviesAccuracy());
+            test.setDaviesLimit(req.getDaviesLimit());
 
+            double pval = evaluateStatistic(test, r.score, r.variance, r.weights);
 
+            std::string label = pvalueLabel(test, static_cast<int>(r.phenotype), static_cast<int>(nphenotypes));
+
+            for(std::string& variant : r.variants){
+                pvals << variant << "\t" << std::to_string(pval) << "\t" << label;
+                if(r.variants.size() > 1)
+                    pvals << "\t" << r.setID;
+                pvals << '\n';
+            }
+        }
+    }
+
+    pvals.close();
+
+    QuadFormCounts tiers = getQuadFormCounts();
+    if(tiers.liu + tiers.davies > 0)
+        printInfo("SKAT/C-alpha p-values: " + std::to_string(tiers.liu) + " from Liu's approximation, " +
+                  std::to_string(tiers.davies) + " from Davies' method");
+
+    printInfo("Results written to " + req.getOutputDir());
+}
+
+static void copyBytes(std::ifstream& in, std::ofstream& out, uint64_t bytes){
+    std::vector<char> buffer(1 << 20);
+    while(bytes > 0 && in){
+        in.read(buffer.data(), static_cast<std::streamsize>(std::min<uint64_t>(bytes, buffer.size())));
+        out.write(buffer.data(), in.gcount());
+        bytes -= static_cast<uint64_t>(in.gcount());
+    }
+}
+
+/*
+Combines the outputs of the shards of one run into p-value and filtered files with the same
+layout as an unsharded run. Every shard holds consecutive sets, so the phenotype blocks of
+the shards are copied in shard order.
+
+@param shardFiles Shard information files, one per shard, in any order.
+@param outputDir Directory for the merged files.
+*/
+void mergeShards(std::vector<std::string> shardFiles, std::string outputDir) {
+
+    std::vector<ShardInfo> shards;
+    std::vector<std::string> dirs;
+    for(std::string& path : shardFiles){
+        shards.push_back(loadShardInfo(path));
+        size_t slash = path.find_last_of('/');
+        dirs.push_back(slash == std::string::npos ? "." : path.substr(0, slash));
+    }
+
+    int count = shards[0].count;
+    size_t nphenotypes = shards[0].pvalueBytes.size();
+    std::vector<int> order(static_cast<size_t>(count), -1);
+
+    for(size_t i = 0; i < shards.size(); i++){
+        ShardInfo& s = shards[i];
+        if(s.count != count || s.vcf != shards[0].vcf || s.vcfSize != shards[0].vcfSize || s.pvalueBytes.size() != nphenotypes)
+            throwError("MERGE", "Shards come from different runs.", shardFiles[i]);
+        if(s.index < 0 || s.index >= count || order[static_cast<size_t>(s.index)] >= 0)
+            throwError("MERGE", "Shard given twice or out of range.", std::to_string(s.index + 1) + "/" + std::to_string(count));
+        order[static_cast<size_t>(s.index)] = static_cast<int>(i);
+
+        uint64_t total = 0;
+        for(uint64_t bytes : s.pvalueBytes)
+            total += bytes;
+        if(fileSize(dirs[i] + "/" + s.pvalues) != total)
+            throwError("MERGE", "P-value file of shard does not match its shard information.", dirs[i] + "/" + s.pvalues);
+    }
+
+    for(int i = 0; i < count; i++)
+        if(order[static_cast<size_t>(i)] < 0)
+            throwError("MERGE", "Missing shard.", std::to_string(i + 1) + "/" + std::to_string(count));
+
+    printInfo("Merging " + std::to_string(count) + " shards...");
+
+    std::ofstream pvals(fileName(outputDir, pfile, ""), std::ios::binary | std::ios::trunc);
+    if(!pvals.is_open())
+        throwError("MERGE", "Could not open output file.", fileName(outputDir, pfile, ""));
+
+    for(size_t p = 0; p < nphenotypes; p++){
+        for(int i = 0; i < count; i++){
+            size_t k = static_cast<size_t>(order[static_cast<size_t>(i)]);
+            ShardInfo& s = shards[k];
+
+            uint64_t offset = 0;
+            for(size_t q = 0; q < p; q++)
+                offset += s.pvalueBytes[q];
+
+            std::ifstream in(dirs[k] + "/" + s.pvalues, std::ios::binary);
+            in.seekg(static_cast<std::streamoff>(offset));
+            copyBytes(in, pvals, s.pvalueBytes[p]);
+        }
+    }
+    pvals.close();
+
+    std::ofstream filtered(fileName(outputDir, ffile, ""), std::ios::binary | std::ios::trunc);
+    for(int i = 0; i < count; i++){
+        size_t k = static_cast<size_t>(order[static_cast<size_t>(i)]);
+        std::string path = dirs[k] + "/" + shards[k].filtered;
+        std::ifstream in(path, std::ios::binary);
+        copyBytes(in, filtered, fileSize(path));
+    }
+    filtered.close();
+
+    printInfo("Results written to " + outputDir);
+}
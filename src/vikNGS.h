@@ -18,6 +18,8 @@ enum class Family;
 enum class Depth;
 enum class Filter;
 enum class CollapseType;
+struct Checkpoint;
+class PipelineStats;
 
 //========================================================
 // Main object that contains all the information
@@ -43,12 +45,43 @@ struct Data {
 //========================================================
 extern bool STOP_RUNNING_THREAD;
 
+//========================================================
+// Pool shared by the running analysis for splitting work
+// inside a single variant set (null if single threaded)
+//========================================================
+class ThreadPool;
+extern ThreadPool* THREAD_POOL;
+
+//========================================================
+// Receives the score and variance of every tested set
+// when summary statistics are exported (otherwise null)
+//========================================================
+class SummaryWriter;
+extern SummaryWriter* SUMMARY_WRITER;
+
+//========================================================
+// Records the spans of the running analysis when a trace
+// file is requested (otherwise null)
+//========================================================
+class Tracer;
+extern Tracer* TRACER;
+
+//========================================================
+// Collects hardware counters of the running analysis when
+// they are requested and allowed (otherwise null)
+//========================================================
+class PerfCounters;
+extern PerfCounters* PERF_COUNTERS;
+
 //========================================================
 // Main functions that have different implementations
 // for command line vs GUI
 //========================================================
 
 Data startVikNGS(Request req);
-std::vector<VariantSet> processVCF(Request &req, SampleInfo &sampleInfo, size_t& totalLineCount);
+std::vector<VariantSet> processVCF(Request &req, SampleInfo &sampleInfo, size_t& totalLineCount, PipelineStats& stats,
+                                   Checkpoint* resumeFrom = nullptr);
+void recomputeVikNGS(Request req, std::vector<std::string> summaryFiles);
+void mergeShards(std::vector<std::string> shardFiles, std::string outputDir);
 
 